@@ -26,979 +26,4880 @@
 
 
 #include "iniplus.hpp"
+#include "iniplus_grammar.hpp"
+#include "iniplus_image.hpp"
 
 #include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 
 namespace iniplus {
 
-class StorageImpl
+/// FNV-1a, used to tell whether the content changed
+class HashSink : public Storage::Sink
+{
+public:
+    HashSink()
+        : Sink()
+        , m_value(0xcbf29ce484222325ULL)
+    {}
+
+    virtual ~HashSink()
+    {}
+
+    virtual bool write(const char *data, size_t size)
+    {
+        uint64_t value = m_value;
+        for (size_t i = 0; i != size; ++i)
+            value = (value ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+        m_value = value;
+        return true;
+    }
+
+    uint64_t value() const
+    {
+        return m_value;
+    }
+
+private:
+    uint64_t m_value;
+};
+
+static bool hash_file(const std::string &path, uint64_t &value)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    HashSink hash;
+    std::vector<char> buffer(256 * 1024);
+    ssize_t count;
+    while ((count = ::read(fd, &buffer[0], buffer.size())) != 0)
+    {
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ::close(fd);
+            return false;
+        }
+        hash.write(&buffer[0], count);
+    }
+    ::close(fd);
+
+    value = hash.value();
+    return true;
+}
+
+static uint64_t mtime_ns(const struct stat &st)
+{
+    return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+bool read_file(const std::string &path, std::string &text, ImageSource *source)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (::fstat(fd, &st))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // one byte more than the file, so the read that sees the end needs no growing
+    text.resize(st.st_size + 1);
+    size_t size = 0;
+    for (;;)
+    {
+        if (size == text.size())
+            text.resize(size * 2);
+
+        ssize_t count = ::read(fd, &text[size], text.size() - size);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ::close(fd);
+            return false;
+        }
+        if (!count)
+            break;
+        size += count;
+    }
+    ::close(fd);
+    text.resize(size);
+
+    if (source)
+    {
+        source->size = size;
+        source->mtime_ns = mtime_ns(st);
+        source->hash = image_hash(text.data(), size);
+    }
+
+    return true;
+}
+
+bool stat_source(const std::string &path, ImageSource &source)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st))
+        return false;
+
+    source.size = st.st_size;
+    source.mtime_ns = mtime_ns(st);
+    source.hash = 0;
+    return true;
+}
+
+/// the regular files of the directory matching the pattern, sorted by name
+static bool list_directory(const std::string &path, const std::string &pattern, std::vector<std::string> &names)
+{
+    DIR *dir = ::opendir(path.c_str());
+    if (!dir)
+        return false;
+
+    while (struct dirent *entry = ::readdir(dir))
+    {
+        if (::fnmatch(pattern.c_str(), entry->d_name, FNM_PERIOD))
+            continue;
+
+        struct stat st;
+        if (::stat((path + '/' + entry->d_name).c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        names.push_back(entry->d_name);
+    }
+    ::closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    return true;
+}
+
+/// makes a rename in the directory of the path durable
+static bool sync_directory(const std::string &path)
+{
+    std::string::size_type slash = path.rfind('/');
+    std::string directory = (slash == path.npos) ? std::string(".") : (slash ? path.substr(0, slash) : std::string("/"));
+
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool result = !::fsync(fd);
+    return !::close(fd) && result;
+}
+
+class BufferGenerator
+{
+public:
+    BufferGenerator(const std::string &buffer)
+        : m_buffer(buffer)
+    {}
+
+    bool operator () (Storage::Sink &sink) const
+    {
+        return sink.write(m_buffer.data(), m_buffer.size()) && sink.flush();
+    }
+
+private:
+    const std::string &m_buffer;
+};
+
+/// the file a symlink points to, so the rename replaces the target and not the link; the path itself otherwise
+static bool resolve_link(const std::string &path, std::string &target)
+{
+    struct stat st;
+    if (::lstat(path.c_str(), &st) || !S_ISLNK(st.st_mode))
+    {
+        target = path;
+        return true;
+    }
+
+    char *resolved = ::realpath(path.c_str(), 0);
+    if (!resolved)
+        return false;
+
+    target = resolved;
+    free(resolved);
+    return true;
+}
+
+/// creates a new file next to the path with the mode less the umask, as open() does
+static int create_temp_file(const std::string &path, mode_t mode, std::string &temp_path)
+{
+    static std::atomic<unsigned> counter(0);
+    for (;;)
+    {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%ld.%u", static_cast<long>(::getpid()), counter.fetch_add(1));
+        temp_path = path + suffix;
+
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if ((fd >= 0) || (errno != EEXIST))
+            return fd;
+    }
+}
+
+/// writes a temporary file next to the target and renames it over the target,
+/// skips the write if the file already has the same size and hash; a symlink is followed
+template <typename Generator>
+static bool replace_file(const std::string &link_path, size_t size, const Generator &generator)
+{
+    std::string path;
+    if (!resolve_link(link_path, path))
+        return false;
+
+    struct stat st;
+    bool exists = !::stat(path.c_str(), &st);
+    if (exists && S_ISREG(st.st_mode) && (static_cast<size_t>(st.st_size) == size))
+    {
+        HashSink hash;
+        generator(hash);
+
+        uint64_t file_hash;
+        if (hash_file(path, file_hash) && (file_hash == hash.value()))
+            return true;
+    }
+
+    std::string temp_path;
+    int fd = create_temp_file(path, 0666, temp_path);
+    if (fd < 0)
+        return false;
+
+    bool result = !exists || !::fchmod(fd, st.st_mode & 07777);
+    if (result)
+    {
+        Storage::FdSink sink(fd, 1024 * 1024);
+        result = generator(sink);
+    }
+    result = result && !::fsync(fd);
+    result = !::close(fd) && result;
+    result = result && !::rename(temp_path.c_str(), path.c_str());
+    if (!result)
+    {
+        ::unlink(temp_path.c_str());
+        return false;
+    }
+
+    return sync_directory(path);
+}
+
+
+/// adds up the heap blocks of the containers, assuming the libstdc++ layouts: a tree node is four pointers plus the entry,
+/// a hash node a pointer plus the entry, a short string lives in its object
+class MemoryCounter
+{
+public:
+    MemoryCounter()
+        : bytes(0)
+        , blocks(0)
+    {}
+
+    template <typename Table>
+    void add_tree_node()
+    {
+        add_block(tree_node_size<Table>());
+    }
+
+    template <typename Table>
+    void add_hash_table(const Table &table)
+    {
+        // a single bucket lives in the table object
+        if (table.bucket_count() > 1)
+            add_block(table.bucket_count() * sizeof(void *));
+        bytes += table.size() * (sizeof(void *) + sizeof(typename Table::value_type));
+        blocks += table.size();
+    }
+
+    void add_string(const std::string &string)
+    {
+        if (!is_local(string))
+            add_block(string.capacity() + 1);
+    }
+
+    template <typename T>
+    void add_vector(const std::vector<T> &vector)
+    {
+        if (vector.capacity())
+            add_block(vector.capacity() * sizeof(T));
+    }
+
+    void add_block(size_t size)
+    {
+        bytes += size;
+        ++blocks;
+    }
+
+    template <typename Table>
+    static size_t tree_node_size()
+    {
+        return 4 * sizeof(void *) + sizeof(typename Table::value_type);
+    }
+
+    static bool is_local(const std::string &string)
+    {
+        const char *data = string.data();
+        const char *object = reinterpret_cast<const char *>(&string);
+        return (data >= object) && (data < object + sizeof(string));
+    }
+
+public:
+    size_t bytes;
+    size_t blocks;
+};
+
+/// orders the section names the way a depth-first walk of the hierarchy meets them, the dot coming before any other character
+class HierarchyLess
+{
+public:
+    HierarchyLess(bool fold)
+        : m_fold(fold)
+    {}
+
+    bool operator () (const std::string &left, const std::string &right) const
+    {
+        size_t m = std::min(left.length(), right.length());
+        for (size_t i = 0; i != m; ++i)
+            if (rank(left[i]) != rank(right[i]))
+                return rank(left[i]) < rank(right[i]);
+
+        return left.length() < right.length();
+    }
+
+private:
+    unsigned rank(char c) const
+    {
+        if (c == '.')
+            return 0;
+        return (m_fold ? fold_char(c) : static_cast<unsigned char>(c)) + 1u;
+    }
+
+private:
+    bool m_fold;
+};
+
+/// trie over the dot-separated components of the section names
+class HierarchyIndex
+{
+private:
+    typedef struct Node
+    {
+        Node(const NameLess &less)
+            : is_section(false)
+            , parent(0)
+            , children(less)
+        {}
+
+        std::string name; // the full path
+        bool is_section;
+        Node *parent;
+        std::map<std::string, Node, NameLess> children; // by component
+    } Node;
+
+public:
+    /// the components are compared the way the storage compares the section names
+    HierarchyIndex(const NameLess &less)
+        : m_root(less)
+    {}
+
+    ~HierarchyIndex()
+    {}
+
+    void add(const std::string &section)
+    {
+        // the empty name is the top level itself, as in find()
+        if (section.empty())
+        {
+            m_root.is_section = true;
+            return;
+        }
+
+        Node *node = &m_root;
+
+        std::string::size_type start = 0;
+        for (;;)
+        {
+            std::string::size_type dot = section.find('.', start);
+            std::string::size_type end = (dot == section.npos) ? section.length() : dot;
+
+            std::map<std::string, Node, NameLess>::iterator CI = node->children.lower_bound(section.substr(start, end - start));
+            if ((CI == node->children.end()) ||
+                compare_names(CI->first.data(), CI->first.length(), section.data() + start, end - start, node->children.key_comp().fold()))
+            {
+                Node child(node->children.key_comp());
+                child.name.assign(section, 0, end);
+                child.parent = node;
+                CI = node->children.insert(CI, std::make_pair(section.substr(start, end - start), child));
+            }
+            node = &CI->second;
+
+            if (dot == section.npos)
+                break;
+            start = dot + 1;
+        }
+
+        node->is_section = true;
+    }
+
+    /// drops the nodes left with neither a section nor children
+    void remove(const std::string &section)
+    {
+        Node *node = find(section);
+        if (!node)
+            return;
+
+        node->is_section = false;
+        while ((node != &m_root) && !node->is_section && node->children.empty())
+        {
+            Node *parent = node->parent;
+            parent->children.erase(component(*node));
+            node = parent;
+        }
+    }
+
+    void clear()
+    {
+        m_root.is_section = false;
+        m_root.children.clear();
+    }
+
+    bool visit_children(const std::string &section, Storage::Visitor &visitor) const
+    {
+        const Node *node = find(section);
+        if (!node)
+            return true;
+
+        std::map<std::string, Node, NameLess>::const_iterator CM = node->children.end();
+        for (std::map<std::string, Node, NameLess>::const_iterator CI = node->children.begin(); CI != CM; ++CI)
+            if (!visitor.section(CI->second.name))
+                return false;
+
+        return true;
+    }
+
+    bool visit_subtree(const std::string &section, Storage::Visitor &visitor) const
+    {
+        const Node *node = find(section);
+        if (!node)
+            return true;
+
+        return visit_subtree(*node, visitor);
+    }
+
+    void count_memory(MemoryCounter &counter) const
+    {
+        counter.add_block(sizeof(*this));
+        count_memory(m_root, counter);
+    }
+
+private:
+    /// the empty name is the root, so "" finds the top level
+    Node *find(const std::string &section) const
+    {
+        const Node *node = &m_root;
+        if (section.empty())
+            return const_cast<Node *>(node);
+
+        std::string::size_type start = 0;
+        for (;;)
+        {
+            std::string::size_type dot = section.find('.', start);
+            std::string::size_type end = (dot == section.npos) ? section.length() : dot;
+
+            std::map<std::string, Node, NameLess>::const_iterator CI = node->children.find(section.substr(start, end - start));
+            if (CI == node->children.end())
+                return 0;
+            node = &CI->second;
+
+            if (dot == section.npos)
+                return const_cast<Node *>(node);
+            start = dot + 1;
+        }
+    }
+
+    static std::string component(const Node &node)
+    {
+        if (node.parent->parent)
+            return node.name.substr(node.parent->name.length() + 1);
+        return node.name;
+    }
+
+    static void count_memory(const Node &node, MemoryCounter &counter)
+    {
+        counter.add_string(node.name);
+
+        std::map<std::string, Node, NameLess>::const_iterator CM = node.children.end();
+        for (std::map<std::string, Node, NameLess>::const_iterator CI = node.children.begin(); CI != CM; ++CI)
+        {
+            counter.add_tree_node<std::map<std::string, Node, NameLess> >();
+            counter.add_string(CI->first);
+            count_memory(CI->second, counter);
+        }
+    }
+
+    static bool visit_subtree(const Node &node, Storage::Visitor &visitor)
+    {
+        if (node.is_section && !visitor.section(node.name))
+            return false;
+
+        std::map<std::string, Node, NameLess>::const_iterator CM = node.children.end();
+        for (std::map<std::string, Node, NameLess>::const_iterator CI = node.children.begin(); CI != CM; ++CI)
+            if (!visit_subtree(CI->second, visitor))
+                return false;
+
+        return true;
+    }
+
+private:
+    Node m_root;
+};
+
+/// maps the hash of every stored value to where it is stored, the candidates still have to be compared
+class ValueIndex
 {
 private:
-    typedef enum Context {
-        CONTEXT__NEWLINE,
-        CONTEXT__COMMENT,
-        CONTEXT__SECTION_START,
-        CONTEXT__SECTION_NAME,
-        CONTEXT__SECTION_HEX1,
-        CONTEXT__SECTION_HEX2,
-        CONTEXT__SECTION_END,
-        CONTEXT__SECTION_CLOSE,
-        CONTEXT__KEY_NAME,
-        CONTEXT__KEY_HEX1,
-        CONTEXT__KEY_HEX2,
-        CONTEXT__KEY_END,
-        CONTEXT__EQUAL,
-        CONTEXT__VALUE_QUOTED,
-        CONTEXT__VALUE_START,
-        CONTEXT__VALUE_ESCAPED,
-        CONTEXT__VALUE_HEX1,
-        CONTEXT__VALUE_HEX2,
-        CONTEXT__VALUE_END
-    } Context;
-
-    typedef enum CharClass {
-        CHAR_CLASS__NEWLINE,      // \r \n
-        CHAR_CLASS__SPACE,        // \s \t
-        CHAR_CLASS__SEMICOLON,    // ;
-        CHAR_CLASS__OPENBRACKET,  // [
-        CHAR_CLASS__CLOSEBRACKET, // ]
-        CHAR_CLASS__PERCENT,      // %
-        CHAR_CLASS__HEXDIGIT,     // 0-9A-Fa-f
-        CHAR_CLASS__LETTERS,      // G-Zg-z
-        CHAR_CLASS__MINUS,        // _.-
-        CHAR_CLASS__EQUAL,        // =
-        CHAR_CLASS__QUOTE,        // "
-        CHAR_CLASS__BACKSLASH,    // \\ (backslash)
-        CHAR_CLASS__COMMA,        // ,
-        CHAR_CLASS__VISIBLE,      // other 0x21-0x7e
-        CHAR_CLASS__OTHER         // other 0x00-0x1f, 0x7f-0xff
-    } CharClass;
-
-
-    typedef std::map<std::string, Storage::Values> Keys;
-    typedef std::map<std::string, Keys> Sections;
+    class LocationLess
+    {
+    public:
+        LocationLess(const NameLess &less)
+            : m_less(less)
+        {}
+
+        bool operator () (const Storage::Location &left, const Storage::Location &right) const
+        {
+            int result = compare_names(left.section.data(), left.section.length(), right.section.data(), right.section.length(), m_less.fold());
+            if (result)
+                return result < 0;
+            if (m_less(left.key, right.key))
+                return true;
+            if (m_less(right.key, left.key))
+                return false;
+            return left.index < right.index;
+        }
+
+    private:
+        NameLess m_less;
+    };
+
+public:
+    typedef std::set<Storage::Location, LocationLess> Bucket;
+
+    ValueIndex(const NameLess &less)
+        : m_less(less)
+        , m_built(false)
+    {}
+
+    std::mutex &mutex()
+    {
+        return m_mutex;
+    }
+
+    bool is_built() const
+    {
+        return m_built;
+    }
+
+    void set_built()
+    {
+        m_built = true;
+    }
+
+    void add(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        Storage::Location location;
+        location.section = section;
+        location.key = key;
+        for (size_t i = 0; i != values.size(); ++i)
+        {
+            Buckets::iterator BI = m_buckets.find(hash(values[i]));
+            if (BI == m_buckets.end())
+                BI = m_buckets.insert(std::make_pair(hash(values[i]), Bucket(LocationLess(m_less)))).first;
+
+            location.index = i;
+            BI->second.insert(location);
+        }
+    }
+
+    void remove(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        Storage::Location location;
+        location.section = section;
+        location.key = key;
+        for (size_t i = 0; i != values.size(); ++i)
+        {
+            Buckets::iterator BI = m_buckets.find(hash(values[i]));
+            if (BI == m_buckets.end())
+                continue;
+
+            location.index = i;
+            BI->second.erase(location);
+            if (BI->second.empty())
+                m_buckets.erase(BI);
+        }
+    }
+
+    /// forgets everything, the next query builds it again
+    void clear()
+    {
+        m_buckets.clear();
+        m_built = false;
+    }
+
+    const Bucket *find(const char *data, size_t size) const
+    {
+        Buckets::const_iterator BI = m_buckets.find(image_hash(data, size));
+        return (BI == m_buckets.end()) ? 0 : &BI->second;
+    }
+
+    /// the caller holds the mutex
+    void count_memory(MemoryCounter &counter) const
+    {
+        counter.add_hash_table(m_buckets);
+
+        Buckets::const_iterator BM = m_buckets.end();
+        for (Buckets::const_iterator BI = m_buckets.begin(); BI != BM; ++BI)
+        {
+            Bucket::const_iterator LM = BI->second.end();
+            for (Bucket::const_iterator LI = BI->second.begin(); LI != LM; ++LI)
+            {
+                counter.add_tree_node<Bucket>();
+                counter.add_string(LI->section);
+                counter.add_string(LI->key);
+            }
+        }
+    }
+
+private:
+    static uint64_t hash(const Storage::Value &value)
+    {
+        return image_hash(value.empty() ? 0 : &value[0], value.size());
+    }
+
+    typedef std::unordered_map<uint64_t, Bucket> Buckets;
+
+private:
+    NameLess m_less;
+    std::mutex m_mutex; // the queries build it on demand
+    bool m_built;
+    Buckets m_buckets;
+};
+
+/// collects the names, for the queries that answer with a copy
+class SectionCollector : public Storage::Visitor
+{
+public:
+    SectionCollector()
+        : Visitor()
+    {}
+
+    virtual bool section(const std::string &section)
+    {
+        m_sections.push_back(section);
+        return true;
+    }
+
+    std::vector<std::string> m_sections;
+};
+
+
+/// keeps the reports of a parse on another thread, to be replayed on the calling one
+class RecordingCallback : public Storage::Callback
+{
+public:
+    RecordingCallback()
+        : Callback()
+    {}
+
+    virtual void error(size_t faulty_pos, size_t faulty_line, size_t faulty_char)
+    {
+        Report report = { true, Storage::PARSE_WARNING__BINARY_ZERO_IN_SECTION_NAME, faulty_pos, faulty_line, faulty_char };
+        m_reports.push_back(report);
+    }
+
+    virtual void warning(Storage::ParseWarning type, size_t faulty_pos, size_t faulty_line, size_t faulty_char)
+    {
+        Report report = { false, type, faulty_pos, faulty_line, faulty_char };
+        m_reports.push_back(report);
+    }
+
+    /// as the parse on this thread would have reported them
+    void replay(Storage::Callback *callback) const
+    {
+        for (size_t i = 0; i != m_reports.size(); ++i)
+        {
+            const Report &report = m_reports[i];
+            if (report.error)
+                callback->error(report.pos, report.line, report.ch);
+            else
+                callback->warning(report.type, report.pos, report.line, report.ch);
+        }
+    }
+
+    void replay(const std::string &path, Storage::Callback *callback) const
+    {
+        for (size_t i = 0; i != m_reports.size(); ++i)
+        {
+            const Report &report = m_reports[i];
+            if (report.error)
+                callback->file_error(path, report.pos, report.line, report.ch);
+            else
+                callback->file_warning(path, report.type, report.pos, report.line, report.ch);
+        }
+    }
+
+private:
+    typedef struct Report
+    {
+        bool error;
+        Storage::ParseWarning type;
+        size_t pos;
+        size_t line;
+        size_t ch;
+    } Report;
+
+    std::vector<Report> m_reports;
+};
+
+/// a few threads for Storage::load_async() and Storage::prefetch(), started on the first task
+class TaskPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    static TaskPool &instance()
+    {
+        static TaskPool pool;
+        return pool;
+    }
+
+    void run(const Task &task)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_workers.empty())
+        {
+            unsigned threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+            for (unsigned i = 0; i != threads; ++i)
+                m_workers.push_back(std::thread(&TaskPool::work, this));
+        }
+
+        m_tasks.push_back(task);
+        m_ready.notify_one();
+    }
+
+private:
+    TaskPool()
+        : m_stop(false)
+    {}
+
+    /// finishes the queued tasks first
+    ~TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_ready.notify_all();
+
+        for (size_t i = 0; i != m_workers.size(); ++i)
+            m_workers[i].join();
+    }
+
+    void work()
+    {
+        for (;;)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (m_tasks.empty() && !m_stop)
+                    m_ready.wait(lock);
+                if (m_tasks.empty())
+                    return;
+
+                task.swap(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<Task> m_tasks;
+    std::vector<std::thread> m_workers;
+    bool m_stop;
+};
+
+
+/*  Journal of the key changes next to a base INI file, see Storage::open_journal().
+ *
+ *  path.journal      magic | record...
+ *  path.journal.old  the journal being folded into the base
+ *
+ *  record   payload size (u32) | reserved (u32) | checksum of the payload (u64) | payload
+ *  payload  operation count (u32) | operation...
+ *  op       type (u32) | section size (u32) | section | key size (u32) | key | value count (u32) | (value size (u32) | value)...
+ *
+ *  One record per change, so a change is either replayed whole or not at all, and as one unit: like the change, the
+ *  record erases the sections it emptied only at its end, so a section it refills keeps its spelling. The operations
+ *  only ever overwrite a key or drop keys, never depend on what is there, so replaying a journal that is already in
+ *  the base gives the same keys and values again. A renamed section is moved by a rename operation, which does nothing
+ *  unless the section is there and the new name is not, followed by the keys set under the new name and the removal
+ *  of the old one, so it keeps its place in the insertion order and is still replayed right over a base that has it.
+ *  That lets the compaction rename the journal aside, fold it into a new base and delete it, in that order: a crash
+ *  at any point leaves files that load to the same content. A torn record at the end is cut off on open.
+ */
+
+static const char JOURNAL__MAGIC[8] = { 'I', 'N', 'I', 'P', 'L', 'U', 'S', 'J' };
+
+typedef enum JournalOpType {
+    JOURNAL_OP__SET = 1,
+    JOURNAL_OP__REMOVE,
+    JOURNAL_OP__REMOVE_SECTION,
+    JOURNAL_OP__RENAME_SECTION
+} JournalOpType;
+
+typedef struct JournalOp
+{
+    JournalOpType type;
+    std::string section;
+    std::string key;         // empty for JOURNAL_OP__REMOVE_SECTION, the new name for JOURNAL_OP__RENAME_SECTION
+    Storage::Values values;  // empty unless JOURNAL_OP__SET
+} JournalOp;
+
+typedef std::vector<JournalOp> JournalOps;
+typedef std::vector<JournalOps> JournalRecords;
+
+typedef struct JournalRecordHeader
+{
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t checksum;
+} JournalRecordHeader;
+
+class StorageImpl;
+
+class Journal
+{
+public:
+    Journal(const std::string &path, unsigned options)
+        : m_path(path)
+        , m_journal_path(journal_path(path))
+        , m_old_path(old_path(path))
+        , m_options(options)
+        , m_fd(-1)
+        , m_record_count(0)
+        , m_intact(true)
+        , m_stop(false)
+    {}
+
+    ~Journal()
+    {
+        if (m_compactor.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            m_compactor.join();
+        }
+
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    static std::string journal_path(const std::string &path)
+    {
+        return path + ".journal";
+    }
+
+    static std::string old_path(const std::string &path)
+    {
+        return path + ".journal.old";
+    }
+
+    /// reads the records up to the first torn or damaged one, a missing file has none;
+    /// returns false on I/O errors and if the file is not a journal
+    static bool read(const std::string &path, JournalRecords &records, size_t &valid_size, size_t &record_count)
+    {
+        valid_size = 0;
+        record_count = 0;
+
+        std::string data;
+        if (!read_file(path, data))
+            return errno == ENOENT;
+
+        if (data.size() < sizeof(JOURNAL__MAGIC))
+            return true;
+        if (memcmp(data.data(), JOURNAL__MAGIC, sizeof(JOURNAL__MAGIC)))
+            return false;
+
+        size_t offset = sizeof(JOURNAL__MAGIC);
+        while (decode(data, offset, records))
+            ++record_count;
+        valid_size = offset;
+        return true;
+    }
+
+    /// continues the journal after its last good record, starts it if there is none; compacts every compact_seconds if not 0
+    bool open(size_t valid_size, size_t record_count, unsigned compact_seconds)
+    {
+        m_fd = ::open(m_journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0)
+            return false;
+
+        if (!restart(valid_size))
+            return false;
+        m_record_count = record_count;
+
+        if (compact_seconds)
+            m_compactor = std::thread(&Journal::compact_periodically, this, compact_seconds);
+        return true;
+    }
+
+    /// appends the operations of one change as one record
+    void append(const JournalOps &ops)
+    {
+        if (ops.empty())
+            return;
+
+        std::string record(sizeof(JournalRecordHeader), '\0');
+        put_number(record, ops.size());
+        for (size_t i = 0; i != ops.size(); ++i)
+        {
+            const JournalOp &op = ops[i];
+            put_number(record, op.type);
+            put_bytes(record, op.section.data(), op.section.length());
+            put_bytes(record, op.key.data(), op.key.length());
+            put_number(record, op.values.size());
+            for (size_t j = 0; j != op.values.size(); ++j)
+                put_bytes(record, op.values[j].empty() ? 0 : &op.values[j][0], op.values[j].size());
+        }
+
+        JournalRecordHeader header;
+        header.size = record.size() - sizeof(header);
+        header.reserved = 0;
+        header.checksum = image_hash(record.data() + sizeof(header), header.size);
+        memcpy(&record[0], &header, sizeof(header));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_intact)
+            return;
+
+        // nothing after a torn record would be replayed, so the journal stays as it is until compact()
+        if (!write_all(record.data(), record.size()) || ::fdatasync(m_fd))
+        {
+            m_intact = false;
+            return;
+        }
+        ++m_record_count;
+    }
+
+    /// false once a record could not be appended, until the next compact()
+    bool intact() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_intact;
+    }
+
+    /// writes the storage as the new base and empties the journal
+    bool compact(const StorageImpl &storage);
+
+private:
+    Journal(const Journal &);
+    Journal& operator = (const Journal &);
+
+    /// cuts the journal to the size, or to just the magic if 0
+    bool restart(size_t valid_size)
+    {
+        if (valid_size)
+            return !::ftruncate(m_fd, valid_size);
+
+        return !::ftruncate(m_fd, 0) && write_all(JOURNAL__MAGIC, sizeof(JOURNAL__MAGIC)) && !::fdatasync(m_fd);
+    }
+
+    bool write_all(const char *data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t count = ::write(m_fd, data, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    /// moves the journal aside for fold() and starts a new one, unless an earlier one is still waiting there
+    bool rotate()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_record_count || !m_intact)
+            return true;
+
+        struct stat st;
+        if (!::stat(m_old_path.c_str(), &st))
+            return false;
+
+        if (::rename(m_journal_path.c_str(), m_old_path.c_str()))
+            return false;
+
+        ::close(m_fd);
+        m_fd = ::open(m_journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if ((m_fd < 0) || !restart(0) || !sync_directory(m_journal_path))
+        {
+            m_intact = false;
+            return false;
+        }
+        m_record_count = 0;
+        return true;
+    }
+
+    /// the base file plus the journal moved aside make the new base, then the journal goes
+    bool fold();
+
+    void compact_periodically(unsigned compact_seconds)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_wake.wait_for(lock, std::chrono::seconds(compact_seconds));
+            if (m_stop)
+                return;
+
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> compact_lock(m_compact_mutex);
+                if (fold() && rotate())
+                    fold();
+            }
+            lock.lock();
+        }
+    }
+
+    static void put_number(std::string &record, uint32_t number)
+    {
+        record.append(reinterpret_cast<const char *>(&number), sizeof(number));
+    }
+
+    static void put_bytes(std::string &record, const char *data, size_t size)
+    {
+        put_number(record, size);
+        record.append(data, size);
+    }
+
+    static bool get_number(const char *&data, const char *end, uint32_t &number)
+    {
+        if (static_cast<size_t>(end - data) < sizeof(number))
+            return false;
+
+        memcpy(&number, data, sizeof(number));
+        data += sizeof(number);
+        return true;
+    }
+
+    static bool get_bytes(const char *&data, const char *end, const char *&bytes, uint32_t &size)
+    {
+        if (!get_number(data, end, size) || (static_cast<size_t>(end - data) < size))
+            return false;
+
+        bytes = data;
+        data += size;
+        return true;
+    }
+
+    /// adds the record at the offset and moves past it, false if there is no whole good record
+    static bool decode(const std::string &data, size_t &offset, JournalRecords &records)
+    {
+        JournalRecordHeader header;
+        if (data.size() - offset < sizeof(header))
+            return false;
+
+        memcpy(&header, data.data() + offset, sizeof(header));
+        if (data.size() - offset - sizeof(header) < header.size)
+            return false;
+
+        const char *payload = data.data() + offset + sizeof(header);
+        if (image_hash(payload, header.size) != header.checksum)
+            return false;
+
+        const char *end = payload + header.size;
+        JournalOps record;
+        uint32_t count;
+        if (!get_number(payload, end, count))
+            return false;
+        for (uint32_t i = 0; i != count; ++i)
+        {
+            uint32_t type;
+            const char *section;
+            uint32_t section_size;
+            const char *key;
+            uint32_t key_size;
+            uint32_t value_count;
+            if (!get_number(payload, end, type) || (type < JOURNAL_OP__SET) || (type > JOURNAL_OP__RENAME_SECTION) ||
+                !get_bytes(payload, end, section, section_size) || !get_bytes(payload, end, key, key_size) ||
+                !get_number(payload, end, value_count))
+                return false;
+
+            record.resize(record.size() + 1);
+            JournalOp &op = record.back();
+            op.type = static_cast<JournalOpType>(type);
+            op.section.assign(section, section_size);
+            op.key.assign(key, key_size);
+            for (uint32_t j = 0; j != value_count; ++j)
+            {
+                const char *value;
+                uint32_t value_size;
+                if (!get_bytes(payload, end, value, value_size))
+                    return false;
+
+                op.values.resize(op.values.size() + 1);
+                op.values.back().assign(value, value + value_size);
+            }
+        }
+        if (payload != end)
+            return false;
+
+        records.resize(records.size() + 1);
+        records.back().swap(record);
+        offset += sizeof(header) + header.size;
+        return true;
+    }
+
+private:
+    std::string m_path;
+    std::string m_journal_path;
+    std::string m_old_path;
+    unsigned m_options;
+    int m_fd;
+    size_t m_record_count; // since the journal was started
+    bool m_intact;
+    bool m_stop;
+    mutable std::mutex m_mutex;     // the file and the counters
+    std::mutex m_compact_mutex;     // one compaction at a time, the base file is written under it
+    std::condition_variable m_wake;
+    std::thread m_compactor;
+};
+
+
+static Storage::AllocationCounter allocation_counter = 0;
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t nanoseconds(Clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+/// parse() statistics policy for the plain overloads, compiles to nothing
+class NoParseStats
+{
+public:
+    void escape()
+    {}
+
+    void begin_store()
+    {}
+
+    template <typename Name, typename Values>
+    void end_store(const Name &, const Name &, const Values &)
+    {}
+
+    void fail(size_t, size_t, size_t)
+    {}
+};
+
+/*  Caller's buffer of Snapshot::parse(), parse() runs on it with the Fixed* types in place of the heap ones.
+ *
+ *  header | names and values -->          <-- entries | rest
+ *
+ *  The names and values grow from the front, each parsed entry reserves a FixedEntry at the back, followed downwards
+ *  by the ImageValue of every of its values. Once both ends meet only the sizes are counted, for the hint.
+ *  finish() sorts the entries and writes the image tables behind the names and values.
+ */
+
+typedef struct FixedEntry
+{
+    uint64_t section_offset; // in the buffer
+    uint64_t key_offset;
+    uint32_t section_size;
+    uint32_t key_size;
+    uint32_t value_count;
+    uint32_t stored;         // is 0 for the entries the parser dropped
+} FixedEntry;
+
+class FixedArena
+{
+public:
+    FixedArena(char *data, size_t size)
+        : m_data(data)
+        , m_front(sizeof(ImageHeader))
+        , m_back(size & ~static_cast<size_t>(7))
+        , m_end(m_back)
+        , m_size(size)
+        , m_overflow(size < sizeof(ImageHeader))
+        , m_byte_count(0)
+        , m_entry_count(0)
+        , m_value_count(0)
+    {}
+
+    bool overflow() const
+    {
+        return m_overflow;
+    }
+
+    size_t front() const
+    {
+        return m_front;
+    }
+
+    char &byte(size_t offset)
+    {
+        return m_data[offset];
+    }
+
+    void push_byte(char c)
+    {
+        ++m_byte_count;
+        if (!m_overflow && (m_front == m_back))
+            m_overflow = true;
+        if (!m_overflow)
+            m_data[m_front++] = c;
+    }
+
+    FixedEntry *push_entry()
+    {
+        ++m_entry_count;
+        if (!reserve(sizeof(FixedEntry)))
+            return 0;
+
+        FixedEntry *entry = reinterpret_cast<FixedEntry *>(m_data + m_back);
+        memset(entry, 0, sizeof(*entry));
+        return entry;
+    }
+
+    void push_value(FixedEntry *entry, size_t offset, size_t size)
+    {
+        ++m_value_count;
+        if (!entry || !reserve(sizeof(ImageValue)))
+            return;
+
+        ImageValue *value = reinterpret_cast<ImageValue *>(m_data + m_back);
+        value->offset = offset - sizeof(ImageHeader);
+        value->size = size;
+        ++entry->value_count;
+    }
+
+    /// the size with which the same text fits: the names and values, the entries, the tables and the sort order
+    size_t required() const
+    {
+        size_t front = (sizeof(ImageHeader) + m_byte_count + 7) & ~static_cast<size_t>(7);
+        return front + m_entry_count * (sizeof(FixedEntry) + sizeof(ImageSection) + sizeof(ImageKey) + sizeof(FixedEntry *)) +
+            m_value_count * 2 * sizeof(ImageValue);
+    }
+
+    /// writes the image, the later of the same keys wins, the names keep their first spelling
+    bool finish(bool fold)
+    {
+        if (m_overflow || (required() > m_size))
+            return false;
+
+        size_t stored_count = 0;
+        size_t stored_values = 0;
+        for (size_t back = m_end; back != m_back; )
+        {
+            const FixedEntry *entry = reinterpret_cast<const FixedEntry *>(m_data + back - sizeof(FixedEntry));
+            if (entry->stored)
+            {
+                ++stored_count;
+                stored_values += entry->value_count;
+            }
+            back -= sizeof(FixedEntry) + entry->value_count * sizeof(ImageValue);
+        }
+
+        size_t tables = (m_front + 7) & ~static_cast<size_t>(7);
+        FixedEntry **order = reinterpret_cast<FixedEntry **>(m_data + tables + stored_count * (sizeof(ImageSection) + sizeof(ImageKey)) +
+            stored_values * sizeof(ImageValue));
+        size_t count = 0;
+        for (size_t back = m_end; back != m_back; )
+        {
+            FixedEntry *entry = reinterpret_cast<FixedEntry *>(m_data + back - sizeof(FixedEntry));
+            if (entry->stored)
+                order[count++] = entry;
+            back -= sizeof(FixedEntry) + entry->value_count * sizeof(ImageValue);
+        }
+        std::sort(order, order + count, EntryLess(m_data, fold));
+
+        ImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, IMAGE__MAGIC, sizeof(IMAGE__MAGIC));
+        header.version = IMAGE_VERSION__CURRENT;
+        if (fold)
+            header.flags |= IMAGE_FLAG__CASE_INSENSITIVE;
+        for (size_t i = 0; i != count; ++i)
+        {
+            bool last_key = (i + 1 == count) || compare_keys(order[i], order[i + 1], fold);
+            if (!last_key)
+                continue;
+
+            ++header.key_count;
+            header.value_count += order[i]->value_count;
+            if ((i + 1 == count) || compare_sections(order[i], order[i + 1], fold))
+                ++header.section_count;
+        }
+        header.sections_offset = tables;
+        header.keys_offset = header.sections_offset + header.section_count * sizeof(ImageSection);
+        header.values_offset = header.keys_offset + header.key_count * sizeof(ImageKey);
+        header.bytes_offset = sizeof(ImageHeader);
+        header.size = header.values_offset + header.value_count * sizeof(ImageValue);
+
+        ImageSection *sections = reinterpret_cast<ImageSection *>(m_data + header.sections_offset);
+        ImageKey *keys = reinterpret_cast<ImageKey *>(m_data + header.keys_offset);
+        ImageValue *values = reinterpret_cast<ImageValue *>(m_data + header.values_offset);
+        uint32_t key_index = 0;
+        uint32_t value_index = 0;
+        for (size_t i = 0; i != count; )
+        {
+            // the earliest entry of the section has the highest address
+            const FixedEntry *section_first = order[i];
+            const FixedEntry *first_entry = section_first;
+            ImageSection &section = *sections++;
+            section.first_key = key_index;
+            section.key_count = 0;
+            section.reserved = 0;
+
+            while ((i != count) && !compare_sections(section_first, order[i], fold))
+            {
+                size_t last_index = i;
+                while ((last_index + 1 != count) && !compare_keys(order[i], order[last_index + 1], fold))
+                    ++last_index;
+
+                if (order[i] > first_entry)
+                    first_entry = order[i];
+
+                const FixedEntry *last = order[last_index];
+                ImageKey &key = keys[key_index++];
+                key.name_offset = order[i]->key_offset - sizeof(ImageHeader);
+                key.name_size = order[i]->key_size;
+                key.first_value = value_index;
+                key.value_count = last->value_count;
+                key.reserved = 0;
+                ++section.key_count;
+
+                const char *first_value = reinterpret_cast<const char *>(last) - sizeof(ImageValue);
+                for (uint32_t v = 0; v != last->value_count; ++v)
+                    memcpy(&values[value_index++], first_value - v * sizeof(ImageValue), sizeof(ImageValue));
+
+                i = last_index + 1;
+            }
+
+            section.name_offset = first_entry->section_offset - sizeof(ImageHeader);
+            section.name_size = first_entry->section_size;
+        }
+
+        header.checksum = image_hash(m_data + sizeof(ImageHeader), header.size - sizeof(ImageHeader));
+        memcpy(m_data, &header, sizeof(header));
+        return true;
+    }
+
+    /// parse() target
+    template <typename Name, typename Values>
+    bool entry(const Name &section, const Name &key, const Values &values)
+    {
+        FixedEntry *entry = values.entry();
+        if (!entry)
+            return true;
+
+        entry->section_offset = section.offset();
+        entry->section_size = section.size();
+        entry->key_offset = key.offset();
+        entry->key_size = key.size();
+        entry->stored = 1;
+        return true;
+    }
+
+private:
+    bool reserve(size_t size)
+    {
+        if (!m_overflow && (m_back - m_front < size))
+            m_overflow = true;
+        if (m_overflow)
+            return false;
+
+        m_back -= size;
+        return true;
+    }
+
+    static int compare_sections(const FixedEntry *left, const FixedEntry *right, const char *data, bool fold)
+    {
+        return compare_names(data + left->section_offset, left->section_size, data + right->section_offset, right->section_size, fold);
+    }
+
+    int compare_sections(const FixedEntry *left, const FixedEntry *right, bool fold) const
+    {
+        return compare_sections(left, right, m_data, fold);
+    }
+
+    static int compare_keys(const FixedEntry *left, const FixedEntry *right, const char *data, bool fold)
+    {
+        int result = compare_sections(left, right, data, fold);
+        if (result)
+            return result;
+        return compare_names(data + left->key_offset, left->key_size, data + right->key_offset, right->key_size, fold);
+    }
+
+    int compare_keys(const FixedEntry *left, const FixedEntry *right, bool fold) const
+    {
+        return compare_keys(left, right, m_data, fold);
+    }
+
+    /// by section and key, the earlier entries (at the higher addresses) first
+    class EntryLess
+    {
+    public:
+        EntryLess(const char *data, bool fold)
+            : m_data(data)
+            , m_fold(fold)
+        {}
+
+        bool operator () (const FixedEntry *left, const FixedEntry *right) const
+        {
+            int result = compare_keys(left, right, m_data, m_fold);
+            if (result)
+                return result < 0;
+            return left > right;
+        }
+
+    private:
+        const char *m_data;
+        bool m_fold;
+    };
+
+private:
+    char *m_data;
+    size_t m_front;
+    size_t m_back;
+    size_t m_end;
+    size_t m_size;
+    bool m_overflow;
+    size_t m_byte_count;
+    size_t m_entry_count;
+    size_t m_value_count;
+};
+
+/// a name or a value being parsed into the arena, always the last thing at its front
+class FixedBytes
+{
+public:
+    explicit FixedBytes(FixedArena &arena)
+        : m_arena(&arena)
+        , m_offset(arena.front())
+        , m_size(0)
+        , m_spare('\0')
+    {}
+
+    void clear()
+    {
+        m_offset = m_arena->front();
+        m_size = 0;
+    }
+
+    FixedBytes& operator += (char c)
+    {
+        m_arena->push_byte(c);
+        ++m_size;
+        m_spare = c;
+        return *this;
+    }
+
+    void append(const char *data, size_t size)
+    {
+        for (size_t i = 0; i != size; ++i)
+            *this += data[i];
+    }
+
+    /// the parser only ever touches the last byte, kept aside once the arena is full
+    char &operator [] (size_t index)
+    {
+        return m_arena->overflow() ? m_spare : m_arena->byte(m_offset + index);
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    size_t length() const
+    {
+        return m_size;
+    }
+
+    size_t offset() const
+    {
+        return m_offset;
+    }
+
+    /// drops the spaces and tabs around, in place
+    FixedBytes trimmed() const
+    {
+        FixedBytes result(*this);
+        if (m_arena->overflow())
+            return result;
+
+        while (result.m_size && is_blank(m_arena->byte(result.m_offset)))
+        {
+            ++result.m_offset;
+            --result.m_size;
+        }
+        while (result.m_size && is_blank(m_arena->byte(result.m_offset + result.m_size - 1)))
+            --result.m_size;
+        return result;
+    }
+
+private:
+    static bool is_blank(char c)
+    {
+        return (c == ' ') || (c == '\t');
+    }
+
+private:
+    FixedArena *m_arena;
+    size_t m_offset;
+    size_t m_size;
+    char m_spare;
+};
+
+/// the values of the entry being parsed, recorded behind its FixedEntry
+class FixedValues
+{
+public:
+    explicit FixedValues(FixedArena &arena)
+        : m_arena(&arena)
+        , m_entry(0)
+    {}
+
+    void clear()
+    {
+        m_entry = m_arena->push_entry();
+    }
+
+    FixedValues& operator += (const FixedBytes &value)
+    {
+        m_arena->push_value(m_entry, value.offset(), value.size());
+        return *this;
+    }
+
+    FixedEntry *entry() const
+    {
+        return m_entry;
+    }
+
+private:
+    FixedArena *m_arena;
+    FixedEntry *m_entry;
+};
+
+/// the text of Snapshot::parse(), reads as NUL past the end like std::string does
+class FixedText
+{
+public:
+    FixedText(const char *data, size_t length)
+        : m_data(data)
+        , m_length(length)
+    {}
+
+    char operator [] (size_t index) const
+    {
+        return (index < m_length) ? m_data[index] : '\0';
+    }
+
+    const char *data() const
+    {
+        return m_data;
+    }
+
+    size_t length() const
+    {
+        return m_length;
+    }
+
+private:
+    const char *m_data;
+    size_t m_length;
+};
+
+/// the Grammar helpers of the values
+static Storage::Value trim_value(const Storage::Value &value)
+{
+    size_t start = 0;
+    size_t end = value.size();
+    while ((start != end) && ((value[start] == ' ') || (value[start] == '\t')))
+        ++start;
+    while ((end != start) && ((value[end - 1] == ' ') || (value[end - 1] == '\t')))
+        --end;
+
+    Storage::Value result;
+    result.assign(value.begin() + start, value.begin() + end);
+    return result;
+}
+
+static FixedBytes trim_value(const FixedBytes &value)
+{
+    return value.trimmed();
+}
+
+static void append_value(Storage::Value &value, const char *data, size_t size)
+{
+    value.insert(value.end(), data, data + size);
+}
+
+static void append_value(FixedBytes &value, const char *data, size_t size)
+{
+    value.append(data, size);
+}
+
+/// parse() statistics policy filling a ParseResult
+class ParseStats
+{
+public:
+    ParseStats(Storage::ParseResult &result)
+        : m_result(result)
+        , m_store_time(0)
+        , m_allocations(allocation_counter ? allocation_counter() : 0)
+    {
+        memset(&m_result, 0, sizeof(m_result));
+        m_start = Clock::now();
+    }
+
+    void escape()
+    {
+        ++m_result.escapes_decoded;
+    }
+
+    void begin_store()
+    {
+        m_store_start = Clock::now();
+    }
+
+    void end_store(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        m_store_time += Clock::now() - m_store_start;
+
+        m_result.peak_name_size = std::max(m_result.peak_name_size, std::max(section.size(), key.size()));
+        m_result.peak_value_count = std::max(m_result.peak_value_count, values.size());
+        for (Storage::Values::const_iterator VI = values.begin(); VI != values.end(); ++VI)
+            m_result.peak_value_size = std::max(m_result.peak_value_size, VI->size());
+    }
+
+    void fail(size_t faulty_pos, size_t faulty_line, size_t faulty_char)
+    {
+        m_result.faulty_pos = faulty_pos;
+        m_result.faulty_line = faulty_line;
+        m_result.faulty_char = faulty_char;
+    }
+
+    void finish(bool success, size_t size)
+    {
+        uint64_t total_time = nanoseconds(Clock::now() - m_start);
+
+        m_result.success = success;
+        m_result.bytes_processed = success ? size : m_result.faulty_pos;
+        m_result.allocations = allocation_counter ? allocation_counter() - m_allocations : 0;
+        m_result.store_time = nanoseconds(m_store_time);
+        m_result.scan_time = total_time - m_result.store_time;
+        m_result.total_time = total_time;
+    }
+
+private:
+    Storage::ParseResult &m_result;
+    Clock::time_point m_start;
+    Clock::time_point m_store_start;
+    Clock::duration m_store_time;
+    size_t m_allocations;
+};
+
+
+#if defined(INIPLUS_ACCESS_STATS)
+/// per-key lookup counters; every thread counts into its own shard with relaxed atomics,
+/// a shard is locked only when its thread meets a new key and while the counts are collected
+class AccessStats
+{
+public:
+    typedef std::map<std::pair<std::string, std::string>, Storage::AccessCount> Totals;
+
+    AccessStats()
+        : m_id(next_id.fetch_add(1, std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        live.insert(m_id);
+    }
+
+    ~AccessStats()
+    {
+        {
+            std::lock_guard<std::mutex> lock(live_mutex);
+            live.erase(m_id);
+        }
+        removals.fetch_add(1, std::memory_order_release);
+
+        for (size_t i = 0; i != m_shards.size(); ++i)
+            delete m_shards[i];
+    }
+
+    void count(const std::string &section, const std::string &key, bool found, bool has_default)
+    {
+        Counters &counters = shard().counters(section, key);
+        counters.lookups.fetch_add(1, std::memory_order_relaxed);
+        if (!found)
+        {
+            counters.misses.fetch_add(1, std::memory_order_relaxed);
+            if (has_default)
+                counters.defaults.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void collect(Totals &totals)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i != m_shards.size(); ++i)
+        {
+            Shard &shard = *m_shards[i];
+            std::lock_guard<std::mutex> shard_lock(shard.mutex);
+
+            CounterMap::const_iterator SM = shard.map.end();
+            for (CounterMap::const_iterator SI = shard.map.begin(); SI != SM; ++SI)
+            {
+                KeyCounters::const_iterator KM = SI->second.end();
+                for (KeyCounters::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+                {
+                    Storage::AccessCount &total = totals[std::make_pair(SI->first, KI->first)];
+                    total.lookups += KI->second.lookups.load(std::memory_order_relaxed);
+                    total.misses += KI->second.misses.load(std::memory_order_relaxed);
+                    total.defaults += KI->second.defaults.load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    /// zeroes the counters but keeps the entries, their threads look them up without a lock
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i != m_shards.size(); ++i)
+        {
+            Shard &shard = *m_shards[i];
+            std::lock_guard<std::mutex> shard_lock(shard.mutex);
+
+            CounterMap::iterator SM = shard.map.end();
+            for (CounterMap::iterator SI = shard.map.begin(); SI != SM; ++SI)
+            {
+                KeyCounters::iterator KM = SI->second.end();
+                for (KeyCounters::iterator KI = SI->second.begin(); KI != KM; ++KI)
+                {
+                    KI->second.lookups.store(0, std::memory_order_relaxed);
+                    KI->second.misses.store(0, std::memory_order_relaxed);
+                    KI->second.defaults.store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+private:
+    typedef struct Counters
+    {
+        Counters()
+            : lookups(0)
+            , misses(0)
+            , defaults(0)
+        {}
+
+        std::atomic<uint64_t> lookups;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> defaults;
+    } Counters;
+
+    typedef std::map<std::string, Counters> KeyCounters;
+    typedef std::map<std::string, KeyCounters> CounterMap;
+
+    /// only its own thread changes the map, so that thread reads it without the lock
+    typedef struct Shard
+    {
+        Counters &counters(const std::string &section, const std::string &key)
+        {
+            CounterMap::iterator SI = map.find(section);
+            if (SI != map.end())
+            {
+                KeyCounters::iterator KI = SI->second.find(key);
+                if (KI != SI->second.end())
+                    return KI->second;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            return map[section][key];
+        }
+
+        std::mutex mutex;
+        CounterMap map;
+    } Shard;
+
+    /// the shards of a thread by the id of their storage
+    typedef struct ThreadShards
+    {
+        ThreadShards()
+            : removals(0)
+        {}
+
+        uint64_t removals; // as of the last purge
+        std::map<uint64_t, Shard *> shards;
+    } ThreadShards;
+
+    Shard &shard()
+    {
+        // the ids are never reused, so a shard of a destroyed storage is never found again; its pointer stays behind
+        // in the threads that used it only until they count again after the destruction
+        static thread_local ThreadShards thread_shards;
+
+        uint64_t current_removals = removals.load(std::memory_order_acquire);
+        if (thread_shards.removals != current_removals)
+        {
+            std::lock_guard<std::mutex> lock(live_mutex);
+            for (std::map<uint64_t, Shard *>::iterator TI = thread_shards.shards.begin(); TI != thread_shards.shards.end(); )
+                if (live.count(TI->first))
+                    ++TI;
+                else
+                    thread_shards.shards.erase(TI++);
+            thread_shards.removals = current_removals;
+        }
+
+        Shard *&result = thread_shards.shards[m_id];
+        if (!result)
+        {
+            result = new Shard;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_shards.push_back(result);
+        }
+        return *result;
+    }
+
+private:
+    AccessStats(const AccessStats &);
+    AccessStats& operator = (const AccessStats &);
+
+private:
+    static std::atomic<uint64_t> next_id;
+    static std::mutex live_mutex;
+    static std::set<uint64_t> live;        // the ids of the existing storages
+    static std::atomic<uint64_t> removals; // of storages, the threads purge their shards when it changes
+
+    uint64_t m_id;
+    std::mutex m_mutex;
+    std::vector<Shard *> m_shards;
+};
+
+std::atomic<uint64_t> AccessStats::next_id(1);
+std::mutex AccessStats::live_mutex;
+std::set<uint64_t> AccessStats::live;
+std::atomic<uint64_t> AccessStats::removals(0);
+#endif
+
+/// orders the staged changes by section and key the way the storage sorts the names
+class ChangeLess
+{
+public:
+    ChangeLess(const Storage::Changes &changes, const NameLess &less)
+        : m_changes(changes)
+        , m_less(less)
+    {}
+
+    bool operator () (size_t left, size_t right) const
+    {
+        const Storage::Change &left_change = m_changes[left];
+        const Storage::Change &right_change = m_changes[right];
+        int result = compare_names(left_change.section.data(), left_change.section.length(),
+                                   right_change.section.data(), right_change.section.length(), m_less.fold());
+        if (result)
+            return result < 0;
+        return m_less(left_change.key, right_change.key);
+    }
+
+    bool equal(size_t left, size_t right) const
+    {
+        return m_less.equal(m_changes[left].section, m_changes[right].section) && m_less.equal(m_changes[left].key, m_changes[right].key);
+    }
+
+private:
+    const Storage::Changes &m_changes;
+    NameLess m_less;
+};
+
+/// memoized results of the expanded lookups and the graph of who references whom;
+/// the caller holds the mutex around everything but invalidate() and clear(), which the mutations call
+class ExpansionCache
+{
+public:
+    typedef std::pair<std::string, std::string> Name; // section, key
+
+    ExpansionCache(const NameLess &less)
+        : m_memo(less)
+        , m_dependents(less)
+        , m_empty(true)
+    {}
+
+    std::mutex &mutex()
+    {
+        return m_mutex;
+    }
+
+    const Storage::Values *find(const std::string &section, const std::string &key) const
+    {
+        Memo::const_iterator MI = m_memo.find(section);
+        if (MI == m_memo.end())
+            return 0;
+
+        KeyMemo::const_iterator KI = MI->second.find(key);
+        if (KI == MI->second.end())
+            return 0;
+
+        return &KI->second;
+    }
+
+    void store(const Name &name, const Storage::Values &values)
+    {
+        m_empty.store(false, std::memory_order_relaxed);
+        inner(m_memo, name.first)[name.second] = values;
+    }
+
+    /// the referenced key may not exist yet, setting it later invalidates the dependent all the same
+    void add_dependency(const Name &referenced, const Name &dependent)
+    {
+        m_empty.store(false, std::memory_order_relaxed);
+
+        std::vector<Name> &dependents = inner(m_dependents, referenced.first)[referenced.second];
+        const NameLess &less = m_dependents.key_comp();
+        for (size_t i = 0; i != dependents.size(); ++i)
+            if (less.equal(dependents[i].first, dependent.first) && less.equal(dependents[i].second, dependent.second))
+                return;
+
+        dependents.push_back(dependent);
+    }
+
+    /// forgets the result of the key and, through the graph, of every key made of it
+    void invalidate(const std::string &section, const std::string &key)
+    {
+        if (m_empty.load(std::memory_order_relaxed))
+            return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        forget(section, key);
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_memo.clear();
+        m_dependents.clear();
+        m_empty.store(true, std::memory_order_relaxed);
+    }
+
+    /// the caller holds the mutex
+    void count_memory(MemoryCounter &counter) const
+    {
+        Memo::const_iterator MM = m_memo.end();
+        for (Memo::const_iterator MI = m_memo.begin(); MI != MM; ++MI)
+        {
+            counter.add_tree_node<Memo>();
+            counter.add_string(MI->first);
+
+            KeyMemo::const_iterator KM = MI->second.end();
+            for (KeyMemo::const_iterator KI = MI->second.begin(); KI != KM; ++KI)
+            {
+                counter.add_tree_node<KeyMemo>();
+                counter.add_string(KI->first);
+                counter.add_vector(KI->second);
+                for (size_t i = 0; i != KI->second.size(); ++i)
+                    counter.add_vector(KI->second[i]);
+            }
+        }
+
+        Dependents::const_iterator DM = m_dependents.end();
+        for (Dependents::const_iterator DI = m_dependents.begin(); DI != DM; ++DI)
+        {
+            counter.add_tree_node<Dependents>();
+            counter.add_string(DI->first);
+
+            KeyDependents::const_iterator KM = DI->second.end();
+            for (KeyDependents::const_iterator KI = DI->second.begin(); KI != KM; ++KI)
+            {
+                counter.add_tree_node<KeyDependents>();
+                counter.add_string(KI->first);
+                counter.add_vector(KI->second);
+                for (size_t i = 0; i != KI->second.size(); ++i)
+                {
+                    counter.add_string(KI->second[i].first);
+                    counter.add_string(KI->second[i].second);
+                }
+            }
+        }
+    }
+
+private:
+    typedef std::map<std::string, Storage::Values, NameLess> KeyMemo;
+    typedef std::map<std::string, KeyMemo, NameLess> Memo;
+    typedef std::map<std::string, std::vector<Name>, NameLess> KeyDependents;
+    typedef std::map<std::string, KeyDependents, NameLess> Dependents;
+
+    template <typename Table>
+    static typename Table::mapped_type &inner(Table &table, const std::string &section)
+    {
+        typename Table::iterator TI = table.lower_bound(section);
+        if ((TI == table.end()) || !table.key_comp().equal(TI->first, section))
+            TI = table.insert(TI, std::make_pair(section, typename Table::mapped_type(table.key_comp())));
+        return TI->second;
+    }
+
+    /// the edges are dropped on the way, so a cycle in the graph ends the walk
+    void forget(const std::string &section, const std::string &key)
+    {
+        Memo::iterator MI = m_memo.find(section);
+        if ((MI != m_memo.end()) && MI->second.erase(key) && MI->second.empty())
+            m_memo.erase(MI);
+
+        Dependents::iterator DI = m_dependents.find(section);
+        if (DI == m_dependents.end())
+            return;
+        KeyDependents::iterator KI = DI->second.find(key);
+        if (KI == DI->second.end())
+            return;
+
+        std::vector<Name> dependents;
+        dependents.swap(KI->second);
+        DI->second.erase(KI);
+        if (DI->second.empty())
+            m_dependents.erase(DI);
+
+        for (size_t i = 0; i != dependents.size(); ++i)
+            forget(dependents[i].first, dependents[i].second);
+    }
+
+private:
+    std::mutex m_mutex;
+    Memo m_memo;
+    Dependents m_dependents;
+    std::atomic<bool> m_empty; // lets the mutations skip the lock while nothing was expanded
+};
+
+
+/// hashes the names the way NameLess compares them
+class NameHash
+{
+public:
+    NameHash(bool fold = false)
+        : m_fold(fold)
+    {}
+
+    size_t operator () (const std::string *name) const
+    {
+        if (!m_fold)
+            return image_hash(name->data(), name->length());
+
+        uint64_t result = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i != name->length(); ++i)
+            result = (result ^ fold_char((*name)[i])) * 0x100000001b3ULL;
+        return result;
+    }
+
+private:
+    bool m_fold;
+};
+
+class NameEqual
+{
+public:
+    NameEqual(bool fold = false)
+        : m_less(fold)
+    {}
+
+    bool operator () (const std::string *left, const std::string *right) const
+    {
+        return m_less.equal(*left, *right);
+    }
+
+private:
+    NameLess m_less;
+};
+
+/*  The order the sections and keys came in, for OPTION__ORDERED.
+ *
+ *  The storage keeps its maps, the range queries and the binary images need the name order. Beside them every
+ *  section has a slot in a dense vector, holding the map entries of its keys in a dense vector of its own, and hash
+ *  tables find the slots and the keys by name. The map nodes never move, so the slots point right at them.
+ *  A removal leaves a null tombstone in its place; once the tombstones outnumber the entries, or on compact(),
+ *  the vector is closed up and its hash table rebuilt, so a removal costs O(1) amortized. While held, as during a
+ *  commit, nothing is closed up, so restore() can put a removed entry back in its tombstone.
+ */
+template <typename Sections>
+class InsertionOrder
+{
+public:
+    typedef typename Sections::value_type Section;
+    typedef typename Sections::mapped_type::value_type Key;
+    typedef std::unordered_map<const std::string *, size_t, NameHash, NameEqual> Positions;
+
+    typedef struct Slot
+    {
+        Slot(bool fold)
+            : section(0)
+            , removed(0)
+            , positions(0, NameHash(fold), NameEqual(fold))
+        {}
+
+        Section *section;        // 0 once removed
+        std::vector<Key *> keys; // 0 once removed
+        size_t removed;          // of the keys
+        Positions positions;     // of the keys
+    } Slot;
+
+    typedef std::vector<Slot> Slots;
+
+    InsertionOrder(bool fold)
+        : m_fold(fold)
+        , m_held(false)
+        , m_removed(0)
+        , m_positions(0, NameHash(fold), NameEqual(fold))
+    {}
+
+    /// with the tombstones, skip the null sections and keys
+    const Slots &slots() const
+    {
+        return m_slots;
+    }
+
+    const Slot *find(const std::string &section) const
+    {
+        typename Positions::const_iterator PI = m_positions.find(&section);
+        return (PI == m_positions.end()) ? 0 : &m_slots[PI->second];
+    }
+
+    Key *find(const std::string &section, const std::string &key) const
+    {
+        const Slot *slot = find(section);
+        if (!slot)
+            return 0;
+
+        typename Positions::const_iterator PI = slot->positions.find(&key);
+        return (PI == slot->positions.end()) ? 0 : slot->keys[PI->second];
+    }
+
+    /// the position of the section in the slots, with the tombstones
+    size_t position(const std::string &section) const
+    {
+        return m_positions.find(&section)->second;
+    }
+
+    void add_section(Section &section)
+    {
+        m_slots.push_back(Slot(m_fold));
+        m_slots.back().section = &section;
+        m_positions[&section.first] = m_slots.size() - 1;
+    }
+
+    /// the section is gone from the map after this, its keys with it
+    void remove_section(const std::string &section)
+    {
+        typename Positions::iterator PI = m_positions.find(&section);
+        if (PI == m_positions.end())
+            return;
+
+        m_slots[PI->second] = Slot(m_fold);
+        m_positions.erase(PI);
+        if ((++m_removed > m_positions.size()) && !m_held)
+            compact_sections();
+    }
+
+    /// the section that the keys were moved to takes the place of the section they were moved from
+    void move_section(const std::string &section, Section &new_section)
+    {
+        typename Positions::iterator PI = m_positions.find(&section);
+        typename Positions::iterator NI = m_positions.find(&new_section.first);
+        size_t position = PI->second;
+        size_t new_position = NI->second;
+        m_positions.erase(PI);
+        NI->second = position;
+
+        m_slots[position].section = &new_section;
+        m_slots[new_position] = Slot(m_fold);
+        if ((++m_removed > m_positions.size()) && !m_held)
+            compact_sections();
+    }
+
+    void add_key(const std::string &section, Key &key)
+    {
+        Slot &slot = m_slots[m_positions.find(&section)->second];
+        slot.keys.push_back(&key);
+        slot.positions[&key.first] = slot.keys.size() - 1;
+    }
+
+    /// the key is still in the map while this runs; returns the position it had in the keys of the section
+    size_t remove_key(const std::string &section, const std::string &key)
+    {
+        typename Positions::iterator SI = m_positions.find(&section);
+        if (SI == m_positions.end())
+            return 0;
+
+        Slot &slot = m_slots[SI->second];
+        typename Positions::iterator PI = slot.positions.find(&key);
+        if (PI == slot.positions.end())
+            return 0;
+
+        size_t position = PI->second;
+        slot.keys[position] = 0;
+        slot.positions.erase(PI);
+        if ((++slot.removed > slot.positions.size()) && !m_held)
+            compact_keys(slot);
+        return position;
+    }
+
+    /// while held the removals only leave tombstones, the positions stay valid
+    void hold()
+    {
+        m_held = true;
+    }
+
+    /// the sections are closed up if they should have been while held, the keys on their next removal
+    void release()
+    {
+        m_held = false;
+        if (m_removed > m_positions.size())
+            compact_sections();
+    }
+
+    /// moves the key, and the section if it was removed too, just added again at the end back to the positions
+    /// they were removed from while held
+    void restore(const std::string &section, size_t section_position, const std::string &key, size_t key_position)
+    {
+        typename Positions::iterator SI = m_positions.find(&section);
+        if (SI->second != section_position)
+        {
+            std::swap(m_slots[section_position], m_slots[SI->second]);
+            m_slots.pop_back();
+            --m_removed;
+            SI->second = section_position;
+        }
+
+        Slot &slot = m_slots[section_position];
+        typename Positions::iterator PI = slot.positions.find(&key);
+        if (PI->second != key_position)
+        {
+            Key *entry = slot.keys.back();
+            slot.keys.pop_back();
+            if (slot.keys.size() <= key_position)
+                slot.keys.resize(key_position + 1);
+
+            slot.keys[key_position] = entry;
+            PI->second = key_position;
+            slot.removed = slot.keys.size() - slot.positions.size();
+        }
+    }
+
+    void clear()
+    {
+        m_slots.clear();
+        m_removed = 0;
+        m_positions.clear();
+    }
+
+    /// drops all the tombstones
+    void compact()
+    {
+        for (size_t i = 0; i != m_slots.size(); ++i)
+            if (m_slots[i].removed)
+                compact_keys(m_slots[i]);
+        if (m_removed)
+            compact_sections();
+    }
+
+    void count_memory(MemoryCounter &counter) const
+    {
+        counter.add_vector(m_slots);
+        counter.add_hash_table(m_positions);
+        for (size_t i = 0; i != m_slots.size(); ++i)
+        {
+            counter.add_vector(m_slots[i].keys);
+            counter.add_hash_table(m_slots[i].positions);
+        }
+    }
+
+private:
+    void compact_sections()
+    {
+        size_t count = 0;
+        for (size_t i = 0; i != m_slots.size(); ++i)
+        {
+            if (!m_slots[i].section)
+                continue;
+
+            if (count != i)
+            {
+                m_slots[count].section = m_slots[i].section;
+                m_slots[count].keys.swap(m_slots[i].keys);
+                m_slots[count].removed = m_slots[i].removed;
+                m_slots[count].positions.swap(m_slots[i].positions);
+                m_positions[&m_slots[count].section->first] = count;
+            }
+            ++count;
+        }
+        m_slots.erase(m_slots.begin() + count, m_slots.end());
+        m_removed = 0;
+    }
+
+    static void compact_keys(Slot &slot)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i != slot.keys.size(); ++i)
+        {
+            if (!slot.keys[i])
+                continue;
+
+            if (count != i)
+            {
+                slot.keys[count] = slot.keys[i];
+                slot.positions[&slot.keys[count]->first] = count;
+            }
+            ++count;
+        }
+        slot.keys.resize(count);
+        slot.removed = 0;
+    }
+
+private:
+    bool m_fold;
+    bool m_held;
+    Slots m_slots;
+    size_t m_removed; // of the sections
+    Positions m_positions;
+};
+
+class StorageImpl
+{
+private:
+
+    typedef std::map<std::string, Storage::Values, NameLess> Keys;
+    typedef std::map<std::string, Keys, NameLess> Sections;
+    typedef InsertionOrder<Sections> Order;
+
+public:
+    StorageImpl(unsigned options)
+        : m_options(options)
+        , m_content(NameLess((options & Storage::OPTION__CASE_INSENSITIVE) != 0))
+        , m_hierarchy(0)
+        , m_expansions(m_content.key_comp())
+        , m_value_index(m_content.key_comp())
+        , m_observer(0)
+        , m_journal(0)
+        , m_order((options & Storage::OPTION__ORDERED) ? new Order(m_content.key_comp().fold()) : 0)
+    {}
+
+    unsigned options() const
+    {
+        return m_options;
+    }
+
+    ~StorageImpl()
+    {
+        delete m_journal;
+        delete m_order;
+        delete m_hierarchy;
+    }
+
+    bool parse(const std::string &text, Storage::Callback *callback)
+    {
+        clear();
+
+        NoParseStats stats;
+        return parse(text, callback, *this, stats, (m_options & Storage::OPTION__UTF8) != 0);
+    }
+
+    bool parse(const std::string &text, Storage::ParseResult &result, Storage::Callback *callback)
+    {
+        clear();
+
+        ParseStats stats(result);
+        bool success = parse(text, callback, *this, stats, (m_options & Storage::OPTION__UTF8) != 0);
+        stats.finish(success, text.length());
+
+        count(result);
+        return success;
+    }
+
+    static bool scan(const std::string &text, Storage::Visitor &visitor, Storage::Callback *callback, unsigned options)
+    {
+        NoParseStats stats;
+        return parse(text, callback, visitor, stats, (options & Storage::OPTION__UTF8) != 0);
+    }
+
+    static bool scan_file(const std::string &path, Storage::Visitor &visitor, Storage::Callback *callback, unsigned options)
+    {
+        std::string text;
+        if (!read_file(path, text))
+            return false;
+
+        return scan(text, visitor, callback, options);
+    }
+
+    /// Grammar::parse() into the heap types
+    template <typename Target, typename Stats>
+    static bool parse(const std::string &text, Storage::Callback *callback, Target &target, Stats &stats, bool utf8)
+    {
+        std::string current_section;
+        std::string current_key;
+        Storage::Values current_values;
+        Storage::Value current_value;
+
+        return Grammar::parse(text, callback, target, stats, utf8, current_section, current_key, current_values, current_value);
+    }
+
+    /// parses into the buffer without the heap, see FixedArena
+    static bool parse_fixed(const char *text, size_t length, char *buffer, size_t size, size_t &required, Storage::Callback *callback, unsigned options)
+    {
+        FixedArena arena(buffer, size);
+        FixedBytes current_section(arena);
+        FixedBytes current_key(arena);
+        FixedValues current_values(arena);
+        FixedBytes current_value(arena);
+
+        NoParseStats stats;
+        bool success = Grammar::parse(FixedText(text, length), callback, arena, stats, (options & Storage::OPTION__UTF8) != 0,
+            current_section, current_key, current_values, current_value);
+
+        required = arena.required();
+        return success && arena.finish((options & Storage::OPTION__CASE_INSENSITIVE) != 0);
+    }
+
+    /// parse() target of the storage itself
+    bool entry(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        store_values(section, key, values);
+        return true;
+    }
+
+    void count(Storage::ParseResult &result) const
+    {
+        result.section_count = m_content.size();
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            result.key_count += SI->second.size();
+
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+                result.value_count += KI->second.size();
+        }
+    }
+
+    bool load(const std::string &path, Storage::Callback *callback)
+    {
+        bool success;
+        if (take_prefetched(path, callback, success))
+            return success;
+
+        std::string text;
+        if (!read_file(path, text))
+            return false;
+
+        return parse(text, callback);
+    }
+
+    bool load(const std::string &path, Storage::ParseResult &result, Storage::Callback *callback)
+    {
+        Clock::time_point start = Clock::now();
+
+        std::string text;
+        if (!read_file(path, text))
+        {
+            memset(&result, 0, sizeof(result));
+            return false;
+        }
+
+        uint64_t read_time = nanoseconds(Clock::now() - start);
+
+        bool success = parse(text, result, callback);
+        result.read_time = read_time;
+        result.total_time += read_time;
+        return success;
+    }
+
+    std::future<bool> load_async(const std::string &path, Storage::Callback *callback)
+    {
+        std::shared_ptr<std::packaged_task<bool()> > task = std::make_shared<std::packaged_task<bool()> >(
+            [this, path, callback]() { return load(path, callback); });
+
+        std::future<bool> result = task->get_future();
+        TaskPool::instance().run([task]() { (*task)(); });
+        return result;
+    }
+
+    static void prefetch(const std::vector<std::string> &paths, unsigned options)
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        for (size_t i = 0; i != paths.size(); ++i)
+        {
+            Prefetch &prefetch = prefetches[std::make_pair(paths[i], options)];
+            if (prefetch.fragment)
+                continue;
+
+            std::shared_ptr<Fragment> fragment = std::make_shared<Fragment>();
+            fragment->path = paths[i];
+            fragment->storage = new StorageImpl(options);
+
+            std::shared_ptr<std::atomic<bool> > claimed = std::make_shared<std::atomic<bool> >(false);
+            std::shared_ptr<std::promise<void> > done = std::make_shared<std::promise<void> >();
+            prefetch.fragment = fragment;
+            prefetch.claimed = claimed;
+            prefetch.done = done->get_future().share();
+
+            TaskPool::instance().run([fragment, claimed, done]()
+            {
+                if (!claimed->exchange(true))
+                {
+                    fragment->stamped = stat_source(fragment->path, fragment->source);
+                    load_fragment(*fragment);
+                }
+                done->set_value();
+            });
+        }
+    }
+
+    static void cancel_prefetch()
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        prefetches.clear();
+    }
+
+    bool load_directory(const std::string &path, const std::string &pattern, Storage::Callback *callback, Storage::MergePolicy policy, unsigned max_threads)
+    {
+        std::vector<std::string> names;
+        if (!list_directory(path, pattern, names))
+        {
+            if (callback)
+                callback->read_error(path, errno);
+            return false;
+        }
+
+        std::vector<Fragment> fragments(names.size());
+        for (size_t i = 0; i != names.size(); ++i)
+        {
+            fragments[i].path = path + '/' + names[i];
+            fragments[i].storage = new StorageImpl(m_options);
+        }
+
+        unsigned threads = max_threads ? max_threads : std::thread::hardware_concurrency();
+        threads = std::max(1u, std::min<unsigned>(threads, fragments.size()));
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i)
+            workers.push_back(std::thread(load_fragments, &fragments, &next));
+        load_fragments(&fragments, &next);
+        for (size_t i = 0; i != workers.size(); ++i)
+            workers[i].join();
+
+        clear();
+
+        bool result = true;
+        for (size_t i = 0; i != fragments.size(); ++i)
+        {
+            Fragment &fragment = fragments[i];
+            if (callback)
+            {
+                if (fragment.read_error)
+                    callback->read_error(fragment.path, fragment.read_error);
+                fragment.callback.replay(fragment.path, callback);
+            }
+
+            if (!fragment.success)
+            {
+                result = false;
+                continue;
+            }
+
+            merge(*fragment.storage, policy);
+        }
+
+        return result;
+    }
+
+    std::string generate() const
+    {
+        std::string result;
+        result.reserve(generated_size());
+
+        Storage::StringSink sink(result);
+        generate_to(sink);
+
+        return result;
+    }
+
+    size_t generated_size() const
+    {
+        bool utf8 = (m_options & Storage::OPTION__UTF8) != 0;
+        size_t result = 0;
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+            result += generated_size(SI, utf8);
+
+        return result;
+    }
+
+    bool generate_to(Storage::Sink &sink) const
+    {
+        bool utf8 = (m_options & Storage::OPTION__UTF8) != 0;
+        if (m_order)
+            return generate_ordered(sink, utf8) && sink.flush();
+
+        return generate_to(sink, m_content.begin(), m_content.end(), utf8) && sink.flush();
+    }
+
+    /// sizes the output once, then every thread encodes a contiguous range of sections straight into its part;
+    /// the ranges follow the map, so an ordered storage is encoded on the calling thread
+    std::string generate_parallel(unsigned max_threads) const
+    {
+        if (m_order)
+            return generate();
+
+        bool utf8 = (m_options & Storage::OPTION__UTF8) != 0;
+
+        std::vector<size_t> sizes;
+        sizes.reserve(m_content.size());
+        size_t total = 0;
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            sizes.push_back(generated_size(SI, utf8));
+            total += sizes.back();
+        }
+
+        std::string result(total, '\0');
+        if (!total)
+            return result;
+
+        unsigned threads = max_threads ? max_threads : std::thread::hardware_concurrency();
+        threads = std::max(1u, std::min<unsigned>(threads, sizes.size()));
+
+        // the ranges end at the first section boundary past an equal share of the bytes
+        std::vector<Range> ranges;
+        Sections::const_iterator SI = m_content.begin();
+        size_t section = 0;
+        size_t offset = 0;
+        for (unsigned i = 0; i != threads; ++i)
+        {
+            size_t limit = (i + 1 == threads) ? total : total / threads * (i + 1);
+
+            Range range;
+            range.first = SI;
+            range.data = &result[offset];
+            range.size = offset;
+            while ((SI != SM) && (offset < limit))
+            {
+                offset += sizes[section++];
+                ++SI;
+            }
+            range.last = SI;
+            range.size = offset - range.size;
+
+            if (range.size)
+                ranges.push_back(range);
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < ranges.size(); ++i)
+            workers.push_back(std::thread(&StorageImpl::generate_range, this, &ranges[i], utf8));
+        generate_range(&ranges[0], utf8);
+        for (size_t i = 0; i != workers.size(); ++i)
+            workers[i].join();
+
+        return result;
+    }
+
+    bool save_parallel(const std::string &path, unsigned max_threads) const
+    {
+        std::string text = generate_parallel(max_threads);
+        return replace_file(path, text.size(), BufferGenerator(text));
+    }
+
+    bool save(const std::string &path) const
+    {
+        return replace_file(path, generated_size(), TextGenerator(*this));
+    }
+
+    std::string generate_binary(const ImageSource &source) const
+    {
+        uint64_t key_count = 0;
+        uint64_t value_count = 0;
+        uint64_t bytes_size = 0;
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            bytes_size += SI->first.length();
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+            {
+                ++key_count;
+                bytes_size += KI->first.length();
+                value_count += KI->second.size();
+                for (size_t i = 0; i != KI->second.size(); ++i)
+                    bytes_size += KI->second[i].size();
+            }
+        }
+
+        ImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, IMAGE__MAGIC, sizeof(IMAGE__MAGIC));
+        header.version = IMAGE_VERSION__CURRENT;
+        if (m_content.key_comp().fold())
+            header.flags |= IMAGE_FLAG__CASE_INSENSITIVE;
+        header.source = source;
+        header.section_count = m_content.size();
+        header.key_count = key_count;
+        header.value_count = value_count;
+        header.sections_offset = sizeof(ImageHeader);
+        header.keys_offset = header.sections_offset + header.section_count * sizeof(ImageSection);
+        header.values_offset = header.keys_offset + header.key_count * sizeof(ImageKey);
+        header.bytes_offset = header.values_offset + header.value_count * sizeof(ImageValue);
+        header.size = (header.bytes_offset + bytes_size + 7) & ~static_cast<uint64_t>(7);
+
+        std::string result(header.size, '\0');
+        char *data = &result[0];
+
+        uint32_t key_index = 0;
+        uint32_t value_index = 0;
+        uint64_t offset = 0;
+        char *sections = data + header.sections_offset;
+        char *keys = data + header.keys_offset;
+        char *values = data + header.values_offset;
+        char *bytes = data + header.bytes_offset;
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            ImageSection section = { offset, static_cast<uint32_t>(SI->first.length()), key_index, static_cast<uint32_t>(SI->second.size()), 0 };
+            memcpy(sections, &section, sizeof(section));
+            sections += sizeof(section);
+            memcpy(bytes + offset, SI->first.data(), SI->first.length());
+            offset += SI->first.length();
+
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI, ++key_index)
+            {
+                ImageKey key = { offset, static_cast<uint32_t>(KI->first.length()), value_index, static_cast<uint32_t>(KI->second.size()), 0 };
+                memcpy(keys, &key, sizeof(key));
+                keys += sizeof(key);
+                memcpy(bytes + offset, KI->first.data(), KI->first.length());
+                offset += KI->first.length();
+
+                for (size_t i = 0; i != KI->second.size(); ++i, ++value_index)
+                {
+                    const Storage::Value &value_data = KI->second[i];
+                    ImageValue value = { offset, value_data.size() };
+                    memcpy(values, &value, sizeof(value));
+                    values += sizeof(value);
+                    if (!value_data.empty())
+                        memcpy(bytes + offset, &value_data[0], value_data.size());
+                    offset += value_data.size();
+                }
+            }
+        }
+
+        header.checksum = image_hash(data + sizeof(ImageHeader), header.size - sizeof(ImageHeader));
+        memcpy(data, &header, sizeof(header));
+
+        return result;
+    }
+
+    bool parse_binary(const char *data, size_t size)
+    {
+        std::vector<uint64_t> aligned;
+        if (reinterpret_cast<uintptr_t>(data) % 8)
+        {
+            aligned.resize(size / 8 + 1);
+            memcpy(&aligned[0], data, size);
+            data = reinterpret_cast<const char *>(&aligned[0]);
+        }
+
+        ImageView view;
+        if (!view.attach(data, size))
+            return false;
+
+        load_image(view);
+        return true;
+    }
+
+    bool save_binary(const std::string &path) const
+    {
+        ImageSource source;
+        memset(&source, 0, sizeof(source));
+
+        std::string image = generate_binary(source);
+        return replace_file(path, image.size(), BufferGenerator(image));
+    }
+
+    bool load_binary(const std::string &path)
+    {
+        ImageFile file;
+        if (!file.open(path))
+            return false;
+
+        return parse_binary(file.data(), file.size());
+    }
+
+    bool load_cached(const std::string &path, const std::string &snapshot_path, Storage::Callback *callback)
+    {
+        ImageSource source;
+        ImageFile file;
+        ImageView view;
+        if (stat_source(path, source) && file.open(snapshot_path) && view.attach(file.data(), file.size(), false) && is_same_source(view.header().source, source))
+        {
+            load_image(view);
+            return true;
+        }
+        file.close();
+
+        std::string text;
+        if (!read_file(path, text, &source))
+            return false;
+
+        if (!parse(text, callback))
+            return false;
+
+        // the snapshot is only a cache, failing to write it does not fail the load
+        std::string image = generate_binary(source);
+        replace_file(snapshot_path, image.size(), BufferGenerator(image));
+
+        return true;
+    }
+
+    void clear()
+    {
+        m_content.clear();
+        if (m_order)
+            m_order->clear();
+        if (m_hierarchy)
+            m_hierarchy->clear();
+        m_expansions.clear();
+        m_value_index.clear();
+    }
+
+    Storage::Strings get_all_sections() const
+    {
+        Storage::Strings result;
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+            result.insert(SI->first);
+
+        return result;
+    }
+
+    bool is_section_exist(const std::string &section) const
+    {
+        if (m_order)
+            return m_order->find(section) != 0;
+
+        return m_content.find(section) != m_content.end();
+    }
+
+    bool visit_sections(Storage::Visitor &visitor) const
+    {
+        if (m_order)
+        {
+            const Order::Slots &slots = m_order->slots();
+            for (size_t i = 0; i != slots.size(); ++i)
+                if (slots[i].section && !visitor.section(slots[i].section->first))
+                    return false;
+
+            return true;
+        }
+
+        return visit_sections(m_content.begin(), m_content.end(), visitor);
+    }
+
+    bool visit_sections_with_prefix(const std::string &prefix, Storage::Visitor &visitor) const
+    {
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.lower_bound(prefix); (SI != SM) && has_prefix(SI->first, prefix, m_content.key_comp()); ++SI)
+            if (!visitor.section(SI->first))
+                return false;
+
+        return true;
+    }
+
+    bool visit_sections_in_range(const std::string &first, const std::string &last, Storage::Visitor &visitor) const
+    {
+        if (!m_content.key_comp()(first, last))
+            return true;
+
+        return visit_sections(m_content.lower_bound(first), m_content.lower_bound(last), visitor);
+    }
+
+    bool visit_entries(Storage::Visitor &visitor) const
+    {
+        if (m_order)
+        {
+            const Order::Slots &slots = m_order->slots();
+            for (size_t i = 0; i != slots.size(); ++i)
+            {
+                if (!slots[i].section)
+                    continue;
+                if (!visitor.section(slots[i].section->first))
+                    return false;
+                if (!visit_keys(slots[i], visitor))
+                    return false;
+            }
+
+            return true;
+        }
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            if (!visitor.section(SI->first))
+                return false;
+            if (!visit_keys(SI, SI->second.begin(), visitor, 0))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool remove_section(const std::string &section)
+    {
+        Sections::iterator SI = m_content.find(section);
+        if (SI == m_content.end())
+            return false;
+
+        if (m_journal)
+        {
+            JournalOps ops(1);
+            make_journal_op(ops[0], JOURNAL_OP__REMOVE_SECTION, section, std::string(), Storage::Values());
+            m_journal->append(ops);
+        }
+
+        erase_section(SI);
+        return true;
+    }
+
+    bool rename_section(const std::string &section, const std::string &new_section)
+    {
+        Sections::iterator SI = m_content.find(section);
+        if (SI == m_content.end())
+            return false;
+        if (is_section_exist(new_section))
+            return false;
+
+        if (m_journal)
+        {
+            JournalOps ops(1);
+            ops.reserve(SI->second.size() + 2);
+            make_journal_op(ops[0], JOURNAL_OP__RENAME_SECTION, section, new_section, Storage::Values());
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+            {
+                ops.resize(ops.size() + 1);
+                make_journal_op(ops.back(), JOURNAL_OP__SET, new_section, KI->first, KI->second);
+            }
+            ops.resize(ops.size() + 1);
+            make_journal_op(ops.back(), JOURNAL_OP__REMOVE_SECTION, section, std::string(), Storage::Values());
+            m_journal->append(ops);
+        }
+
+        move_section(SI, new_section);
+        return true;
+    }
+
+    void set_hierarchy_index(bool enabled)
+    {
+        if (!enabled)
+        {
+            delete m_hierarchy;
+            m_hierarchy = 0;
+        }
+        else if (!m_hierarchy)
+        {
+            m_hierarchy = new HierarchyIndex(m_content.key_comp());
+
+            Sections::const_iterator SM = m_content.end();
+            for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+                m_hierarchy->add(SI->first);
+        }
+    }
+
+    bool visit_child_sections(const std::string &section, Storage::Visitor &visitor) const
+    {
+        if (m_hierarchy)
+            return m_hierarchy->visit_children(section, visitor);
+
+        // without the index, the children are the distinct next components within the subtree range;
+        // a child with its own section comes before its descendants, but "a-b" sorts between "a" and "a.c",
+        // so a child met through a descendant was already met if its section exists
+        std::string prefix = section.empty() ? section : section + ".";
+        std::vector<std::string> children;
+        Sections::const_iterator SM = m_content.end();
+        Sections::const_iterator SI = m_content.lower_bound(prefix);
+        while ((SI != SM) && has_prefix(SI->first, prefix, m_content.key_comp()))
+        {
+            if (SI->first.empty())
+            {
+                ++SI;
+                continue;
+            }
+
+            std::string::size_type dot = SI->first.find('.', prefix.length());
+            std::string child = SI->first.substr(0, dot);
+            if ((dot == SI->first.npos) || (m_content.find(child) == SM))
+                children.push_back(child);
+
+            // "child." up to "child/" holds only the descendants of the child
+            if (dot == SI->first.npos)
+                ++SI;
+            else
+                SI = m_content.lower_bound(child + "/");
+        }
+
+        // in the order of the index
+        std::sort(children.begin(), children.end(), m_content.key_comp());
+        for (size_t i = 0; i != children.size(); ++i)
+            if (!visitor.section(children[i]))
+                return false;
+
+        return true;
+    }
+
+    Storage::Strings get_child_sections(const std::string &section) const
+    {
+        SectionCollector collector;
+        visit_child_sections(section, collector);
+
+        return Storage::Strings(collector.m_sections.begin(), collector.m_sections.end());
+    }
+
+    bool visit_subtree(const std::string &section, Storage::Visitor &visitor) const
+    {
+        if (m_hierarchy)
+            return m_hierarchy->visit_subtree(section, visitor);
+
+        // in the depth-first order of the index
+        std::vector<std::string> names;
+        Sections::const_iterator SM = m_content.end();
+        if (section.empty())
+        {
+            for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+                names.push_back(SI->first);
+        }
+        else
+        {
+            Sections::const_iterator SI = m_content.find(section);
+            if (SI != SM)
+                names.push_back(SI->first);
+
+            std::string prefix = section + ".";
+            for (SI = m_content.lower_bound(prefix); (SI != SM) && has_prefix(SI->first, prefix, m_content.key_comp()); ++SI)
+                names.push_back(SI->first);
+        }
+        std::sort(names.begin(), names.end(), HierarchyLess(m_content.key_comp().fold()));
+
+        for (size_t i = 0; i != names.size(); ++i)
+            if (!visitor.section(names[i]))
+                return false;
+
+        return true;
+    }
+
+    size_t remove_subtree(const std::string &section)
+    {
+        SectionCollector collector;
+        visit_subtree(section, collector);
+
+        std::vector<Sections::iterator> found;
+        found.reserve(collector.m_sections.size());
+        for (size_t i = 0; i != collector.m_sections.size(); ++i)
+        {
+            Sections::iterator SI = m_content.find(collector.m_sections[i]);
+            if (SI != m_content.end())
+                found.push_back(SI);
+        }
+
+        // one record for the whole subtree, so it is synced once and replayed whole or not at all
+        if (m_journal && !found.empty())
+        {
+            JournalOps ops(found.size());
+            for (size_t i = 0; i != found.size(); ++i)
+                make_journal_op(ops[i], JOURNAL_OP__REMOVE_SECTION, found[i]->first, std::string(), Storage::Values());
+            m_journal->append(ops);
+        }
+
+        for (size_t i = 0; i != found.size(); ++i)
+            erase_section(found[i]);
+
+        return found.size();
+    }
+
+    Storage::Strings get_all_keys(const std::string &section) const
+    {
+        Storage::Strings result;
+
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI != m_content.end())
+        {
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+                result.insert(KI->first);
+        }
+
+        return result;
+    }
+
+    bool is_key_exist(const std::string &section, const std::string &key) const
+    {
+        if (m_order)
+            return m_order->find(section, key) != 0;
+
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI != m_content.end())
+            return SI->second.find(key) != SI->second.end();
+
+        return false;
+    }
+
+    bool visit_keys(const std::string &section, Storage::Visitor &visitor) const
+    {
+        if (m_order)
+        {
+            const Order::Slot *slot = m_order->find(section);
+            return !slot || visit_keys(*slot, visitor);
+        }
+
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI == m_content.end())
+            return true;
+
+        return visit_keys(SI, SI->second.begin(), visitor, 0);
+    }
+
+    bool visit_keys_with_prefix(const std::string &section, const std::string &prefix, Storage::Visitor &visitor) const
+    {
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI == m_content.end())
+            return true;
+
+        return visit_keys(SI, SI->second.lower_bound(prefix), visitor, &prefix);
+    }
+
+    bool is_list(const std::string &section, const std::string &key) const
+    {
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI != m_content.end())
+        {
+            Keys::const_iterator KI = SI->second.find(key);
+            if (KI != SI->second.end())
+                return KI->second.size() > 1;
+        }
+
+        return false;
+    }
+
+    bool contains_binary(const std::string &section, const std::string &key) const
+    {
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI != m_content.end())
+        {
+            Keys::const_iterator KI = SI->second.find(key);
+            if (KI != SI->second.end())
+                return KI->second.contains_binary();
+        }
+
+        return false;
+    }
+
+    bool contains_binary_utf8(const std::string &section, const std::string &key) const
+    {
+        const Storage::Values *values = find_values(section, key);
+        return values && values->contains_binary_utf8();
+    }
+
+    std::pair<bool, std::string> get_string(const std::string &section, const std::string &key, const std::string &default_value) const
+    {
+        const Storage::Values *values = find_values(section, key);
+#if defined(INIPLUS_ACCESS_STATS)
+        m_access_stats.count(section, key, values, !default_value.empty());
+#endif
+        if (!values)
+            return std::make_pair(false, default_value);
+
+        return std::make_pair(true, values->empty() ? std::string() : static_cast<std::string>(values->front()));
+    }
+
+    std::pair<bool, Storage::Values> get_values(const std::string &section, const std::string &key, const Storage::Values &default_values) const
+    {
+        const Storage::Values *values = find_values(section, key);
+#if defined(INIPLUS_ACCESS_STATS)
+        m_access_stats.count(section, key, values, !default_values.empty());
+#endif
+        if (!values)
+            return std::make_pair(false, default_values);
+
+        return std::make_pair(true, *values);
+    }
+
+    std::pair<bool, std::string> get_expanded_string(const std::string &section, const std::string &key, const std::string &default_value) const
+    {
+        std::lock_guard<std::mutex> lock(m_expansions.mutex());
+
+        std::vector<ExpansionCache::Name> chain;
+        Storage::Values values;
+        bool cyclic = false;
+        if (!expand(section, key, chain, values, cyclic))
+            return std::make_pair(false, default_value);
+
+        return std::make_pair(true, values.empty() ? std::string() : static_cast<std::string>(values.front()));
+    }
+
+    std::pair<bool, Storage::Values> get_expanded_values(const std::string &section, const std::string &key, const Storage::Values &default_values) const
+    {
+        std::lock_guard<std::mutex> lock(m_expansions.mutex());
+
+        std::vector<ExpansionCache::Name> chain;
+        Storage::Values values;
+        bool cyclic = false;
+        if (!expand(section, key, chain, values, cyclic))
+            return std::make_pair(false, default_values);
+
+        return std::make_pair(true, values);
+    }
+
+    Storage::Locations find_value(const std::string &value) const
+    {
+        std::lock_guard<std::mutex> lock(m_value_index.mutex());
+        if (!m_value_index.is_built())
+            build_value_index();
+
+        Storage::Locations result;
+        const ValueIndex::Bucket *bucket = m_value_index.find(value.data(), value.size());
+        if (!bucket)
+            return result;
+
+        ValueIndex::Bucket::const_iterator BM = bucket->end();
+        for (ValueIndex::Bucket::const_iterator BI = bucket->begin(); BI != BM; ++BI)
+        {
+            Sections::const_iterator SI = m_content.find(BI->section);
+            if (SI == m_content.end())
+                continue;
+            Keys::const_iterator KI = SI->second.find(BI->key);
+            if ((KI == SI->second.end()) || (BI->index >= KI->second.size()))
+                continue;
+
+            const Storage::Value &stored = KI->second[BI->index];
+            if ((stored.size() != value.size()) || (!stored.empty() && memcmp(&stored[0], value.data(), value.size())))
+                continue;
+
+            result.resize(result.size() + 1);
+            result.back().section = SI->first;
+            result.back().key = KI->first;
+            result.back().index = BI->index;
+        }
+
+        return result;
+    }
+
+    void set_value_index(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(m_value_index.mutex());
+        if (!enabled)
+            m_value_index.clear();
+        else if (!m_value_index.is_built())
+            build_value_index();
+    }
+
+    Storage::MemoryUsage memory_usage() const
+    {
+        Storage::MemoryUsage result;
+        memset(&result, 0, sizeof(result));
+        result.overhead_bytes = sizeof(*this);
+        result.block_count = 1;
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            result.overhead_bytes += MemoryCounter::tree_node_size<Sections>();
+            ++result.block_count;
+            count_name(SI->first, result);
+
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+            {
+                result.overhead_bytes += MemoryCounter::tree_node_size<Keys>();
+                ++result.block_count;
+                count_name(KI->first, result);
+
+                const Storage::Values &values = KI->second;
+                if (values.capacity())
+                {
+                    result.overhead_bytes += values.size() * sizeof(Storage::Value);
+                    result.slack_bytes += (values.capacity() - values.size()) * sizeof(Storage::Value);
+                    ++result.block_count;
+                }
+                for (size_t i = 0; i != values.size(); ++i)
+                {
+                    if (!values[i].capacity())
+                        continue;
+
+                    result.value_bytes += values[i].size();
+                    result.slack_bytes += values[i].capacity() - values[i].size();
+                    ++result.block_count;
+                }
+            }
+        }
+
+        MemoryCounter counter;
+        if (m_order)
+            m_order->count_memory(counter);
+        if (m_hierarchy)
+            m_hierarchy->count_memory(counter);
+        {
+            std::lock_guard<std::mutex> lock(m_expansions.mutex());
+            m_expansions.count_memory(counter);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_value_index.mutex());
+            m_value_index.count_memory(counter);
+        }
+        result.index_bytes = counter.bytes;
+        result.block_count += counter.blocks;
+
+        result.total_bytes = result.name_bytes + result.value_bytes + result.overhead_bytes + result.slack_bytes + result.index_bytes;
+        return result;
+    }
+
+    /// the names are immutable map keys, the parser and the setters already allocate them to size
+    size_t shrink_to_fit()
+    {
+        size_t released = 0;
+        if (m_order)
+            m_order->compact();
+
+        Sections::iterator SM = m_content.end();
+        for (Sections::iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            Keys::iterator KM = SI->second.end();
+            for (Keys::iterator KI = SI->second.begin(); KI != KM; ++KI)
+            {
+                Storage::Values &values = KI->second;
+                for (size_t i = 0; i != values.size(); ++i)
+                {
+                    size_t capacity = values[i].capacity();
+                    values[i].shrink_to_fit();
+                    released += capacity - values[i].capacity();
+                }
+
+                size_t capacity = values.capacity();
+                values.shrink_to_fit();
+                released += (capacity - values.capacity()) * sizeof(Storage::Value);
+            }
+        }
+
+        return released;
+    }
+
+    void get_batch(const Storage::Lookup *lookups, size_t count, Storage::LookupResult *results) const
+    {
+        size_t stack_order[64];
+        std::vector<size_t> heap_order;
+        size_t *order = stack_order;
+        if (count > 64)
+        {
+            heap_order.resize(count);
+            order = &heap_order[0];
+        }
+        NameLess less = m_content.key_comp();
+        sort_lookups(lookups, count, order, less);
+
+        Sections::const_iterator SM = m_content.end();
+        Sections::const_iterator SI = SM;
+        Keys::const_iterator KI;
+        const std::string *section = 0;
+        for (size_t i = 0; i != count; ++i)
+        {
+            const Storage::Lookup &lookup = lookups[order[i]];
+            Storage::LookupResult &result = results[order[i]];
+
+            if (!section || !less.equal(*section, *lookup.section))
+            {
+                section = lookup.section;
+                SI = m_content.find(*section);
+                if (SI != SM)
+                    KI = SI->second.begin();
+            }
 
-public:
-    StorageImpl()
-    {}
+            if (SI == SM)
+            {
+                set_default_result(lookup, result);
+                continue;
+            }
 
-    ~StorageImpl()
-    {}
+            // the keys come sorted, so the next one is usually a few steps ahead
+            Keys::const_iterator KM = SI->second.end();
+            int steps = 0;
+            while ((KI != KM) && less(KI->first, *lookup.key) && (steps++ < 8))
+                ++KI;
+            if ((KI != KM) && less(KI->first, *lookup.key))
+                KI = SI->second.lower_bound(*lookup.key);
 
-    bool parse(const std::string &text, Storage::Callback *callback)
+            if ((KI == KM) || !less.equal(KI->first, *lookup.key))
+            {
+                set_default_result(lookup, result);
+                continue;
+            }
+
+            const Storage::Values &values = KI->second;
+            result.found = true;
+            result.values = &values;
+            result.count = values.size();
+            result.data = 0;
+            result.size = 0;
+            if (!values.empty() && !values.front().empty())
+            {
+                result.data = &values.front()[0];
+                result.size = values.front().size();
+            }
+        }
+
+#if defined(INIPLUS_ACCESS_STATS)
+        for (size_t i = 0; i != count; ++i)
+            m_access_stats.count(*lookups[i].section, *lookups[i].key, results[i].found, lookups[i].default_values && !lookups[i].default_values->empty());
+#endif
+    }
+
+    Storage::AccessCounts access_stats() const
     {
-/*  [ A-Za-z0-9_-. %xx ] ;...
- *  s                    c
- *  s n             hxec
- *
- *  A-Za-z0-9_-. %xx = "0x21-0x7e \? \xxx" , ;...
- *  k                e v                   e c
- *  n             hx q qs          b   hxe q
- */
-        clear();
+        Storage::AccessCounts result;
+#if defined(INIPLUS_ACCESS_STATS)
+        AccessStats::Totals totals;
+
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+        {
+            Keys::const_iterator KM = SI->second.end();
+            for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+                totals[std::make_pair(SI->first, KI->first)];
+        }
 
-        Context context = CONTEXT__NEWLINE;
-        Context last_context = context; // to shut up the compiler
+        m_access_stats.collect(totals);
 
-        std::string current_section;
-        std::string current_key;
-        Storage::Values current_values;
-        Storage::Value current_value;
+        result.reserve(totals.size());
+        AccessStats::Totals::iterator TM = totals.end();
+        for (AccessStats::Totals::iterator TI = totals.begin(); TI != TM; ++TI)
+        {
+            TI->second.section = TI->first.first;
+            TI->second.key = TI->first.second;
+            result.push_back(TI->second);
+        }
+#endif
+        return result;
+    }
+
+    void reset_access_stats()
+    {
+#if defined(INIPLUS_ACCESS_STATS)
+        m_access_stats.reset();
+#endif
+    }
+
+    void set_string(const std::string &section, const std::string &key, const std::string &value)
+    {
+        Storage::Values values;
+        values.push_back(value);
+
+        set_values(section, key, values);
+    }
+
+    void set_values(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        store_values(section, key, values);
+
+        if (m_journal)
+        {
+            JournalOps ops(1);
+            make_journal_op(ops[0], JOURNAL_OP__SET, section, key, values);
+            m_journal->append(ops);
+        }
+
+        if (m_observer)
+        {
+            Storage::Changes changes(1);
+            make_change(changes[0], Storage::CHANGE_TYPE__SET, section, key, values);
+            m_observer->changed(changes);
+        }
+    }
+
+    bool remove_key(const std::string &section, const std::string &key)
+    {
+        if (!erase_key(section, key))
+            return false;
+
+        if (m_journal)
+        {
+            JournalOps ops(1);
+            make_journal_op(ops[0], JOURNAL_OP__REMOVE, section, key, Storage::Values());
+            m_journal->append(ops);
+        }
+
+        if (m_observer)
+        {
+            Storage::Changes changes(1);
+            make_change(changes[0], Storage::CHANGE_TYPE__REMOVE, section, key, Storage::Values());
+            m_observer->changed(changes);
+        }
+
+        return true;
+    }
+
+    bool rename_key(const std::string &section, const std::string &key, const std::string &new_section, const std::string &new_key)
+    {
+        if (!is_key_exist(section, key))
+            return false;
+        if (is_key_exist(new_section, new_key))
+            return false;
+
+        Storage::Changes changes(m_observer ? 2 : 0);
+        if (m_observer)
+        {
+            make_change(changes[0], Storage::CHANGE_TYPE__SET, new_section, new_key, *find_values(section, key));
+            make_change(changes[1], Storage::CHANGE_TYPE__REMOVE, section, key, Storage::Values());
+        }
+
+        if (m_journal)
+        {
+            JournalOps ops(2);
+            make_journal_op(ops[0], JOURNAL_OP__SET, new_section, new_key, *find_values(section, key));
+            make_journal_op(ops[1], JOURNAL_OP__REMOVE, section, key, Storage::Values());
+            m_journal->append(ops);
+        }
+
+        store_values(new_section, new_key, *find_values(section, key));
+        erase_key(section, key);
+
+        if (m_observer)
+            m_observer->changed(changes);
 
-        size_t length = text.length();
+        return true;
+    }
+
+    void set_observer(Storage::Observer *observer)
+    {
+        m_observer = observer;
+    }
 
-        size_t cur_char = 1;
-        size_t cur_line = 1;
-        size_t cur_pos = 0;
-        for (; cur_pos < length; ++cur_pos, ++cur_char)
+    /// the later change of a key replaces the earlier ones, the emptied sections are checked once per section
+    bool commit(Storage::Changes &changes, Storage::Validator *validator)
+    {
+        ChangeLess change_less(changes, m_content.key_comp());
+        std::vector<size_t> order(changes.size());
+        for (size_t i = 0; i != order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), change_less);
+
+        std::vector<Undo> undo;
+        Storage::Changes applied;
+        OrderHold hold(m_order);
+        Sections::iterator SM = m_content.end();
+        Sections::iterator SI = SM;
+        const std::string *section = 0;
+        for (size_t i = 0; i != order.size(); ++i)
         {
-            const char &input = text[cur_pos];
+            if ((i + 1 != order.size()) && change_less.equal(order[i], order[i + 1]))
+                continue;
+
+            Storage::Change &change = changes[order[i]];
+            if (!section || !m_content.key_comp().equal(*section, change.section))
+            {
+                erase_if_empty(SI);
+                section = &change.section;
+                SI = m_content.find(change.section);
+            }
+
+            Keys::iterator KI;
+            const Storage::Values *old_values = 0;
+            if (SI != SM)
+            {
+                KI = SI->second.find(change.key);
+                if (KI != SI->second.end())
+                    old_values = &KI->second;
+            }
 
-            CharClass char_class = get_char_class(input);
+            if ((change.type == Storage::CHANGE_TYPE__REMOVE) && !old_values)
+                continue;
 
-            bool fail = false;
+            if (validator && !validator->validate(change, old_values))
+            {
+                undo_changes(undo);
+                return false;
+            }
+
+            undo.resize(undo.size() + 1);
+            Undo &record = undo.back();
+            record.section = change.section;
+            record.key = change.key;
+            record.existed = (old_values != 0);
+            record.removed = false;
 
-            bool step_back = false;
-            do
+            m_expansions.invalidate(change.section, change.key);
+            if (change.type == Storage::CHANGE_TYPE__SET)
             {
-                step_back = false;
+                if (SI == SM)
+                {
+                    ensure_section(change.section);
+                    SI = m_content.find(change.section);
+                }
 
-                switch (context)
+                if (old_values)
                 {
-                case CONTEXT__NEWLINE:
-                    current_key.clear();
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__NEWLINE:
-                    case CHAR_CLASS__SPACE:
-                        break;
-
-                    case CHAR_CLASS__SEMICOLON:
-                        context = CONTEXT__COMMENT;
-                        break;
-
-                    case CHAR_CLASS__OPENBRACKET:
-                        current_section.clear();
-                        context = CONTEXT__SECTION_START;
-                        break;
-
-                    case CHAR_CLASS__HEXDIGIT:
-                    case CHAR_CLASS__LETTERS:
-                    case CHAR_CLASS__MINUS:
-                        current_key += input;
-                        context = CONTEXT__KEY_NAME;
-                        break;
-
-                    case CHAR_CLASS__PERCENT:
-                        context = CONTEXT__KEY_HEX1;
-                        break;
-
-                    default:
-                        fail = true;
-                    }
-                    break;
+                    unindex_values(change.section, change.key, KI->second);
+                    record.values.swap(KI->second);
+                    KI->second = change.values;
+                }
+                else
+                {
+                    Keys::iterator inserted = SI->second.insert(std::make_pair(change.key, change.values)).first;
+                    if (m_order)
+                        m_order->add_key(SI->first, *inserted);
+                }
+                index_values(change.section, change.key, change.values);
+            }
+            else
+            {
+                unindex_values(change.section, change.key, KI->second);
+                record.values.swap(KI->second);
+                if (m_order)
+                {
+                    record.removed = true;
+                    record.section_position = m_order->position(SI->first);
+                    record.key_position = m_order->remove_key(SI->first, KI->first);
+                }
+                SI->second.erase(KI);
+            }
 
-                case CONTEXT__COMMENT:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__NEWLINE:
-                        context = CONTEXT__NEWLINE;
-                        break;
+            if (m_observer || m_journal)
+                applied.push_back(change);
+        }
+        erase_if_empty(SI);
 
-                    default:;
-                    }
-                    break;
+        if (m_journal)
+        {
+            JournalOps ops(applied.size());
+            for (size_t i = 0; i != applied.size(); ++i)
+                make_journal_op(ops[i], (applied[i].type == Storage::CHANGE_TYPE__SET) ? JOURNAL_OP__SET : JOURNAL_OP__REMOVE,
+                                applied[i].section, applied[i].key, applied[i].values);
+            m_journal->append(ops);
+        }
 
-                case CONTEXT__SECTION_START:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__SPACE:
-                        break;
-
-                    case CHAR_CLASS__HEXDIGIT:
-                    case CHAR_CLASS__LETTERS:
-                    case CHAR_CLASS__MINUS:
-                        current_section += input;
-                        context = CONTEXT__SECTION_NAME;
-                        break;
-
-                    case CHAR_CLASS__PERCENT:
-                        context = CONTEXT__SECTION_HEX1;
-                        break;
-
-                    case CHAR_CLASS__CLOSEBRACKET:
-                        context = CONTEXT__SECTION_CLOSE;
-                        break;
-
-                    default:
-                        fail = true;
-                    }
+        if (m_observer && !applied.empty())
+            m_observer->changed(applied);
+
+        return true;
+    }
+
+    bool open_journal(const std::string &path, Storage::Callback *callback, unsigned compact_seconds)
+    {
+        close_journal();
+
+        std::string text;
+        if (read_file(path, text))
+        {
+            if (!parse(text, callback))
+                return false;
+        }
+        else if (errno == ENOENT)
+            clear();
+        else
+            return false;
+
+        // the journal moved aside by a compaction that did not finish is older than the current one
+        JournalRecords records;
+        size_t valid_size;
+        size_t record_count;
+        if (!Journal::read(Journal::old_path(path), records, valid_size, record_count))
+            return false;
+        if (!Journal::read(Journal::journal_path(path), records, valid_size, record_count))
+            return false;
+        replay(records);
+
+        std::unique_ptr<Journal> journal(new Journal(path, m_options));
+        if (!journal->open(valid_size, record_count, compact_seconds))
+            return false;
+
+        m_journal = journal.release();
+        return true;
+    }
+
+    bool compact_journal()
+    {
+        return m_journal && m_journal->compact(*this);
+    }
+
+    bool close_journal()
+    {
+        if (!m_journal)
+            return true;
+
+        bool intact = m_journal->intact();
+        delete m_journal;
+        m_journal = 0;
+        return intact;
+    }
+
+    /// applies the records read from a journal, does not journal them again; like commit(), a record erases the
+    /// sections it emptied only at its end, so a section it refills keeps its spelling and its place
+    void replay(const JournalRecords &records)
+    {
+        for (size_t i = 0; i != records.size(); ++i)
+        {
+            const JournalOps &ops = records[i];
+            OrderHold hold(m_order);
+            std::vector<const std::string *> emptied;
+            for (size_t j = 0; j != ops.size(); ++j)
+            {
+                const JournalOp &op = ops[j];
+                switch (op.type)
+                {
+                case JOURNAL_OP__SET:
+                    store_values(op.section, op.key, op.values);
                     break;
 
-                case CONTEXT__SECTION_NAME:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__SPACE:
-                        context = CONTEXT__SECTION_END;
-                        break;
-
-                    case CHAR_CLASS__HEXDIGIT:
-                    case CHAR_CLASS__LETTERS:
-                    case CHAR_CLASS__MINUS:
-                        current_section += input;
-                        break;
-
-                    case CHAR_CLASS__PERCENT:
-                        context = CONTEXT__SECTION_HEX1;
-                        break;
-
-                    case CHAR_CLASS__CLOSEBRACKET:
-                        context = CONTEXT__SECTION_CLOSE;
-                        break;
-
-                    default:
-                        fail = true;
-                    }
+                case JOURNAL_OP__REMOVE:
+                    if (drop_key(m_content.find(op.section), op.key))
+                        emptied.push_back(&op.section);
                     break;
 
-                case CONTEXT__SECTION_HEX1:
-                    switch (char_class)
+                case JOURNAL_OP__REMOVE_SECTION:
                     {
-                    case CHAR_CLASS__HEXDIGIT:
-                        current_section += char_to_hex(input) << 4;
-                        context = CONTEXT__SECTION_HEX2;
-                        break;
-
-                    default:
-                        current_section += input;
-                        context = CONTEXT__SECTION_NAME;
-                        step_back = true;
-//                        fail = true;
+                        Sections::iterator SI = m_content.find(op.section);
+                        if (SI != m_content.end())
+                            erase_section(SI);
                     }
                     break;
 
-                case CONTEXT__SECTION_HEX2:
-                    switch (char_class)
+                case JOURNAL_OP__RENAME_SECTION:
                     {
-                    case CHAR_CLASS__HEXDIGIT:
-                        current_section[current_section.length() - 1] |= char_to_hex(input);
-                        if (!current_section[current_section.length() - 1])
-                            if (callback)
-                                callback->warning(Storage::PARSE_WARNING__BINARY_ZERO_IN_SECTION_NAME, cur_pos - 2, cur_line, cur_char - 2);
-                        context = CONTEXT__SECTION_NAME;
-                        break;
-
-                    default:
-                        current_section[current_section.size() - 1] >>= 4;
-                        context = CONTEXT__SECTION_NAME;
-                        step_back = true;
-//                        fail = true;
+                        Sections::iterator SI = m_content.find(op.section);
+                        if ((SI != m_content.end()) && !is_section_exist(op.key))
+                            move_section(SI, op.key);
                     }
                     break;
+                }
+            }
 
-                case CONTEXT__SECTION_END:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__SPACE:
-                        break;
+            for (size_t j = 0; j != emptied.size(); ++j)
+                erase_if_empty(m_content.find(*emptied[j]));
+        }
+    }
 
-                    case CHAR_CLASS__CLOSEBRACKET:
-                        context = CONTEXT__SECTION_CLOSE;
-                        break;
+    static void count_name(const std::string &name, Storage::MemoryUsage &usage)
+    {
+        if (MemoryCounter::is_local(name))
+            return;
 
-                    default:
-                        fail = true;
-                    }
-                    break;
+        usage.name_bytes += name.length();
+        usage.slack_bytes += name.capacity() - name.length();
+        usage.overhead_bytes += 1;
+        ++usage.block_count;
+    }
 
-                case CONTEXT__SECTION_CLOSE:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__NEWLINE:
-                        context = CONTEXT__NEWLINE;
-                        break;
+    static void make_journal_op(JournalOp &op, JournalOpType type, const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        op.type = type;
+        op.section = section;
+        op.key = key;
+        op.values = values;
+    }
+
+    static void make_change(Storage::Change &change, Storage::ChangeType type, const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        change.type = type;
+        change.section = section;
+        change.key = key;
+        change.values = values;
+        if ((type == Storage::CHANGE_TYPE__SET) && values.empty())
+            change.values.push_back(std::string());
+    }
+
+private:
+    /// how a key was before a commit changed it
+    typedef struct Undo
+    {
+        std::string section;
+        std::string key;
+        bool existed;
+        bool removed;            // from the insertion order, to be restored to the positions
+        size_t section_position;
+        size_t key_position;
+        Storage::Values values;
+    } Undo;
+
+    /// holds the insertion order for a commit, so a rolled back one leaves it as it was
+    class OrderHold
+    {
+    public:
+        OrderHold(Order *order)
+            : m_order(order)
+        {
+            if (m_order)
+                m_order->hold();
+        }
+
+        ~OrderHold()
+        {
+            if (m_order)
+                m_order->release();
+        }
+
+    private:
+        Order *m_order;
+    };
+
+    void undo_changes(std::vector<Undo> &undo)
+    {
+        for (size_t i = undo.size(); i--; )
+        {
+            Undo &record = undo[i];
+            if (record.existed)
+            {
+                m_expansions.invalidate(record.section, record.key);
+                Storage::Values &values = ensure_key(record.section, record.key);
+                if (record.removed)
+                    m_order->restore(record.section, record.section_position, record.key, record.key_position);
+                unindex_values(record.section, record.key, values);
+                values.swap(record.values);
+                index_values(record.section, record.key, values);
+            }
+            else
+                erase_key(record.section, record.key);
+        }
+    }
 
-                    case CHAR_CLASS__SPACE:
-                        break;
+    void erase_if_empty(Sections::iterator SI)
+    {
+        if ((SI != m_content.end()) && SI->second.empty())
+            erase_section(SI);
+    }
+
+    void store_values(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        m_expansions.invalidate(section, key);
+
+        Storage::Values &stored = ensure_key(section, key);
+        unindex_values(section, key, stored);
+        if (values.empty())
+        {
+            stored.clear();
+            stored.push_back(std::string());
+        }
+        else
+            stored = values;
+        index_values(section, key, stored);
+    }
+
+    bool erase_key(const std::string &section, const std::string &key)
+    {
+        Sections::iterator SI = m_content.find(section);
+        if (!drop_key(SI, key))
+            return false;
+
+        erase_if_empty(SI);
+        return true;
+    }
+
+    /// leaves the section even if the key was its last one
+    bool drop_key(Sections::iterator SI, const std::string &key)
+    {
+        if (SI == m_content.end())
+            return false;
+        Keys::iterator KI = SI->second.find(key);
+        if (KI == SI->second.end())
+            return false;
+
+        unindex_values(SI->first, key, KI->second);
+        if (m_order)
+            m_order->remove_key(SI->first, key);
+        SI->second.erase(KI);
+
+        m_expansions.invalidate(SI->first, key);
+        return true;
+    }
+
+    typedef struct Fragment
+    {
+        Fragment()
+            : storage(0)
+            , source()
+            , stamped(false)
+            , read_error(0)
+            , success(false)
+        {}
+
+        ~Fragment()
+        {
+            delete storage;
+        }
+
+        std::string path;
+        StorageImpl *storage;
+        RecordingCallback callback;
+        ImageSource source;  // the file as a prefetch saw it before reading, if stamped
+        bool stamped;
+        int read_error;
+        bool success;
+
+    private:
+        Fragment(const Fragment &);
+        Fragment& operator = (const Fragment &);
+    } Fragment;
+
+    static void load_fragments(std::vector<Fragment> *fragments, std::atomic<size_t> *next)
+    {
+        for (;;)
+        {
+            size_t i = next->fetch_add(1);
+            if (i >= fragments->size())
+                return;
+
+            load_fragment((*fragments)[i]);
+        }
+    }
+
+    static void load_fragment(Fragment &fragment)
+    {
+        std::string text;
+        if (!read_file(fragment.path, text))
+        {
+            fragment.read_error = errno;
+            return;
+        }
+
+        fragment.success = fragment.storage->parse(text, &fragment.callback);
+    }
+
+    /// a file being read and parsed on the pool
+    typedef struct Prefetch
+    {
+        std::shared_ptr<Fragment> fragment;
+        std::shared_ptr<std::atomic<bool> > claimed;  // by the pool task starting, or by a load() dropping it first
+        std::shared_future<void> done;
+    } Prefetch;
+
+    typedef std::map<std::pair<std::string, unsigned>, Prefetch> Prefetches; // by path and options
+
+    static std::mutex prefetch_mutex;
+    static Prefetches prefetches;
+
+    /// takes over the prefetched result of the path, waiting for it if it is being read; as load(), a file that could
+    /// not be read leaves the storage as it was and is not reported. Returns false to read the file afresh when the
+    /// prefetch has not started yet, so a load on the pool never waits for a task queued behind it, or when the file
+    /// changed since
+    bool take_prefetched(const std::string &path, Storage::Callback *callback, bool &success)
+    {
+        Prefetch prefetch;
+        {
+            std::lock_guard<std::mutex> lock(prefetch_mutex);
+            Prefetches::iterator PI = prefetches.find(std::make_pair(path, m_options));
+            if (PI == prefetches.end())
+                return false;
+
+            prefetch = PI->second;
+            prefetches.erase(PI);
+        }
+
+        if (!prefetch.claimed->exchange(true))
+            return false;
+
+        prefetch.done.wait();
+        Fragment &fragment = *prefetch.fragment;
+
+        ImageSource source;
+        bool found = stat_source(path, source);
+        if ((found != fragment.stamped) || (found && !is_same_source(fragment.source, source)))
+            return false;
+
+        success = false;
+        if (fragment.read_error)
+            return true;
+
+        clear();
+        m_content.swap(fragment.storage->m_content);
+        std::swap(m_order, fragment.storage->m_order);
+        if (m_hierarchy)
+        {
+            Sections::const_iterator SM = m_content.end();
+            for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+                m_hierarchy->add(SI->first);
+        }
 
-                    case CHAR_CLASS__SEMICOLON:
-                        context = CONTEXT__COMMENT;
-                        break;
+        if (callback)
+            fragment.callback.replay(callback);
+        success = fragment.success;
+        return true;
+    }
 
-                    default:
-                        fail = true;
-                    }
-                    break;
+    /// takes the content of the other storage away in its order, the reverse index is left to the next query
+    void merge(StorageImpl &other, Storage::MergePolicy policy)
+    {
+        m_value_index.clear();
 
-                case CONTEXT__KEY_NAME:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__SPACE:
-                        context = CONTEXT__KEY_END;
-                        break;
-
-                    case CHAR_CLASS__HEXDIGIT:
-                    case CHAR_CLASS__LETTERS:
-                    case CHAR_CLASS__MINUS:
-                    case CHAR_CLASS__BACKSLASH:
-                        current_key += input;
-                        break;
-
-                    case CHAR_CLASS__PERCENT:
-                        context = CONTEXT__KEY_HEX1;
-                        break;
-
-                    case CHAR_CLASS__EQUAL:
-                        current_values.clear();
-                        current_value.clear();
-                        context = CONTEXT__EQUAL;
-                        break;
-
-                    default:
-                        fail = true;
-                    }
-                    break;
+        if (other.m_order)
+        {
+            const Order::Slots &slots = other.m_order->slots();
+            for (size_t i = 0; i != slots.size(); ++i)
+            {
+                if (!slots[i].section)
+                    continue;
+
+                const std::string &section = slots[i].section->first;
+                Keys &keys = ensure_section(section);
+                for (size_t j = 0; j != slots[i].keys.size(); ++j)
+                    if (slots[i].keys[j])
+                        merge_key(section, keys, *slots[i].keys[j], policy);
+            }
+            return;
+        }
 
-                case CONTEXT__KEY_HEX1:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__HEXDIGIT:
-                        current_key += char_to_hex(input) << 4;
-                        context = CONTEXT__KEY_HEX2;
-                        break;
-
-                    default:
-                        current_key += input;
-                        context = CONTEXT__KEY_NAME;
-                        step_back = true;
-//                        fail = true;
-                    }
-                    break;
+        Sections::iterator SM = other.m_content.end();
+        for (Sections::iterator SI = other.m_content.begin(); SI != SM; ++SI)
+        {
+            Keys &keys = ensure_section(SI->first);
 
-                case CONTEXT__KEY_HEX2:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__HEXDIGIT:
-                        current_key[current_key.length() - 1] |= char_to_hex(input);
-                        if (!current_key[current_key.length() - 1])
-                            if (callback)
-                                callback->warning(Storage::PARSE_WARNING__BINARY_ZERO_IN_KEY_NAME, cur_pos - 2, cur_line, cur_char - 2);
-                        context = CONTEXT__KEY_NAME;
-                        break;
-
-                    default:
-                        current_key[current_key.size() - 1] >>= 4;
-                        context = CONTEXT__KEY_NAME;
-                        step_back = true;
-//                        fail = true;
-                    }
-                    break;
+            Keys::iterator KM = SI->second.end();
+            for (Keys::iterator KI = SI->second.begin(); KI != KM; ++KI)
+                merge_key(SI->first, keys, *KI, policy);
+        }
+    }
 
-                case CONTEXT__KEY_END:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__SPACE:
-                        break;
+    void merge_key(const std::string &section, Keys &keys, Keys::value_type &key, Storage::MergePolicy policy)
+    {
+        m_expansions.invalidate(section, key.first);
 
-                    case CHAR_CLASS__EQUAL:
-                        current_values.clear();
-                        current_value.clear();
-                        context = CONTEXT__EQUAL;
-                        break;
+        Keys::iterator existing = keys.lower_bound(key.first);
+        if ((existing == keys.end()) || !keys.key_comp().equal(existing->first, key.first))
+        {
+            Keys::iterator KI = keys.insert(existing, Keys::value_type(key.first, Storage::Values()));
+            KI->second.swap(key.second);
+            if (m_order)
+                m_order->add_key(section, *KI);
+            return;
+        }
 
-                    default:
-                        fail = true;
-                    }
-                    break;
+        switch (policy)
+        {
+        case Storage::MERGE_POLICY__OVERRIDE:
+            existing->second.swap(key.second);
+            break;
 
-                case CONTEXT__EQUAL:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__NEWLINE:
-                        current_values += current_value;
-                        current_value.clear();
-                        set_values(current_section, current_key, current_values);
-                        context = CONTEXT__NEWLINE;
-                        break;
-
-                    case CHAR_CLASS__SPACE:
-                        break;
-
-                    case CHAR_CLASS__SEMICOLON:
-                        context = CONTEXT__COMMENT;
-                        break;
-
-                    case CHAR_CLASS__QUOTE:
-                        context = CONTEXT__VALUE_QUOTED;
-                        break;
-
-                    case CHAR_CLASS__BACKSLASH:
-                        last_context = CONTEXT__VALUE_START;
-                        context = CONTEXT__VALUE_ESCAPED;
-                        break;
-
-                    case CHAR_CLASS__COMMA:
-                        current_values += trim(current_value);
-                        current_value.clear();
-                        context = CONTEXT__EQUAL;
-                        break;
-
-                    default:
-                        if ((input >= 0x20) && (input < 0x7f))
-                        {
-                            current_value += input;
-                            context = CONTEXT__VALUE_START;
-                        }
-                        else
-                            fail = true;
-                    }
-                    break;
+        case Storage::MERGE_POLICY__KEEP:
+            break;
 
-                case CONTEXT__VALUE_QUOTED:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__QUOTE:
-                        current_values += current_value;
-                        current_value.clear();
-                        context = CONTEXT__VALUE_END;
-                        break;
-
-                    case CHAR_CLASS__BACKSLASH:
-                        last_context = context;
-                        context = CONTEXT__VALUE_ESCAPED;
-                        break;
-
-                    default:
-                        if ((input >= 0x20) && (input < 0x7f))
-                            current_value += input;
-                        else
-                            fail = true;
-                    }
-                    break;
+        case Storage::MERGE_POLICY__APPEND:
+            existing->second.insert(existing->second.end(), key.second.begin(), key.second.end());
+            break;
+        }
+    }
 
-                case CONTEXT__VALUE_START:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__NEWLINE:
-                        current_values += trim(current_value);
-                        current_value.clear();
-                        set_values(current_section, current_key, current_values);
-                        context = CONTEXT__NEWLINE;
-                        break;
-
-                    case CHAR_CLASS__SPACE:
-                        current_value += input;
-                        break;
-
-                    case CHAR_CLASS__SEMICOLON:
-                        context = CONTEXT__COMMENT;
-                        break;
-
-                    case CHAR_CLASS__BACKSLASH:
-                        last_context = context;
-                        context = CONTEXT__VALUE_ESCAPED;
-                        break;
-
-                    case CHAR_CLASS__COMMA:
-                        current_values += trim(current_value);
-                        current_value.clear();
-                        context = CONTEXT__EQUAL;
-                        break;
-
-                    default:
-                        if ((input >= 0x20) && (input < 0x7f))
-                            current_value += input;
-                        else
-                            fail = true;
-                    }
-                    break;
+    /// does not count as an access
+    const Storage::Values *find_values(const std::string &section, const std::string &key) const
+    {
+        if (m_order)
+        {
+            const Keys::value_type *found = m_order->find(section, key);
+            return found ? &found->second : 0;
+        }
 
-                case CONTEXT__VALUE_ESCAPED:
-                    switch (input) // !! INPUT, NOT CLASS
-                    {
-                    case '0':
-                        current_value += '\0';
-                        context = last_context;
-                        break;
-
-                    case 'a':
-                        current_value += '\a';
-                        context = last_context;
-                        break;
-
-                    case 'b':
-                        current_value += '\b';
-                        context = last_context;
-                        break;
-
-                    case 'f':
-                        current_value += '\f';
-                        context = last_context;
-                        break;
-
-                    case 'n':
-                        current_value += '\n';
-                        context = last_context;
-                        break;
-
-                    case 'r':
-                        current_value += '\r';
-                        context = last_context;
-                        break;
-
-                    case 't':
-                        current_value += '\t';
-                        context = last_context;
-                        break;
-
-                    case 'v':
-                        current_value += '\v';
-                        context = last_context;
-                        break;
-
-                    case '"':
-                    case '\\':
-                        current_value += input;
-                        context = last_context;
-                        break;
-
-                    case 'x':
-                        context = CONTEXT__VALUE_HEX1;
-                        break;
-
-                    default:
-                        fail = true;
-                    }
-                    break;
+        Sections::const_iterator SI = m_content.find(section);
+        if (SI == m_content.end())
+            return 0;
 
-                case CONTEXT__VALUE_HEX1:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__HEXDIGIT:
-                        current_value += char_to_hex(input) << 4;
-                        context = CONTEXT__VALUE_HEX2;
-                        break;
+        Keys::const_iterator KI = SI->second.find(key);
+        if (KI == SI->second.end())
+            return 0;
 
-                    default:
-                        fail = true;
-                    }
-                    break;
+        return &KI->second;
+    }
 
-                case CONTEXT__VALUE_HEX2:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__HEXDIGIT:
-                        current_value[current_value.size() - 1] |= char_to_hex(input);
-                        context = last_context;
-                        break;
-
-                    default:
-                        current_value[current_value.size() - 1] >>= 4;
-                        context = last_context;
-                        step_back = true;
-//                        fail = true;
-                    }
-                    break;
+    /// the chain holds the keys being expanded, a reference back into it closes a cycle;
+    /// the results made without meeting a cycle are memoized, returns false if the key does not exist
+    bool expand(const std::string &section, const std::string &key, std::vector<ExpansionCache::Name> &chain, Storage::Values &result, bool &cyclic) const
+    {
+        const Storage::Values *values = find_values(section, key);
+        if (!values)
+            return false;
 
-                case CONTEXT__VALUE_END:
-                    switch (char_class)
-                    {
-                    case CHAR_CLASS__NEWLINE:
-                        set_values(current_section, current_key, current_values);
-                        context = CONTEXT__NEWLINE;
-                        break;
+        const Storage::Values *memo = m_expansions.find(section, key);
+        if (memo)
+        {
+            result = *memo;
+            return true;
+        }
 
-                    case CHAR_CLASS__SPACE:
-                        break;
+        chain.push_back(ExpansionCache::Name(section, key));
+        bool own_cyclic = false;
+        result.resize(values->size());
+        for (size_t i = 0; i != values->size(); ++i)
+            expand_value((*values)[i], chain, result[i], own_cyclic);
+        chain.pop_back();
 
-                    case CHAR_CLASS__SEMICOLON:
-                        set_values(current_section, current_key, current_values);
-                        context = CONTEXT__COMMENT;
-                        break;
+        if (own_cyclic)
+            cyclic = true;
+        else
+            m_expansions.store(ExpansionCache::Name(section, key), result);
 
-                    case CHAR_CLASS__COMMA:
-                        context = CONTEXT__EQUAL;
-                        break;
+        return true;
+    }
 
-                    default:
-                        fail = true;
-                    }
-                    break;
-                }
-            }
-            while (step_back);
+    /// copies the value with every resolved reference replaced, the others stay as written
+    void expand_value(const Storage::Value &value, std::vector<ExpansionCache::Name> &chain, Storage::Value &result, bool &cyclic) const
+    {
+        static const size_t max_depth = 64;
 
-            if (fail)
+        result.clear();
+        const char *data = value.empty() ? 0 : &value[0];
+        size_t size = value.size();
+        size_t done = 0;
+        for (;;)
+        {
+            const char *open = data ? static_cast<const char *>(memchr(data + done, '$', size - done)) : 0;
+            if (!open)
+                break;
+            size_t start = open - data;
+            if ((start + 1 == size) || (data[start + 1] != '{'))
             {
-                if (callback)
-                    callback->error(cur_pos, cur_line, cur_char);
-                return false;
+                result.insert(result.end(), data + done, data + start + 1);
+                done = start + 1;
+                continue;
             }
+            const char *close = static_cast<const char *>(memchr(data + start + 2, '}', size - start - 2));
+            if (!close)
+                break;
+            size_t end = close - data + 1;
 
-            if ((input == '\r') || ((input == '\n') && (text[cur_pos + 1] != '\r')))
-            {
-                cur_char = 0;
-                ++cur_line;
-            }
-        }
+            result.insert(result.end(), data + done, data + start);
+            done = end;
 
-        switch (context)
-        {
-        case CONTEXT__NEWLINE:
-        case CONTEXT__COMMENT:
-        case CONTEXT__SECTION_CLOSE:
-            return true;
+            std::string reference(data + start + 2, end - start - 3);
+            std::string::size_type colon = reference.find(':');
+            ExpansionCache::Name name = (colon == reference.npos)
+                ? ExpansionCache::Name(chain.back().first, reference)
+                : ExpansionCache::Name(reference.substr(0, colon), reference.substr(colon + 1));
 
-        case CONTEXT__VALUE_START:
-            current_values += trim(current_value);
-            current_value.clear();
-        // FALL THROUGH
-        case CONTEXT__VALUE_END:
-            set_values(current_section, current_key, current_values);
-            return true;
+            bool resolved = false;
+            if (!name.second.empty())
+            {
+                m_expansions.add_dependency(name, chain.back());
 
-        default:;
+                if (in_chain(chain, name) || (chain.size() >= max_depth))
+                    cyclic = true;
+                else
+                {
+                    Storage::Values referenced;
+                    if (expand(name.first, name.second, chain, referenced, cyclic))
+                    {
+                        if (!referenced.empty())
+                            result.insert(result.end(), referenced.front().begin(), referenced.front().end());
+                        resolved = true;
+                    }
+                }
+            }
+            if (!resolved)
+                result.insert(result.end(), data + start, data + end);
         }
 
-        if (callback)
-            callback->error(cur_pos, cur_line, cur_char);
+        if (data)
+            result.insert(result.end(), data + done, data + size);
+    }
+
+    bool in_chain(const std::vector<ExpansionCache::Name> &chain, const ExpansionCache::Name &name) const
+    {
+        const NameLess &less = m_content.key_comp();
+        for (size_t i = 0; i != chain.size(); ++i)
+            if (less.equal(chain[i].first, name.first) && less.equal(chain[i].second, name.second))
+                return true;
 
         return false;
     }
 
-    std::string generate() const
+    /// a part of the generate() output
+    typedef struct Range
     {
-        std::string result;
+        Sections::const_iterator first;
+        Sections::const_iterator last;
+        char *data;
+        size_t size;
+    } Range;
 
-        Sections::const_iterator SM = m_content.end();
-        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
+    size_t generated_size(Sections::const_iterator SI, bool utf8) const
+    {
+        size_t result = encodedSectionSize(SI->first) + 3; // "[" "]\n"
+        Keys::const_iterator KM = SI->second.end();
+        for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
+            result += encodedKeySize(KI->first) + encodedValuesSize(KI->second, utf8) + 2; // "=" "\n"
+        return result + 1; // "\n"
+    }
+
+    bool generate_to(Storage::Sink &sink, Sections::const_iterator SI, Sections::const_iterator SM, bool utf8) const
+    {
+        for (; SI != SM; ++SI)
         {
-            result += std::string("[") + encodeSection(SI->first) + "]\n";
+            if (!sink.write("[", 1) || !encodeSection(sink, SI->first) || !sink.write("]\n", 2))
+                return false;
             Keys::const_iterator KM = SI->second.end();
             for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
-                result += encodeKey(KI->first) + "=" + encodeValues(KI->second) + "\n";
-            result += "\n";
+                if (!generate_key(sink, *KI, utf8))
+                    return false;
+            if (!sink.write("\n", 1))
+                return false;
         }
 
-        return result;
+        return true;
     }
 
-    void clear()
+    /// same as generate_to() in the insertion order
+    bool generate_ordered(Storage::Sink &sink, bool utf8) const
     {
-        m_content.clear();
-    }
+        const Order::Slots &slots = m_order->slots();
+        for (size_t i = 0; i != slots.size(); ++i)
+        {
+            if (!slots[i].section)
+                continue;
 
-    Storage::Strings get_all_sections() const
-    {
-        Storage::Strings result;
+            if (!sink.write("[", 1) || !encodeSection(sink, slots[i].section->first) || !sink.write("]\n", 2))
+                return false;
+            for (size_t j = 0; j != slots[i].keys.size(); ++j)
+                if (slots[i].keys[j] && !generate_key(sink, *slots[i].keys[j], utf8))
+                    return false;
+            if (!sink.write("\n", 1))
+                return false;
+        }
 
-        Sections::const_iterator SM = m_content.end();
-        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
-            result.insert(SI->first);
+        return true;
+    }
 
-        return result;
+    bool generate_key(Storage::Sink &sink, const Keys::value_type &key, bool utf8) const
+    {
+        return encodeKey(sink, key.first) && sink.write("=", 1) && encodeValues(sink, key.second, utf8) && sink.write("\n", 1);
     }
 
-    bool is_section_exist(const std::string &section) const
+    void generate_range(const Range *range, bool utf8) const
     {
-        return m_content.find(section) != m_content.end();
+        Storage::BufferSink sink(range->data, range->size);
+        generate_to(sink, range->first, range->last, utf8);
     }
 
-    bool remove_section(const std::string &section)
+    /// all the sections come to be here, so the indexes learn about them
+    Keys &ensure_section(const std::string &section)
     {
-        return m_content.erase(section);
+        Sections::iterator SI = m_content.lower_bound(section);
+        if ((SI != m_content.end()) && m_content.key_comp().equal(SI->first, section))
+            return SI->second;
+
+        SI = m_content.insert(SI, std::make_pair(section, Keys(m_content.key_comp())));
+        if (m_order)
+            m_order->add_section(*SI);
+        if (m_hierarchy)
+            m_hierarchy->add(section);
+
+        return SI->second;
     }
 
-    bool rename_section(const std::string &section, const std::string &new_section)
+    /// all the keys come to be here, except commit() and merge()
+    Storage::Values &ensure_key(const std::string &section, const std::string &key)
     {
-        if (!is_section_exist(section))
-            return false;
-        if (is_section_exist(new_section))
-            return false;
+        Keys &keys = ensure_section(section);
+        Keys::iterator KI = keys.lower_bound(key);
+        if ((KI != keys.end()) && keys.key_comp().equal(KI->first, key))
+            return KI->second;
 
-        m_content[new_section] = m_content[section];
+        KI = keys.insert(KI, std::make_pair(key, Storage::Values()));
+        if (m_order)
+            m_order->add_key(section, *KI);
 
-        return m_content.erase(section);
+        return KI->second;
     }
 
-    Storage::Strings get_all_keys(const std::string &section) const
+    /// the keys go to the new section, which takes the place of the old one in the insertion order
+    void move_section(Sections::iterator SI, const std::string &new_section)
     {
-        Storage::Strings result;
+        invalidate_section(SI->first, SI->second);
+        index_section(SI->first, SI->second, false);
+        Keys &keys = ensure_section(new_section);
+        keys.swap(SI->second);
+        if (m_order)
+            m_order->move_section(SI->first, *m_content.find(new_section));
+        erase_section(SI);
+        invalidate_section(new_section, keys);
+        index_section(new_section, keys, true);
+    }
 
-        Sections::const_iterator SI = m_content.find(section);
-        if (SI != m_content.end())
+    /// all the sections go away here, except clear()
+    void erase_section(Sections::iterator SI)
+    {
+        invalidate_section(SI->first, SI->second);
+        index_section(SI->first, SI->second, false);
+        if (m_order)
+            m_order->remove_section(SI->first);
+        if (m_hierarchy)
+            m_hierarchy->remove(SI->first);
+        m_content.erase(SI);
+    }
+
+    void invalidate_section(const std::string &section, const Keys &keys)
+    {
+        Keys::const_iterator KM = keys.end();
+        for (Keys::const_iterator KI = keys.begin(); KI != KM; ++KI)
+            m_expansions.invalidate(section, KI->first);
+    }
+
+    void build_value_index() const
+    {
+        Sections::const_iterator SM = m_content.end();
+        for (Sections::const_iterator SI = m_content.begin(); SI != SM; ++SI)
         {
             Keys::const_iterator KM = SI->second.end();
             for (Keys::const_iterator KI = SI->second.begin(); KI != KM; ++KI)
-                result.insert(KI->first);
+                m_value_index.add(SI->first, KI->first, KI->second);
         }
-
-        return result;
+        m_value_index.set_built();
     }
 
-    bool is_key_exist(const std::string &section, const std::string &key) const
+    /// the reverse index changes only once built
+    void index_values(const std::string &section, const std::string &key, const Storage::Values &values)
     {
-        Sections::const_iterator SI = m_content.find(section);
-        if (SI != m_content.end())
-            return SI->second.find(key) != SI->second.end();
+        if (m_value_index.is_built())
+            m_value_index.add(section, key, values);
+    }
 
-        return false;
+    void unindex_values(const std::string &section, const std::string &key, const Storage::Values &values)
+    {
+        if (m_value_index.is_built())
+            m_value_index.remove(section, key, values);
     }
 
-    bool is_list(const std::string &section, const std::string &key) const
+    void index_section(const std::string &section, const Keys &keys, bool add)
     {
-        Sections::const_iterator SI = m_content.find(section);
-        if (SI != m_content.end())
-        {
-            Keys::const_iterator KI = SI->second.find(key);
-            if (KI != SI->second.end())
-                return KI->second.size() > 1;
-        }
+        if (!m_value_index.is_built())
+            return;
 
-        return false;
+        Keys::const_iterator KM = keys.end();
+        for (Keys::const_iterator KI = keys.begin(); KI != KM; ++KI)
+            if (add)
+                m_value_index.add(section, KI->first, KI->second);
+            else
+                m_value_index.remove(section, KI->first, KI->second);
     }
 
-    bool contains_binary(const std::string &section, const std::string &key) const
+    static bool has_prefix(const std::string &name, const std::string &prefix, const NameLess &less)
     {
-        Sections::const_iterator SI = m_content.find(section);
-        if (SI != m_content.end())
-        {
-            Keys::const_iterator KI = SI->second.find(key);
-            if (KI != SI->second.end())
-                return KI->second.contains_binary();
-        }
+        return (name.length() >= prefix.length()) && !compare_names(name.data(), prefix.length(), prefix.data(), prefix.length(), less.fold());
+    }
 
-        return false;
+    static bool visit_sections(Sections::const_iterator SI, Sections::const_iterator SM, Storage::Visitor &visitor)
+    {
+        for (; SI != SM; ++SI)
+            if (!visitor.section(SI->first))
+                return false;
+
+        return true;
     }
 
-    std::pair<bool, std::string> get_string(const std::string &section, const std::string &key, const std::string &default_value) const
+    /// stops at the first key without the prefix, if there is one
+    static bool visit_keys(Sections::const_iterator SI, Keys::const_iterator KI, Storage::Visitor &visitor, const std::string *prefix)
     {
-        Storage::Values default_values;
-        default_values.push_back(default_value);
+        Keys::const_iterator KM = SI->second.end();
+        for (; (KI != KM) && (!prefix || has_prefix(KI->first, *prefix, SI->second.key_comp())); ++KI)
+            if (!visitor.entry(SI->first, KI->first, KI->second))
+                return false;
+
+        return true;
+    }
 
-        std::pair<bool, Storage::Values> result = get_values(section, key, default_values);
+    static bool visit_keys(const Order::Slot &slot, Storage::Visitor &visitor)
+    {
+        for (size_t i = 0; i != slot.keys.size(); ++i)
+            if (slot.keys[i] && !visitor.entry(slot.section->first, slot.keys[i]->first, slot.keys[i]->second))
+                return false;
 
-        return std::make_pair(result.first, static_cast<std::string>(result.second[0]));
+        return true;
     }
 
-    std::pair<bool, Storage::Values> get_values(const std::string &section, const std::string &key, const Storage::Values &default_values) const
+    class TextGenerator
     {
-        Sections::const_iterator SI = m_content.find(section);
-        if (SI != m_content.end())
+    public:
+        TextGenerator(const StorageImpl &storage)
+            : m_storage(storage)
+        {}
+
+        bool operator () (Storage::Sink &sink) const
         {
-            Keys::const_iterator KI = SI->second.find(key);
-            if (KI != SI->second.end())
-                return std::make_pair(true, KI->second);
+            return m_storage.generate_to(sink);
         }
 
-        return std::make_pair(false, default_values);
+    private:
+        const StorageImpl &m_storage;
+    };
+
+    /// the view is sorted the same way, so every insertion goes to the end
+    void load_image(const ImageView &view)
+    {
+        clear();
+
+        const ImageHeader &header = view.header();
+        for (uint32_t i = 0; i != header.section_count; ++i)
+        {
+            const ImageSection &section = view.section(i);
+            Sections::iterator SI = m_content.insert(m_content.end(), std::make_pair(view.section_name(i), Keys(m_content.key_comp())));
+            Keys &keys = SI->second;
+            if (m_order)
+                m_order->add_section(*SI);
+            if (m_hierarchy)
+                m_hierarchy->add(view.section_name(i));
+
+            for (uint32_t j = 0; j != section.key_count; ++j)
+            {
+                const ImageKey &key = view.key(section.first_key + j);
+                Keys::iterator KI = keys.insert(keys.end(), std::make_pair(view.key_name(section.first_key + j), Storage::Values()));
+                if (m_order)
+                    m_order->add_key(SI->first, *KI);
+
+                Storage::Values &values = KI->second;
+
+                values.resize(key.value_count);
+                for (uint32_t k = 0; k != key.value_count; ++k)
+                {
+                    const ImageValue &value = view.value(key.first_value + k);
+                    const char *bytes = view.bytes(value.offset);
+                    values[k].assign(bytes, bytes + value.size);
+                }
+            }
+        }
     }
 
-    void set_string(const std::string &section, const std::string &key, const std::string &value)
+    static const char *hex;
+
+    typedef enum CharFlag {
+        CHAR_FLAG__SECTION = 0x01, // goes as is in section names
+        CHAR_FLAG__KEY     = 0x02, // goes as is in key names
+        CHAR_FLAG__QUOTE   = 0x04  // forces quotes around a value
+    } CharFlag;
+
+    static const unsigned char char_flags[256];
+    static const char value_escapes[256]; // 0 - goes as is, 'x' - goes as \xHH, other - goes after a backslash
+
+#if defined(__SSE2__)
+    /// marks the bytes in [low, low + count)
+    static __m128i in_range(__m128i bytes, char low, char count)
     {
-        Storage::Values values;
-        values.push_back(value);
+        return _mm_cmplt_epi8(_mm_add_epi8(bytes, _mm_set1_epi8(static_cast<char>(-0x80 - low))), _mm_set1_epi8(static_cast<char>(count - 0x80)));
+    }
 
-        set_values(section, key, values);
+    static size_t first_unset(int mask)
+    {
+        return __builtin_ctz(~mask & 0xffff);
     }
+#endif
 
-    void set_values(const std::string &section, const std::string &key, const Storage::Values &values)
+    /// returns the length of the leading part of the name that goes as is
+    static size_t plainNameLength(const char *data, size_t size, CharFlag flag)
     {
-        if (values.empty())
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i extra = _mm_set1_epi8((flag == CHAR_FLAG__KEY) ? '\\' : '.');
+        for (; i + 16 <= size; i += 16)
         {
-            Storage::Values empty;
-            empty.push_back(std::string());
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i plain = _mm_or_si128(
+                _mm_or_si128(in_range(bytes, '0', 10), in_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 26)),
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('-'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('.')), _mm_cmpeq_epi8(bytes, extra))));
+            int mask = _mm_movemask_epi8(plain);
+            if (mask != 0xffff)
+                return i + first_unset(mask);
+        }
+#endif
+        while ((i < size) && (char_flags[static_cast<unsigned char>(data[i])] & flag))
+            ++i;
+        return i;
+    }
 
-            m_content[section][key] = empty;
+    /// returns the length of the leading part of the value that goes as is, with utf8 the UTF-8 characters go as is too
+    static size_t plainValueLength(const char *data, size_t size, bool utf8)
+    {
+        size_t i = 0;
+        for (;;)
+        {
+#if defined(__SSE2__)
+            for (; i + 16 <= size; i += 16)
+            {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                __m128i escaped = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+                int mask = _mm_movemask_epi8(_mm_andnot_si128(escaped, in_range(bytes, 0x20, 0x5f)));
+                if (mask != 0xffff)
+                {
+                    i += first_unset(mask);
+                    break;
+                }
+            }
+#endif
+            while ((i < size) && !value_escapes[static_cast<unsigned char>(data[i])])
+                ++i;
+
+            size_t length = (utf8 && (i < size)) ? Grammar::utf8_sequence_length(data + i, size - i) : 0;
+            if (!length)
+                return i;
+            i += length;
         }
-        else
-            m_content[section][key] = values;
     }
 
-    bool remove_key(const std::string &section, const std::string &key)
+    /// tells in one pass that the value needs neither escaping nor quotes
+    static bool isPlainValue(const char *data, size_t size, bool utf8)
     {
-        bool result = false;
+        if (!size)
+            return true;
+        if ((data[0] == ' ') || (data[size - 1] == ' '))
+            return false;
 
-        Sections::iterator SI = m_content.find(section);
-        if (SI != m_content.end())
+        size_t i = 0;
+#if defined(__SSE2__)
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'))),
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(';')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('='))),
+                    _mm_cmpeq_epi8(bytes, _mm_set1_epi8(','))));
+            if (_mm_movemask_epi8(_mm_andnot_si128(special, in_range(bytes, 0x20, 0x5f))) != 0xffff)
+            {
+                if (!utf8)
+                    return false;
+                break;
+            }
+        }
+#endif
+        while (i < size)
         {
-            if (SI->second.erase(key))
+            unsigned char ch = data[i];
+            size_t length = (utf8 && (ch & 0x80)) ? Grammar::utf8_sequence_length(data + i, size - i) : 0;
+            if (length)
             {
-                result = true;
-                if (SI->second.empty())
-                    m_content.erase(SI);
+                i += length;
+                continue;
             }
+            if (value_escapes[ch] || (char_flags[ch] & CHAR_FLAG__QUOTE))
+                return false;
+            ++i;
         }
+        return true;
+    }
+
+    /// the escapes never produce these characters, so the decision can be made on the raw value
+    static bool needsQuotes(const char *data, size_t size)
+    {
+        if (!size)
+            return false;
+        if ((data[0] == ' ') || (data[size - 1] == ' '))
+            return true;
+
+        for (size_t i = 0; i != size; ++i)
+            if (char_flags[static_cast<unsigned char>(data[i])] & CHAR_FLAG__QUOTE)
+                return true;
+
+        return false;
+    }
+
+    static const char *valueData(const Storage::Value &value)
+    {
+        return value.empty() ? 0 : &value[0];
+    }
+
+    static size_t encodedNameSize(const std::string &name, CharFlag flag)
+    {
+        const char *data = name.data();
+        size_t m = name.length();
+
+        size_t result = m;
+        for (size_t i = plainNameLength(data, m, flag); i < m; i += 1 + plainNameLength(data + i + 1, m - i - 1, flag))
+            result += 2; // "%xx"
 
         return result;
     }
 
-    bool rename_key(const std::string &section, const std::string &key, const std::string &new_section, const std::string &new_key)
+    static size_t encodedSectionSize(const std::string &section)
+    {
+        return encodedNameSize(section, CHAR_FLAG__SECTION);
+    }
+
+    static size_t encodedKeySize(const std::string &key)
+    {
+        return encodedNameSize(key, CHAR_FLAG__KEY);
+    }
+
+    static size_t encodedValueSize(const Storage::Value &value, bool utf8)
     {
-        if (!is_key_exist(section, key))
-            return false;
-        if (is_key_exist(new_section, new_key))
-            return false;
+        const char *data = valueData(value);
+        size_t m = value.size();
 
-        set_values(new_section, new_key, get_values(section, key, Storage::Values()).second);
+        if (isPlainValue(data, m, utf8))
+            return m;
 
-        return remove_key(section, key);
-    }
+        size_t result = m + (needsQuotes(data, m) ? 2 : 0);
+        for (size_t i = plainValueLength(data, m, utf8); i < m; i += 1 + plainValueLength(data + i + 1, m - i - 1, utf8))
+            result += (value_escapes[static_cast<unsigned char>(data[i])] == 'x') ? 3 : 1;
 
-private:
-    static const char *hex;
+        return result;
+    }
 
-    static std::string encodeSection(const std::string &section)
+    static size_t encodedValuesSize(const Storage::Values &values, bool utf8)
     {
-        std::string result;
+        size_t result = 0;
 
-        size_t m = section.length();
+        size_t m = values.size();
         for (size_t i = 0; i != m; ++i)
         {
-            const char &ch = section[i];
-            if (((ch >= '0') && (ch <= '9')) || ((ch >= 'a') && (ch <= 'z')) || ((ch >= 'A') && (ch <= 'Z')) || (ch == '_') || (ch == '-') || (ch == '.'))
-                result += ch;
-            else
-                result += std::string("%") + hex[static_cast<unsigned char>(ch) / 16] + hex[static_cast<unsigned char>(ch) % 16];
+            if (i)
+                result += 2; // ", "
+            result += encodedValueSize(values[i], utf8);
         }
 
         return result;
     }
 
-    static std::string encodeKey(const std::string &key)
+    /// writes runs of plain characters at once
+    static bool encodeName(Storage::Sink &sink, const std::string &name, CharFlag flag)
     {
-        std::string result;
+        const char *data = name.data();
+        size_t m = name.length();
 
-        size_t m = key.length();
-        for (size_t i = 0; i != m; ++i)
+        size_t start = 0;
+        for (size_t i = plainNameLength(data, m, flag); i < m; i = start + plainNameLength(data + start, m - start, flag))
         {
-            const char &ch = key[i];
-            if (((ch >= '0') && (ch <= '9')) || ((ch >= 'a') && (ch <= 'z')) || ((ch >= 'A') && (ch <= 'Z')) || (ch == '_') || (ch == '-') || (ch == '.') || (ch == '\\'))
-                result += ch;
-            else
-                result += std::string("%") + hex[static_cast<unsigned char>(ch) / 16] + hex[static_cast<unsigned char>(ch) % 16];
+            unsigned char ch = data[i];
+            char escaped[3] = { '%', hex[ch / 16], hex[ch % 16] };
+            if (((i > start) && !sink.write(data + start, i - start)) || !sink.write(escaped, 3))
+                return false;
+            start = i + 1;
         }
 
-        return result;
+        return (m == start) || sink.write(data + start, m - start);
     }
 
-    static std::string encodeValues(const Storage::Values &values)
+    static bool encodeSection(Storage::Sink &sink, const std::string &section)
     {
-        std::string result;
+        return encodeName(sink, section, CHAR_FLAG__SECTION);
+    }
+
+    static bool encodeKey(Storage::Sink &sink, const std::string &key)
+    {
+        return encodeName(sink, key, CHAR_FLAG__KEY);
+    }
 
+    static bool encodeValues(Storage::Sink &sink, const Storage::Values &values, bool utf8)
+    {
         size_t m = values.size();
         for (size_t i = 0; i != m; ++i)
         {
-            if (i)
-                result += ", ";
-            result += encodeValue(values[i]);
+            if (i && !sink.write(", ", 2))
+                return false;
+            if (!encodeValue(sink, values[i], utf8))
+                return false;
         }
 
-        return result;
+        return true;
     }
 
-    static std::string encodeValue(const Storage::Value &value)
+    static bool encodeValue(Storage::Sink &sink, const Storage::Value &value, bool utf8)
     {
-        std::string result;
-
+        const char *data = valueData(value);
         size_t m = value.size();
-        for (size_t i = 0; i != m; ++i)
-        {
-            const char &ch = value[i];
-            switch (ch)
-            {
-            case '\0':
-                result += "\\0";
-                break;
-
-            case '\a':
-                result += "\\a";
-                break;
-
-            case '\b':
-                result += "\\b";
-                break;
-
-            case '\f':
-                result += "\\f";
-                break;
-
-            case '\n':
-                result += "\\n";
-                break;
-
-            case '\r':
-                result += "\\r";
-                break;
-
-            case '\t':
-                result += "\\t";
-                break;
 
-            case '\v':
-                result += "\\v";
-                break;
+        if (isPlainValue(data, m, utf8))
+            return !m || sink.write(data, m);
 
-            case '\\':
-            case '"':
-                result += std::string("\\") + ch;
-                break;
+        bool quoted = needsQuotes(data, m);
+        if (quoted && !sink.write("\"", 1))
+            return false;
 
-            default:
-                if ((ch >= 0x20) && (ch < 0x7f))
-                    result += ch;
-                else
-                    result += std::string("\\x") + hex[static_cast<unsigned char>(ch) / 16] + hex[static_cast<unsigned char>(ch) % 16];
-            }
+        size_t start = 0;
+        for (size_t i = plainValueLength(data, m, utf8); i < m; i = start + plainValueLength(data + start, m - start, utf8))
+        {
+            unsigned char ch = data[i];
+            char escaped[4] = { '\\', value_escapes[ch], hex[ch / 16], hex[ch % 16] };
+            if (((i > start) && !sink.write(data + start, i - start)) || !sink.write(escaped, (escaped[1] == 'x') ? 4 : 2))
+                return false;
+            start = i + 1;
         }
 
-        if ((result.find_first_of(";=,\"") != result.npos) || ((result.length() > 0) && ((result[0] == ' ') || (result[result.length() - 1] == ' '))))
-            result = std::string("\"") + result + "\"";
+        if ((m != start) && !sink.write(data + start, m - start))
+            return false;
 
-        return result;
+        return !quoted || sink.write("\"", 1);
     }
 
-    static CharClass get_char_class(char input)
-    {
-        switch (input)
-        {
-        case '\r':
-        case '\n':
-            return CHAR_CLASS__NEWLINE;
-
-        case ' ':
-        case '\t':
-            return CHAR_CLASS__SPACE;
-
-        case ';':
-            return CHAR_CLASS__SEMICOLON;
+private:
+    unsigned m_options;
+    Sections m_content;
+    HierarchyIndex *m_hierarchy;
+    mutable ExpansionCache m_expansions;
+    mutable ValueIndex m_value_index;
+    Storage::Observer *m_observer;
+    Journal *m_journal;
+    Order *m_order; // OPTION__ORDERED only
+#if defined(INIPLUS_ACCESS_STATS)
+    mutable AccessStats m_access_stats;
+#endif
+};
 
-        case '[':
-            return CHAR_CLASS__OPENBRACKET;
+const char *StorageImpl::hex = "0123456789ABCDEF";
 
-        case ']':
-            return CHAR_CLASS__CLOSEBRACKET;
+std::mutex StorageImpl::prefetch_mutex;
+StorageImpl::Prefetches StorageImpl::prefetches;
+
+const unsigned char StorageImpl::char_flags[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 00
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 10
+    0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x03, 0x03, 0x00, // 20
+    0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x04, 0x00, 0x04, 0x00, 0x00, // 30
+    0x00, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, // 40
+    0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x02, 0x00, 0x00, 0x03, // 50
+    0x00, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, // 60
+    0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, // 70
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 80
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 90
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // a0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // b0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // c0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // d0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // e0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00  // f0
+};
 
-        case '%':
-            return CHAR_CLASS__PERCENT;
+const char StorageImpl::value_escapes[256] = {
+     '0',  'x',  'x',  'x',  'x',  'x',  'x',  'a',  'b',  't',  'n',  'v',  'f',  'r',  'x',  'x', // 00
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // 10
+       0,    0,  '"',    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, // 20
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, // 30
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, // 40
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, '\\',    0,    0,    0, // 50
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0, // 60
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,  'x', // 70
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // 80
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // 90
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // a0
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // b0
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // c0
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // d0
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x', // e0
+     'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x',  'x'  // f0
+};
 
-        case '=':
-            return CHAR_CLASS__EQUAL;
+bool parse_image(const char *text, size_t length, char *buffer, size_t size, size_t &required, Storage::Callback *callback, unsigned options)
+{
+    return StorageImpl::parse_fixed(text, length, buffer, size, required, callback, options);
+}
 
-        case '"':
-            return CHAR_CLASS__QUOTE;
+bool Journal::compact(const StorageImpl &storage)
+{
+    std::lock_guard<std::mutex> compact_lock(m_compact_mutex);
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-        case '\\':
-            return CHAR_CLASS__BACKSLASH;
+    if (!storage.save(m_path))
+        return false;
+    if (::unlink(m_old_path.c_str()) && (errno != ENOENT))
+        return false;
 
-        case ',':
-            return CHAR_CLASS__COMMA;
+    if (m_fd < 0)
+    {
+        m_fd = ::open(m_journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0)
+            return false;
+    }
+    if (!restart(0) || !sync_directory(m_path))
+        return false;
 
-        case '-':
-        case '_':
-        case '.':
-            return CHAR_CLASS__MINUS;
+    m_record_count = 0;
+    m_intact = true;
+    return true;
+}
 
-        default:
-            if (((input >= '0') && (input <= '9')) || ((input >= 'A') && (input <= 'F')) || ((input >= 'a') && (input <= 'f')))
-                return CHAR_CLASS__HEXDIGIT;
-            else if (((input >= 'G') && (input <= 'Z')) || ((input >= 'g') && (input <= 'z')))
-                return CHAR_CLASS__LETTERS;
-            else if ((input >= 0x20) || (input < 0x7f))
-                return CHAR_CLASS__VISIBLE;
-            else
-                return CHAR_CLASS__OTHER;
-        }
-    }
+bool Journal::fold()
+{
+    JournalRecords records;
+    size_t valid_size;
+    size_t record_count;
+    if (!read(m_old_path, records, valid_size, record_count))
+        return false;
 
-    static char char_to_hex(char input)
-    {
-        if ((input >= '0') && (input <= '9'))
-            return input - '0';
-        else if ((input >= 'A') && (input <= 'F'))
-            return input - 'A' + 0x0a;
-        else if ((input >= 'a') && (input <= 'f'))
-            return input - 'a' + 0x0a;
-        return '\0';
-    }
+    struct stat st;
+    if (::stat(m_old_path.c_str(), &st))
+        return errno == ENOENT;
 
-    static std::string trim(const std::string &str)
+    StorageImpl base(m_options);
+    std::string text;
+    if (read_file(m_path, text))
     {
-        std::string::size_type start = str.find_first_not_of(" \t");
-        if (start == str.npos)
-            return std::string();
-        std::string::size_type end = str.find_last_not_of(" \t");
-        return str.substr(start, end - start + 1);
+        if (!base.parse(text, 0))
+            return false;
     }
+    else if (errno != ENOENT)
+        return false;
 
-private:
-    Sections m_content;
-};
+    base.replay(records);
+    if (!base.save(m_path))
+        return false;
 
-const char *StorageImpl::hex = "0123456789ABCDEF";
+    return !::unlink(m_old_path.c_str()) && sync_directory(m_path);
+}
 
 
 Storage::Value::Value()
@@ -1051,6 +4952,41 @@ bool Storage::Value::contains_binary(void) const
     return false;
 }
 
+/// skips the blocks of printable ASCII, checks the rest one character at a time
+bool Storage::Value::contains_binary_utf8(void) const
+{
+    const char *data = empty() ? 0 : &(*this)[0];
+    size_t m = size();
+
+    size_t i = 0;
+    while (i < m)
+    {
+#if defined(__SSE2__)
+        for (; i + 16 <= m; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+            if (_mm_movemask_epi8(printable) != 0xffff)
+                break;
+        }
+        if (i == m)
+            break;
+#endif
+        if (!is_binary(data[i]))
+        {
+            ++i;
+            continue;
+        }
+
+        size_t length = (data[i] & 0x80) ? Grammar::utf8_sequence_length(data + i, m - i) : 0;
+        if (!length)
+            return true;
+        i += length;
+    }
+
+    return false;
+}
+
 
 Storage::Values::Values()
     : std::vector<Storage::Value>()
@@ -1090,9 +5026,231 @@ bool Storage::Values::contains_binary(void) const
     return false;
 }
 
+bool Storage::Values::contains_binary_utf8(void) const
+{
+    size_t m = size();
+    for (size_t i = 0; i < m; ++i)
+        if (at(i).contains_binary_utf8())
+            return true;
+
+    return false;
+}
+
+
+Storage::Transaction::Transaction(Storage &storage)
+    : m_storage(storage)
+{
+}
+
+void Storage::Transaction::set_string(const std::string &section, const std::string &key, const std::string &string)
+{
+    Values values;
+    values.push_back(string);
+
+    set_values(section, key, values);
+}
+
+void Storage::Transaction::set_values(const std::string &section, const std::string &key, const Values &values)
+{
+    m_changes.resize(m_changes.size() + 1);
+    StorageImpl::make_change(m_changes.back(), CHANGE_TYPE__SET, section, key, values);
+}
+
+void Storage::Transaction::remove_key(const std::string &section, const std::string &key)
+{
+    m_changes.resize(m_changes.size() + 1);
+    StorageImpl::make_change(m_changes.back(), CHANGE_TYPE__REMOVE, section, key, Values());
+}
+
+bool Storage::Transaction::commit(Validator *validator)
+{
+    Changes changes;
+    changes.swap(m_changes);
+
+    return m_storage.impl->commit(changes, validator);
+}
+
+void Storage::Transaction::rollback()
+{
+    m_changes.clear();
+}
+
+size_t Storage::Transaction::size() const
+{
+    return m_changes.size();
+}
+
+
+Storage::StringSink::StringSink(std::string &string)
+    : Sink()
+    , m_string(string)
+{
+}
+
+Storage::StringSink::~StringSink()
+{
+}
+
+bool Storage::StringSink::write(const char *data, size_t size)
+{
+    m_string.append(data, size);
+    return true;
+}
+
+
+Storage::BufferSink::BufferSink(char *buffer, size_t capacity)
+    : Sink()
+    , m_buffer(buffer)
+    , m_capacity(capacity)
+    , m_size(0)
+{
+}
+
+Storage::BufferSink::~BufferSink()
+{
+}
+
+bool Storage::BufferSink::write(const char *data, size_t size)
+{
+    if (size > m_capacity - m_size)
+        return false;
+
+    memcpy(m_buffer + m_size, data, size);
+    m_size += size;
+    return true;
+}
+
+size_t Storage::BufferSink::size() const
+{
+    return m_size;
+}
+
+
+Storage::OStreamSink::OStreamSink(std::ostream &stream)
+    : Sink()
+    , m_stream(stream)
+{
+}
+
+Storage::OStreamSink::~OStreamSink()
+{
+}
+
+bool Storage::OStreamSink::write(const char *data, size_t size)
+{
+    m_stream.write(data, size);
+    return m_stream.good();
+}
+
+bool Storage::OStreamSink::flush()
+{
+    m_stream.flush();
+    return m_stream.good();
+}
+
+
+/// writes all iovecs, resuming after partial writes and interrupts
+static bool writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count)
+    {
+        ssize_t written = ::writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        size_t left = written;
+        while (count && (left >= iov->iov_len))
+        {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    return true;
+}
+
+Storage::FdSink::FdSink(int fd, size_t buffer_size)
+    : Sink()
+    , m_fd(fd)
+    , m_buffer(buffer_size ? buffer_size : 1)
+    , m_used(0)
+{
+}
+
+Storage::FdSink::~FdSink()
+{
+}
+
+bool Storage::FdSink::write(const char *data, size_t size)
+{
+    if (size <= m_buffer.size() - m_used)
+    {
+        memcpy(&m_buffer[m_used], data, size);
+        m_used += size;
+        return true;
+    }
+
+    if (size < m_buffer.size() / 2)
+    {
+        if (!flush())
+            return false;
+        memcpy(&m_buffer[0], data, size);
+        m_used = size;
+        return true;
+    }
+
+    return write_buffer(data, size);
+}
+
+bool Storage::FdSink::flush()
+{
+    return write_buffer(0, 0);
+}
+
+/// writes the collected data followed by the given one in a single call
+bool Storage::FdSink::write_buffer(const char *data, size_t size)
+{
+    struct iovec iov[2];
+    int count = 0;
+    if (m_used)
+    {
+        iov[count].iov_base = &m_buffer[0];
+        iov[count].iov_len = m_used;
+        ++count;
+    }
+    if (size)
+    {
+        iov[count].iov_base = const_cast<char *>(data);
+        iov[count].iov_len = size;
+        ++count;
+    }
+
+    m_used = 0;
+    return writev_all(m_fd, iov, count);
+}
+
+
+std::string Storage::generate_binary() const
+{
+    ImageSource source;
+    memset(&source, 0, sizeof(source));
+
+    return impl->generate_binary(source);
+}
+
 
-Storage::Storage() :
-    impl(new StorageImpl())
+Storage::Storage(unsigned options) :
+    impl(new StorageImpl(options))
 {
 }
 
@@ -1101,22 +5259,109 @@ Storage::~Storage()
     delete impl;
 }
 
+void Storage::set_allocation_counter(AllocationCounter counter)
+{
+    allocation_counter = counter;
+}
+
+bool Storage::has_access_stats()
+{
+#if defined(INIPLUS_ACCESS_STATS)
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::future<bool> Storage::load_async(const std::string &path, Callback *callback)
+{
+    return impl->load_async(path, callback);
+}
+
+void Storage::prefetch(const std::vector<std::string> &paths, unsigned options)
+{
+    StorageImpl::prefetch(paths, options);
+}
+
+void Storage::cancel_prefetch()
+{
+    StorageImpl::cancel_prefetch();
+}
+
+void Storage::swap(Storage &other)
+{
+    std::swap(impl, other.impl);
+}
+
+bool Storage::load_directory(const std::string &path, const std::string &pattern, Callback *callback, MergePolicy policy, unsigned max_threads)
+{
+    return impl->load_directory(path, pattern, callback, policy, max_threads);
+}
+
+bool Storage::scan(const std::string &text, Visitor &visitor, Callback *callback, unsigned options)
+{
+    return StorageImpl::scan(text, visitor, callback, options);
+}
+
+bool Storage::scan_file(const std::string &path, Visitor &visitor, Callback *callback, unsigned options)
+{
+    return StorageImpl::scan_file(path, visitor, callback, options);
+}
+
+unsigned                         Storage::options         ()                                                                                                               const { return impl->options         (); }
 bool                             Storage::parse           (const std::string &text, Callback *callback)                                                                          { return impl->parse           (text, callback); }
+bool                             Storage::parse           (const std::string &text, ParseResult &result, Callback *callback)                                                     { return impl->parse           (text, result, callback); }
+bool                             Storage::load            (const std::string &path, Callback *callback)                                                                          { return impl->load            (path, callback); }
+bool                             Storage::load            (const std::string &path, ParseResult &result, Callback *callback)                                                     { return impl->load            (path, result, callback); }
 std::string                      Storage::generate        ()                                                                                                               const { return impl->generate        (); }
+size_t                           Storage::generated_size  ()                                                                                                               const { return impl->generated_size  (); }
+bool                             Storage::generate_to     (Sink &sink)                                                                                                     const { return impl->generate_to     (sink); }
+bool                             Storage::save            (const std::string &path)                                                                                        const { return impl->save            (path); }
+std::string                      Storage::generate_parallel(unsigned max_threads)                                                                                          const { return impl->generate_parallel(max_threads); }
+bool                             Storage::save_parallel   (const std::string &path, unsigned max_threads)                                                                  const { return impl->save_parallel   (path, max_threads); }
+bool                             Storage::parse_binary    (const char *data, size_t size)                                                                                        { return impl->parse_binary    (data, size); }
+bool                             Storage::save_binary     (const std::string &path)                                                                                        const { return impl->save_binary     (path); }
+bool                             Storage::load_binary     (const std::string &path)                                                                                              { return impl->load_binary     (path); }
+bool                             Storage::load_cached     (const std::string &path, const std::string &snapshot_path, Callback *callback)                                        { return impl->load_cached     (path, snapshot_path, callback); }
 void                             Storage::clear           ()                                                                                                                     {        impl->clear           (); }
 Storage::Strings                 Storage::get_all_sections()                                                                                                               const { return impl->get_all_sections(); }
 bool                             Storage::is_section_exist(const std::string &section)                                                                                     const { return impl->is_section_exist(section); }
+bool                             Storage::visit_sections  (Visitor &visitor)                                                                                               const { return impl->visit_sections  (visitor); }
+bool                             Storage::visit_sections_with_prefix(const std::string &prefix, Visitor &visitor)                                                           const { return impl->visit_sections_with_prefix(prefix, visitor); }
+bool                             Storage::visit_sections_in_range(const std::string &first, const std::string &last, Visitor &visitor)                                      const { return impl->visit_sections_in_range(first, last, visitor); }
+bool                             Storage::visit_entries   (Visitor &visitor)                                                                                               const { return impl->visit_entries   (visitor); }
+void                             Storage::set_hierarchy_index(bool enabled)                                                                                                     {        impl->set_hierarchy_index(enabled); }
+bool                             Storage::visit_child_sections(const std::string &section, Visitor &visitor)                                                               const { return impl->visit_child_sections(section, visitor); }
+Storage::Strings                 Storage::get_child_sections(const std::string &section)                                                                                   const { return impl->get_child_sections(section); }
+bool                             Storage::visit_subtree   (const std::string &section, Visitor &visitor)                                                                   const { return impl->visit_subtree   (section, visitor); }
+size_t                           Storage::remove_subtree  (const std::string &section)                                                                                           { return impl->remove_subtree  (section); }
 bool                             Storage::remove_section  (const std::string &section)                                                                                           { return impl->remove_section  (section); }
 bool                             Storage::rename_section  (const std::string &section, const std::string &new_section)                                                           { return impl->rename_section  (section, new_section); }
 Storage::Strings                 Storage::get_all_keys    (const std::string &section)                                                                                     const { return impl->get_all_keys    (section); }
 bool                             Storage::is_key_exist    (const std::string &section, const std::string &key)                                                             const { return impl->is_key_exist    (section, key); }
+bool                             Storage::visit_keys      (const std::string &section, Visitor &visitor)                                                                   const { return impl->visit_keys      (section, visitor); }
+bool                             Storage::visit_keys_with_prefix(const std::string &section, const std::string &prefix, Visitor &visitor)                                  const { return impl->visit_keys_with_prefix(section, prefix, visitor); }
 bool                             Storage::is_list         (const std::string &section, const std::string &key)                                                             const { return impl->is_list         (section, key); }
 bool                             Storage::contains_binary (const std::string &section, const std::string &key)                                                             const { return impl->contains_binary (section, key); }
+bool                             Storage::contains_binary_utf8(const std::string &section, const std::string &key)                                                         const { return impl->contains_binary_utf8(section, key); }
 std::pair<bool, std::string>     Storage::get_string      (const std::string &section, const std::string &key, const std::string &default_value)                           const { return impl->get_string      (section, key, default_value); }
 std::pair<bool, Storage::Values> Storage::get_values      (const std::string &section, const std::string &key, const Values &default_values)                               const { return impl->get_values      (section, key, default_values); }
+std::pair<bool, std::string>     Storage::get_expanded_string(const std::string &section, const std::string &key, const std::string &default_value)                      const { return impl->get_expanded_string(section, key, default_value); }
+std::pair<bool, Storage::Values> Storage::get_expanded_values(const std::string &section, const std::string &key, const Values &default_values)                          const { return impl->get_expanded_values(section, key, default_values); }
+void                             Storage::get_batch       (const Lookup *lookups, size_t count, LookupResult *results)                                                     const {        impl->get_batch       (lookups, count, results); }
+Storage::Locations               Storage::find_value      (const std::string &value)                                                                                       const { return impl->find_value      (value); }
+void                             Storage::set_value_index (bool enabled)                                                                                                         {        impl->set_value_index (enabled); }
+Storage::MemoryUsage             Storage::memory_usage    ()                                                                                                               const { return impl->memory_usage    (); }
+size_t                           Storage::shrink_to_fit   ()                                                                                                                     { return impl->shrink_to_fit   (); }
+Storage::AccessCounts            Storage::access_stats    ()                                                                                                               const { return impl->access_stats    (); }
+void                             Storage::reset_access_stats()                                                                                                                    {        impl->reset_access_stats(); }
 void                             Storage::set_string      (const std::string &section, const std::string &key, const std::string &value)                                         {        impl->set_string      (section, key, value); }
 void                             Storage::set_values      (const std::string &section, const std::string &key, const Values &values)                                             {        impl->set_values      (section, key, values); }
 bool                             Storage::remove_key      (const std::string &section, const std::string &key)                                                                   { return impl->remove_key      (section, key); }
 bool                             Storage::rename_key      (const std::string &section, const std::string &key, const std::string &new_section, const std::string &new_key)       { return impl->rename_key      (section, key, new_section, new_key); }
+void                             Storage::set_observer    (Observer *observer)                                                                                                   {        impl->set_observer    (observer); }
+bool                             Storage::open_journal    (const std::string &path, Callback *callback, unsigned compact_seconds)                                                { return impl->open_journal    (path, callback, compact_seconds); }
+bool                             Storage::compact_journal ()                                                                                                                     { return impl->compact_journal (); }
+bool                             Storage::close_journal   ()                                                                                                                     { return impl->close_journal   (); }
 
 }
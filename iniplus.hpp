@@ -28,11 +28,15 @@
 #define INIPLUS__INCLUDED
 
 
+#include <future>
+#include <iosfwd>
 #include <set>
 #include <string>
 #include <vector>
 #include <utility>
 
+#include <stdint.h>
+
 
 namespace iniplus {
 
@@ -58,6 +62,21 @@ public:
 
         virtual void error(size_t faulty_pos, size_t faulty_line, size_t faulty_char) = 0;
         virtual void warning(ParseWarning type, size_t faulty_pos, size_t faulty_line, size_t faulty_char) = 0;
+
+        /// load_directory() reports with the file name, by default these forward to error() and warning()
+        virtual void file_error(const std::string &/*path*/, size_t faulty_pos, size_t faulty_line, size_t faulty_char)
+        {
+            error(faulty_pos, faulty_line, faulty_char);
+        }
+
+        virtual void file_warning(const std::string &/*path*/, ParseWarning type, size_t faulty_pos, size_t faulty_line, size_t faulty_char)
+        {
+            warning(type, faulty_pos, faulty_line, faulty_char);
+        }
+
+        /// the file or the directory could not be read, error is the errno
+        virtual void read_error(const std::string &/*path*/, int /*error*/)
+        {}
     };
 
     class C_Callback : public Callback
@@ -107,6 +126,9 @@ public:
         operator std::string() const;
 
         bool contains_binary(void) const;
+
+        /// same, except for the well-formed UTF-8 characters
+        bool contains_binary_utf8(void) const;
     };
 
     class Values : public std::vector<Value>
@@ -121,26 +143,356 @@ public:
         Values& operator += (const Value &);
 
         bool contains_binary(void) const;
+        bool contains_binary_utf8(void) const;
     };
 
     typedef std::set<std::string> Strings;
 
+    /// gets the stored names by reference, return false to stop the iteration
+    class Visitor
+    {
+    protected:
+        Visitor()
+        {}
+
+    public:
+        virtual ~Visitor()
+        {}
+
+        virtual bool section(const std::string &/*section*/)
+        {
+            return true;
+        }
+
+        virtual bool entry(const std::string &/*section*/, const std::string &/*key*/, const Values &/*values*/)
+        {
+            return true;
+        }
+    };
+
+    typedef struct Lookup
+    {
+        const std::string *section;
+        const std::string *key;
+        const Values *default_values; // may be 0
+    } Lookup;
+
+    /// points into the storage or to the default values, valid until the storage changes
+    typedef struct LookupResult
+    {
+        bool found;
+        const Values *values; // the stored values (Storage only) or the default values, 0 if neither
+        size_t count;         // of the values
+        const char *data;     // the first value
+        size_t size;
+    } LookupResult;
+
+    /// lookups of a key through get_string(), get_values() and get_batch()
+    typedef struct AccessCount
+    {
+        std::string section;
+        std::string key;
+        uint64_t lookups;
+        uint64_t misses;   // the key did not exist
+        uint64_t defaults; // the key did not exist and a non-empty default was returned
+    } AccessCount;
+
+    typedef std::vector<AccessCount> AccessCounts;
+
+    /// where a value is stored
+    typedef struct Location
+    {
+        std::string section;
+        std::string key;
+        size_t index; // in the list
+    } Location;
+
+    typedef std::vector<Location> Locations;
+
+    /// heap bytes of a storage, the sizes of the tree nodes and the short string buffers are those of libstdc++
+    typedef struct MemoryUsage
+    {
+        size_t name_bytes;     // section and key names too long to live in their string objects
+        size_t value_bytes;    // value payload
+        size_t overhead_bytes; // the storage object, the map nodes, the value lists and the name terminators
+        size_t slack_bytes;    // capacity beyond the size of the names, the values and the value lists
+        size_t index_bytes;    // the insertion order, the hierarchy index, the expansion cache and the value index
+        size_t block_count;    // heap blocks, the allocator adds its own header to each
+        size_t total_bytes;    // of all the above but the block count
+    } MemoryUsage;
+
+    typedef enum ChangeType {
+        CHANGE_TYPE__SET = 0,
+        CHANGE_TYPE__REMOVE
+    } ChangeType;
+
+    typedef struct Change
+    {
+        ChangeType type;
+        std::string section;
+        std::string key;
+        Values values; // the new values, empty for CHANGE_TYPE__REMOVE
+    } Change;
+
+    typedef std::vector<Change> Changes;
+
+    /// hears about set_string(), set_values(), remove_key(), rename_key() and Transaction::commit(), one call each;
+    /// parsing, loading and clear() replace the whole content and are not reported
+    class Observer
+    {
+    protected:
+        Observer()
+        {}
+
+    public:
+        virtual ~Observer()
+        {}
+
+        virtual void changed(const Changes &changes) = 0;
+    };
+
+    /// checks the changes of a commit one by one, in the order they are applied
+    class Validator
+    {
+    protected:
+        Validator()
+        {}
+
+    public:
+        virtual ~Validator()
+        {}
+
+        /// old_values is 0 if the key did not exist, return false to roll the whole commit back
+        virtual bool validate(const Change &change, const Values *old_values) = 0;
+    };
+
+    /// stages changes, the storage sees none of them until commit()
+    class Transaction
+    {
+    public:
+        Transaction(Storage &storage);
+
+        void set_string(const std::string &section, const std::string &key, const std::string &string);
+        void set_values(const std::string &section, const std::string &key, const Values &values);
+        void remove_key(const std::string &section, const std::string &key);
+
+        /// applies the staged changes in a single sorted pass, a later change of the same key replaces an earlier one,
+        /// the sections left empty are removed and the observer is told once; if the validator rejects a change,
+        /// the changes applied so far are undone and false is returned; the staged changes are dropped either way
+        bool commit(Validator *validator = 0);
+
+        /// drops the staged changes
+        void rollback();
+
+        size_t size() const;
+
+    private:
+        Storage &m_storage;
+        Changes m_changes;
+    };
+
+    class Sink
+    {
+    protected:
+        Sink()
+        {}
+
+    public:
+        virtual ~Sink()
+        {}
+
+        /// returns false if the data could not be written, the generation stops then
+        virtual bool write(const char *data, size_t size) = 0;
+
+        /// called once after the last write
+        virtual bool flush()
+        {
+            return true;
+        }
+    };
+
+    /// appends to a string, reserve generated_size() beforehand to avoid reallocations
+    class StringSink : public Sink
+    {
+    public:
+        StringSink(std::string &string);
+        virtual ~StringSink();
+
+        virtual bool write(const char *data, size_t size);
+
+    private:
+        std::string &m_string;
+    };
+
+    /// writes into a preallocated buffer, fails when the buffer is too small
+    class BufferSink : public Sink
+    {
+    public:
+        BufferSink(char *buffer, size_t capacity);
+        virtual ~BufferSink();
+
+        virtual bool write(const char *data, size_t size);
+
+        size_t size() const;
+
+    private:
+        char *m_buffer;
+        size_t m_capacity;
+        size_t m_size;
+    };
+
+    class OStreamSink : public Sink
+    {
+    public:
+        OStreamSink(std::ostream &stream);
+        virtual ~OStreamSink();
+
+        virtual bool write(const char *data, size_t size);
+        virtual bool flush();
+
+    private:
+        std::ostream &m_stream;
+    };
+
+    /// collects small writes in a buffer, passes it along with large writes to writev
+    class FdSink : public Sink
+    {
+    public:
+        FdSink(int fd, size_t buffer_size = 64 * 1024);
+        virtual ~FdSink();
+
+        virtual bool write(const char *data, size_t size);
+        virtual bool flush();
+
+    private:
+        bool write_buffer(const char *data, size_t size);
+
+    private:
+        int m_fd;
+        std::vector<char> m_buffer;
+        size_t m_used;
+    };
+
+    typedef enum Option {
+        OPTION__CASE_INSENSITIVE = 0x01, // section and key names match ignoring the ASCII case, the first spelling is kept
+        OPTION__UTF8             = 0x02, // values may hold raw UTF-8 characters, generate() writes them unescaped
+        OPTION__ORDERED          = 0x04  // generate() and the visits without a prefix or range keep the order the sections
+                                         // and keys came in, the lookups by name go through hash tables
+    } Option;
+
 public:
-    Storage();
+    /// the options are a mask of Option, fixed for the life of the storage
+    explicit Storage(unsigned options = 0);
     ~Storage();
 
+    unsigned options() const;
+
     typedef struct ParseResult
     {
         bool success;
         size_t faulty_char;
         size_t faulty_line;
         size_t faulty_pos;
+
+        size_t bytes_processed;
+        size_t section_count;    // in the storage after parsing
+        size_t key_count;
+        size_t value_count;
+        size_t escapes_decoded;  // %xx in names, \n, \xNN and the like in values
+        size_t peak_name_size;   // of the section and key name buffers
+        size_t peak_value_size;  // of a single value buffer
+        size_t peak_value_count; // of the value list buffer
+        size_t allocations;      // 0 without an allocation counter
+
+        /// wall-clock time per phase in nanoseconds
+        uint64_t read_time;      // reading the file, 0 for parse()
+        uint64_t scan_time;      // tokenizing and decoding
+        uint64_t store_time;     // inserting into the storage
+        uint64_t total_time;
     } ParseResult;
 
+    /// returns the running number of allocations, like a counting operator new does
+    typedef size_t (*AllocationCounter)();
+
+    /// enables ParseResult::allocations, 0 disables it; set it before parsing on other threads
+    static void set_allocation_counter(AllocationCounter counter);
+
     bool parse(const std::string &text, Callback *callback = 0);
 
+    /// also fills the result, the statistics cost a few clock reads per key
+    bool parse(const std::string &text, ParseResult &result, Callback *callback = 0);
+
+    /// reads and parses the file
+    bool load(const std::string &path, Callback *callback = 0);
+    bool load(const std::string &path, ParseResult &result, Callback *callback = 0);
+
+    /// load() on an internal pool of a few threads; the storage must not be used until the future is ready,
+    /// the callback is called from the pool
+    std::future<bool> load_async(const std::string &path, Callback *callback = 0);
+
+    /// starts reading and parsing the files on the same pool; a later load() or load_async() of the same path
+    /// by a storage with the same options takes the result over instead of reading the file again, unless the
+    /// size or the mtime of the file changed since or the prefetch had not started yet; load() with a ParseResult
+    /// always reads the file itself to time it and leaves the prefetch to the others
+    static void prefetch(const std::vector<std::string> &paths, unsigned options = 0);
+
+    /// forgets the prefetched files that were not loaded
+    static void cancel_prefetch();
+
+    /// exchanges the content, the options, the indexes, the observer and the journal
+    void swap(Storage &other);
+
+    typedef enum MergePolicy {
+        MERGE_POLICY__OVERRIDE = 0, // a key in a later file replaces the values of the earlier ones
+        MERGE_POLICY__KEEP,         // the first file having a key wins
+        MERGE_POLICY__APPEND        // the values of a key from all the files are concatenated
+    } MergePolicy;
+
+    /// reads and parses the files of the directory matching the pattern (fnmatch, a leading dot must match explicitly)
+    /// on up to max_threads threads (0 means one per CPU), then merges them in the lexical order of their names;
+    /// the errors are reported per file from the calling thread, the files that failed are skipped and false is returned
+    bool load_directory(const std::string &path, const std::string &pattern = "*.ini", Callback *callback = 0,
+                        MergePolicy policy = MERGE_POLICY__OVERRIDE, unsigned max_threads = 0);
+
+    /// parses without storing, hands every entry to visitor.entry() as it is parsed (a repeated key comes again),
+    /// returns false if the text is malformed or the visitor stopped
+    /// of the options only OPTION__UTF8 matters here
+    static bool scan(const std::string &text, Visitor &visitor, Callback *callback = 0, unsigned options = 0);
+    static bool scan_file(const std::string &path, Visitor &visitor, Callback *callback = 0, unsigned options = 0);
+
     std::string generate() const;
 
+    /// returns the exact length of the generate() output
+    size_t generated_size() const;
+
+    /// streams the generate() output into the sink, returns false if the sink failed
+    bool generate_to(Sink &sink) const;
+
+    /// atomically replaces the file with the generate() output, does not touch it if the content is the same
+    /// returns false on I/O errors, the file stays intact then; a symlink is followed and its target replaced,
+    /// a new file gets 0666 less the umask
+    bool save(const std::string &path) const;
+
+    /// same output as generate(), the sections are split into contiguous ranges of about the same encoded size
+    /// and encoded on up to max_threads threads (0 means one per CPU) straight into the exact-size result
+    std::string generate_parallel(unsigned max_threads = 0) const;
+
+    /// save() with the output of generate_parallel()
+    bool save_parallel(const std::string &path, unsigned max_threads = 0) const;
+
+    /// compact binary image of the storage, Snapshot (iniplus_snapshot.hpp) uses it in place
+    std::string generate_binary() const;
+
+    /// returns false if the image is damaged or of an unknown version, the storage is not changed then
+    bool parse_binary(const char *data, size_t size);
+
+    bool save_binary(const std::string &path) const;
+    bool load_binary(const std::string &path);
+
+    /// loads the snapshot without reading the file if it was made of the file as it is now (same size and mtime),
+    /// otherwise parses the file and rewrites the snapshot
+    bool load_cached(const std::string &path, const std::string &snapshot_path, Callback *callback = 0);
+
 
     void clear();
 
@@ -148,24 +500,86 @@ public:
 
     bool is_section_exist(const std::string &section) const;
 
+    /// the visiting functions return false if the visitor stopped the iteration
+    /// the prefix and range ones take time proportional to the number of matches
+    bool visit_sections(Visitor &visitor) const;
+    bool visit_sections_with_prefix(const std::string &prefix, Visitor &visitor) const;
+    /// sections from first (inclusive) to last (exclusive)
+    bool visit_sections_in_range(const std::string &first, const std::string &last, Visitor &visitor) const;
+
+    /// calls section() before the entries of each section
+    bool visit_entries(Visitor &visitor) const;
+
     /// returns false is the section did not exist
     bool remove_section(const std::string &section);
 
     /// returns false is the section did not exist or new_section exists
     bool rename_section(const std::string &section, const std::string &new_section);
 
+    /// Section names with dots form a hierarchy: "cluster.eu.node17" is a child of "cluster.eu", which is a child of "cluster".
+    /// The empty name stands for the top level. A child may have no keys of its own, only descendants.
+    /// The index keeps the queries below proportional to the size of the subtree, without it they scan the name range.
+    void set_hierarchy_index(bool enabled);
+
+    /// gives the full names of the direct children, sorted by name
+    bool visit_child_sections(const std::string &section, Visitor &visitor) const;
+    Strings get_child_sections(const std::string &section) const;
+
+    /// visits the section and all the sections below it depth-first, every section before its children,
+    /// the children sorted by name; "a.b" comes before "a-b" then, unlike in the order of visit_sections()
+    bool visit_subtree(const std::string &section, Visitor &visitor) const;
+
+    /// removes the section and all the sections below it, returns the number of removed sections
+    size_t remove_subtree(const std::string &section);
+
     Strings get_all_keys(const std::string &section) const;
 
     bool is_key_exist(const std::string &section, const std::string &key) const;
 
+    bool visit_keys(const std::string &section, Visitor &visitor) const;
+    bool visit_keys_with_prefix(const std::string &section, const std::string &prefix, Visitor &visitor) const;
+
     bool is_list(const std::string &section, const std::string &key) const;
 
     bool contains_binary(const std::string &section, const std::string &key) const;
+    bool contains_binary_utf8(const std::string &section, const std::string &key) const;
 
     /// returns pair of success flag and the value, success is false if the key did not exist and the default_value used as the returned value
     std::pair<bool, std::string> get_string(const std::string &section, const std::string &key, const std::string &default_string = std::string()) const;
     std::pair<bool, Values> get_values(const std::string &section, const std::string &key, const Values &default_values = Values()) const;
 
+    /// same as above, with every ${section:key} and ${key} (of the same section) replaced by the first value of that key,
+    /// expanded the same way; the references to missing keys, closing a cycle or nested over 64 deep stay as written;
+    /// the results are memoized until a key they were made of is set, removed or renamed
+    std::pair<bool, std::string> get_expanded_string(const std::string &section, const std::string &key, const std::string &default_string = std::string()) const;
+    std::pair<bool, Values> get_expanded_values(const std::string &section, const std::string &key, const Values &default_values = Values()) const;
+
+    /// looks up many keys at once without copying, keys of the same section share a single section lookup
+    void get_batch(const Lookup *lookups, size_t count, LookupResult *results) const;
+
+    /// lists where the value is stored, sorted by section, key and index; the first call builds a reverse index
+    /// that the changes keep up to date, so the next ones take time in proportion to the matches
+    Locations find_value(const std::string &value) const;
+
+    /// builds the reverse index now, or drops it until the next find_value()
+    void set_value_index(bool enabled);
+
+    /// walks the whole storage, the access statistics are not counted
+    MemoryUsage memory_usage() const;
+
+    /// releases the slack capacity of the values and the value lists, returns the bytes released;
+    /// also drops the tombstones of the removed names from the insertion order; the pointers into the values are invalidated
+    size_t shrink_to_fit();
+
+    /// true if the library was built with INIPLUS_ACCESS_STATS, the counting is compiled out otherwise
+    static bool has_access_stats();
+
+    /// sorted by section and key, lists the stored keys that were never looked up with zero counts
+    /// and the missing keys that were looked up; empty without INIPLUS_ACCESS_STATS
+    AccessCounts access_stats() const;
+
+    void reset_access_stats();
+
     void set_string(const std::string &section, const std::string &key, const std::string &string);
     void set_values(const std::string &section, const std::string &key, const Values &values);
 
@@ -175,6 +589,22 @@ public:
     /// returns false is the section/key did not exist or new_section/new_key exists
     bool rename_key(const std::string &section, const std::string &key, const std::string &new_section, const std::string &new_key);
 
+    /// 0 stops the notifications, the observer must outlive the storage or be replaced
+    void set_observer(Observer *observer);
+
+    /// loads the file (a missing one is empty) and replays path.journal over it, then appends every set_string(),
+    /// set_values(), remove_key(), rename_key(), remove_section(), rename_section(), remove_subtree() and
+    /// Transaction::commit() to the journal as one synced record instead of rewriting the file;
+    /// every compact_seconds (0 never) a background thread folds the journal into the file with an atomic replace
+    /// parse(), load(), clear() and the like are not journaled, compact_journal() persists them
+    bool open_journal(const std::string &path, Callback *callback = 0, unsigned compact_seconds = 60);
+
+    /// saves the storage as the new file and empties the journal
+    bool compact_journal();
+
+    /// stops journaling, returns false if a change could not be appended since the last compaction
+    bool close_journal();
+
 private:
     StorageImpl *impl;
 };
@@ -0,0 +1,496 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+/*  iniplus_bench [filter] [--min-time=seconds]
+ *
+ *  Runs every benchmark whose "corpus/benchmark" name contains the filter on a set of synthetic corpora
+ *  and prints the results as JSON. The corpora are the same on every run, so runs can be compared between commits.
+ */
+
+
+#include "iniplus.hpp"
+#include "iniplus_snapshot.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+
+/// the threaded benchmarks allocate on several threads at once
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *result = malloc(size ? size : 1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void *operator new[](size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *result = malloc(size ? size : 1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+
+namespace {
+
+/// deterministic, so the corpora do not depend on the platform's rand()
+class Random
+{
+public:
+    Random(uint64_t seed)
+        : m_state(seed)
+    {}
+
+    uint32_t next()
+    {
+        m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return static_cast<uint32_t>(m_state >> 33);
+    }
+
+    uint32_t below(uint32_t limit)
+    {
+        return next() % limit;
+    }
+
+    std::string word(size_t min_length, size_t max_length)
+    {
+        static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+        std::string result;
+        size_t length = min_length + below(max_length - min_length + 1);
+        for (size_t i = 0; i != length; ++i)
+            result += letters[below(sizeof(letters) - 1)];
+        return result;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+typedef struct Corpus
+{
+    std::string name;
+    std::string text;
+} Corpus;
+
+typedef enum CorpusKind {
+    CORPUS_KIND__SMALL_SECTIONS,
+    CORPUS_KIND__HUGE_SECTIONS,
+    CORPUS_KIND__LONG_VALUES,
+    CORPUS_KIND__LISTS,
+    CORPUS_KIND__ESCAPED,
+    CORPUS_KIND__COMMENTS
+} CorpusKind;
+
+std::string escaped_name(Random &random)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result = random.word(2, 6);
+    for (int i = 0; i != 3; ++i)
+    {
+        unsigned char ch = 0x20 + random.below(0x5f);
+        result += '%';
+        result += hex[ch / 16];
+        result += hex[ch % 16];
+        result += random.word(1, 4);
+    }
+    return result;
+}
+
+std::string escaped_value(Random &random)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    static const char *escapes[] = { "\\n", "\\t", "\\\"", "\\\\", "\\0" };
+    std::string result;
+    for (int i = 0; i != 8; ++i)
+    {
+        result += random.word(1, 8);
+        if (random.below(2))
+        {
+            unsigned char ch = 0x80 + random.below(0x80);
+            result += "\\x";
+            result += hex[ch / 16];
+            result += hex[ch % 16];
+        }
+        else
+            result += escapes[random.below(5)];
+    }
+    return result;
+}
+
+Corpus make_corpus(CorpusKind kind)
+{
+    Random random(0x1234567 + kind);
+    Corpus result;
+    std::string &text = result.text;
+
+    switch (kind)
+    {
+    case CORPUS_KIND__SMALL_SECTIONS:
+        result.name = "small_sections";
+        for (int s = 0; s != 5000; ++s)
+        {
+            text += "[section" + std::to_string(s) + "." + random.word(3, 8) + "]\n";
+            for (int k = 0; k != 5; ++k)
+                text += "key" + std::to_string(k) + " = " + random.word(4, 16) + "\n";
+            text += "\n";
+        }
+        break;
+
+    case CORPUS_KIND__HUGE_SECTIONS:
+        result.name = "huge_sections";
+        for (int s = 0; s != 4; ++s)
+        {
+            text += "[huge" + std::to_string(s) + "]\n";
+            for (int k = 0; k != 20000; ++k)
+                text += random.word(4, 12) + std::to_string(k) + " = " + random.word(4, 24) + "\n";
+            text += "\n";
+        }
+        break;
+
+    case CORPUS_KIND__LONG_VALUES:
+        result.name = "long_values";
+        for (int s = 0; s != 20; ++s)
+        {
+            text += "[long" + std::to_string(s) + "]\n";
+            for (int k = 0; k != 25; ++k)
+            {
+                text += "key" + std::to_string(k) + " = ";
+                for (int w = 0; w != 400; ++w)
+                    text += random.word(4, 10) + " ";
+                text += "end\n";
+            }
+        }
+        break;
+
+    case CORPUS_KIND__LISTS:
+        result.name = "lists";
+        for (int s = 0; s != 500; ++s)
+        {
+            text += "[list" + std::to_string(s) + "]\n";
+            for (int k = 0; k != 10; ++k)
+            {
+                text += "key" + std::to_string(k) + " = ";
+                for (int i = 0; i != 20; ++i)
+                    text += (i ? ", " : "") + random.word(2, 12);
+                text += "\n";
+            }
+        }
+        break;
+
+    case CORPUS_KIND__ESCAPED:
+        result.name = "escaped";
+        for (int s = 0; s != 1000; ++s)
+        {
+            text += "[" + escaped_name(random) + "]\n";
+            for (int k = 0; k != 8; ++k)
+                text += escaped_name(random) + " = \"" + escaped_value(random) + "\"\n";
+        }
+        break;
+
+    case CORPUS_KIND__COMMENTS:
+        result.name = "comments";
+        for (int s = 0; s != 2000; ++s)
+        {
+            text += "; " + random.word(20, 60) + " " + random.word(20, 60) + "\n";
+            text += "[commented" + std::to_string(s) + "] ; " + random.word(10, 30) + "\n";
+            for (int k = 0; k != 4; ++k)
+            {
+                text += ";; " + random.word(30, 80) + "\n";
+                text += "key" + std::to_string(k) + " = " + random.word(4, 16) + "\n";
+            }
+        }
+        break;
+    }
+
+    return result;
+}
+
+
+typedef struct Result
+{
+    std::string corpus;
+    std::string benchmark;
+    uint64_t iterations;
+    double ns_per_op;
+    double bytes_per_second; // 0 when not meaningful
+    double allocations_per_op;
+} Result;
+
+typedef struct Entry
+{
+    std::string section;
+    std::string key;
+} Entry;
+
+class Collector : public iniplus::Storage::Visitor
+{
+public:
+    virtual bool entry(const std::string &section, const std::string &key, const iniplus::Storage::Values &)
+    {
+        Entry entry = { section, key };
+        m_entries.push_back(entry);
+        return true;
+    }
+
+    std::vector<Entry> m_entries;
+};
+
+/// runs the body until min_time passes, the body returns the number of operations it made and sets the bytes it processed
+template <typename Body>
+Result measure(const std::string &corpus, const std::string &benchmark, double min_time, Body body)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    uint64_t operations = 0;
+    uint64_t bytes = 0;
+    uint64_t start_allocations = allocations.load(std::memory_order_relaxed);
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    do
+    {
+        size_t body_bytes = 0;
+        uint64_t body_operations = body(body_bytes);
+        if (!body_operations)
+            break;
+        operations += body_operations;
+        bytes += body_bytes;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    while (elapsed < min_time);
+
+    Result result;
+    result.corpus = corpus;
+    result.benchmark = benchmark;
+    result.iterations = operations;
+    result.ns_per_op = operations ? elapsed * 1e9 / operations : 0;
+    result.bytes_per_second = bytes ? bytes / elapsed : 0;
+    result.allocations_per_op = operations ? static_cast<double>(allocations.load(std::memory_order_relaxed) - start_allocations) / operations : 0;
+    return result;
+}
+
+/// keeps the optimizer from dropping the lookups
+volatile size_t sink = 0;
+
+void run_corpus(const Corpus &corpus, const std::string &filter, double min_time, std::vector<Result> &results)
+{
+    // a corpus that does not parse would benchmark an empty storage
+    iniplus::Storage storage;
+    if (!storage.parse(corpus.text))
+    {
+        fprintf(stderr, "corpus %s does not parse\n", corpus.name.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    Collector collector;
+    storage.visit_entries(collector);
+    const std::vector<Entry> &entries = collector.m_entries;
+
+    std::vector<Entry> misses = entries;
+    for (size_t i = 0; i != misses.size(); ++i)
+        misses[i].key += "_missing";
+
+    iniplus::Storage::Strings all_sections = storage.get_all_sections();
+    std::vector<std::string> sections(all_sections.begin(), all_sections.end());
+
+    const size_t lookups = std::min<size_t>(entries.size(), 4096);
+
+    iniplus::Snapshot fixed;
+    size_t fixed_size = 0;
+    fixed.parse(corpus.text.data(), corpus.text.size(), 0, 0, fixed_size);
+    std::string fixed_space(fixed_size + 8, '\0');
+    char *fixed_buffer = &fixed_space[0] + (8 - reinterpret_cast<uintptr_t>(fixed_space.data()) % 8) % 8;
+    size_t fixed_required;
+    if (!fixed.parse(corpus.text.data(), corpus.text.size(), fixed_buffer, fixed_size, fixed_required))
+    {
+        fprintf(stderr, "corpus %s does not parse into a fixed buffer\n", corpus.name.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+#define BENCHMARK(NAME, BODY) \
+    if ((corpus.name + "/" + NAME).find(filter) != std::string::npos) \
+        results.push_back(measure(corpus.name, NAME, min_time, BODY))
+
+    BENCHMARK("parse", [&](size_t &bytes) -> uint64_t {
+        iniplus::Storage parsed;
+        parsed.parse(corpus.text);
+        bytes = corpus.text.size();
+        return 1;
+    });
+
+    BENCHMARK("parse_fixed", [&](size_t &bytes) -> uint64_t {
+        size_t required;
+        fixed.parse(corpus.text.data(), corpus.text.size(), fixed_buffer, fixed_size, required);
+        bytes = corpus.text.size();
+        return 1;
+    });
+
+    BENCHMARK("generate", [&](size_t &bytes) -> uint64_t {
+        std::string text = storage.generate();
+        bytes = text.size();
+        return 1;
+    });
+
+    BENCHMARK("generate_parallel", [&](size_t &bytes) -> uint64_t {
+        std::string text = storage.generate_parallel();
+        bytes = text.size();
+        return 1;
+    });
+
+    BENCHMARK("get_string_hit", [&](size_t &) -> uint64_t {
+        for (size_t i = 0; i != lookups; ++i)
+            sink += storage.get_string(entries[i].section, entries[i].key).second.size();
+        return lookups;
+    });
+
+    BENCHMARK("get_string_miss", [&](size_t &) -> uint64_t {
+        for (size_t i = 0; i != lookups; ++i)
+            sink += storage.get_string(misses[i].section, misses[i].key).second.size();
+        return lookups;
+    });
+
+    BENCHMARK("get_values_hit", [&](size_t &) -> uint64_t {
+        for (size_t i = 0; i != lookups; ++i)
+            sink += storage.get_values(entries[i].section, entries[i].key).second.size();
+        return lookups;
+    });
+
+    BENCHMARK("get_values_miss", [&](size_t &) -> uint64_t {
+        for (size_t i = 0; i != lookups; ++i)
+            sink += storage.get_values(misses[i].section, misses[i].key).second.size();
+        return lookups;
+    });
+
+    BENCHMARK("set_values", [&](size_t &) -> uint64_t {
+        iniplus::Storage::Values values(iniplus::Storage::Value(std::string("value")));
+        for (size_t i = 0; i != lookups; ++i)
+            storage.set_values(entries[i].section, entries[i].key, values);
+        return lookups;
+    });
+
+    BENCHMARK("rename_section", [&](size_t &) -> uint64_t {
+        size_t m = std::min<size_t>(sections.size(), 256);
+        for (size_t i = 0; i != m; ++i)
+            storage.rename_section(sections[i], sections[i] + "_renamed");
+        for (size_t i = 0; i != m; ++i)
+            storage.rename_section(sections[i] + "_renamed", sections[i]);
+        return 2 * m;
+    });
+
+    BENCHMARK("get_all_keys", [&](size_t &) -> uint64_t {
+        size_t m = std::min<size_t>(sections.size(), 256);
+        for (size_t i = 0; i != m; ++i)
+            sink += storage.get_all_keys(sections[i]).size();
+        return m;
+    });
+
+#undef BENCHMARK
+}
+
+void print_string(const std::string &string)
+{
+    putchar('"');
+    for (size_t i = 0; i != string.length(); ++i)
+    {
+        char ch = string[i];
+        if ((ch == '"') || (ch == '\\'))
+            putchar('\\');
+        putchar(ch);
+    }
+    putchar('"');
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+    std::string filter;
+    double min_time = 0.2;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strncmp(argv[i], "--min-time=", 11))
+            min_time = atof(argv[i] + 11);
+        else
+            filter = argv[i];
+    }
+
+    std::vector<Result> results;
+    for (int kind = CORPUS_KIND__SMALL_SECTIONS; kind <= CORPUS_KIND__COMMENTS; ++kind)
+    {
+        Corpus corpus = make_corpus(static_cast<CorpusKind>(kind));
+        run_corpus(corpus, filter, min_time, results);
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"results\": [\n", FULL_VERSION);
+    for (size_t i = 0; i != results.size(); ++i)
+    {
+        const Result &result = results[i];
+        printf("    {\"corpus\": ");
+        print_string(result.corpus);
+        printf(", \"benchmark\": ");
+        print_string(result.benchmark);
+        printf(", \"iterations\": %llu, \"ns_per_op\": %.2f, \"bytes_per_second\": %.0f, \"allocations_per_op\": %.3f}%s\n",
+               static_cast<unsigned long long>(result.iterations), result.ns_per_op, result.bytes_per_second, result.allocations_per_op,
+               (i + 1 == results.size()) ? "" : ",");
+    }
+    printf("  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,777 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+#ifndef INIPLUS_GRAMMAR__INCLUDED
+#define INIPLUS_GRAMMAR__INCLUDED
+
+
+#include "iniplus.hpp"
+
+#include <stddef.h>
+
+
+#if __cplusplus >= 202002L
+#define INIPLUS_GRAMMAR_CONSTEXPR constexpr
+#else
+#define INIPLUS_GRAMMAR_CONSTEXPR
+#endif
+
+
+namespace iniplus {
+
+/*  The INI grammar of Storage (iniplus.cpp) and StaticStorage (iniplus_static.hpp), constexpr under C++20.
+ *
+ *  Text      operator [] giving '\0' at length(), length(), data()
+ *  Name      clear(), += char, operator [] on the last char, length()
+ *  Value     clear(), += char, operator [] on the last char, size(),
+ *            trim_value(value) and append_value(value, data, size) found by argument-dependent lookup
+ *  Values    clear(), += Value
+ *  Target    entry(section, key, values), false stops the parse
+ *  Stats     escape(), begin_store(), end_store(section, key, values), fail(pos, line, char)
+ */
+class Grammar
+{
+public:
+    /// hands every parsed entry to target.entry(section, key, values), stops if it returns false;
+    /// with utf8 the values may also hold raw UTF-8 characters
+    template <typename Text, typename Name, typename Values, typename Value, typename Target, typename Stats>
+    static INIPLUS_GRAMMAR_CONSTEXPR bool parse(const Text &text, Storage::Callback *callback, Target &target, Stats &stats, bool utf8,
+        Name &current_section, Name &current_key, Values &current_values, Value &current_value)
+    {
+/*  [ A-Za-z0-9_-. %xx ] ;...
+ *  s                    c
+ *  s n             hxec
+ *
+ *  A-Za-z0-9_-. %xx = "0x21-0x7e \? \xxx" , ;...
+ *  k                e v                   e c
+ *  n             hx q qs          b   hxe q
+ */
+        Context context = CONTEXT__NEWLINE;
+        Context last_context = context; // to shut up the compiler
+
+        size_t length = text.length();
+
+        size_t cur_char = 1;
+        size_t cur_line = 1;
+        size_t cur_pos = 0;
+        for (; cur_pos < length; ++cur_pos, ++cur_char)
+        {
+            const char &input = text[cur_pos];
+
+            CharClass char_class = get_char_class(input);
+
+            bool fail = false;
+
+            bool step_back = false;
+            do
+            {
+                step_back = false;
+
+                switch (context)
+                {
+                case CONTEXT__NEWLINE:
+                    current_key.clear();
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__NEWLINE:
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__SEMICOLON:
+                        context = CONTEXT__COMMENT;
+                        break;
+
+                    case CHAR_CLASS__OPENBRACKET:
+                        current_section.clear();
+                        context = CONTEXT__SECTION_START;
+                        break;
+
+                    case CHAR_CLASS__HEXDIGIT:
+                    case CHAR_CLASS__LETTERS:
+                    case CHAR_CLASS__MINUS:
+                        current_key += input;
+                        context = CONTEXT__KEY_NAME;
+                        break;
+
+                    case CHAR_CLASS__PERCENT:
+                        context = CONTEXT__KEY_HEX1;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__COMMENT:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__NEWLINE:
+                        context = CONTEXT__NEWLINE;
+                        break;
+
+                    default:;
+                    }
+                    break;
+
+                case CONTEXT__SECTION_START:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__HEXDIGIT:
+                    case CHAR_CLASS__LETTERS:
+                    case CHAR_CLASS__MINUS:
+                        current_section += input;
+                        context = CONTEXT__SECTION_NAME;
+                        break;
+
+                    case CHAR_CLASS__PERCENT:
+                        context = CONTEXT__SECTION_HEX1;
+                        break;
+
+                    case CHAR_CLASS__CLOSEBRACKET:
+                        context = CONTEXT__SECTION_CLOSE;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__SECTION_NAME:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__SPACE:
+                        context = CONTEXT__SECTION_END;
+                        break;
+
+                    case CHAR_CLASS__HEXDIGIT:
+                    case CHAR_CLASS__LETTERS:
+                    case CHAR_CLASS__MINUS:
+                        current_section += input;
+                        break;
+
+                    case CHAR_CLASS__PERCENT:
+                        context = CONTEXT__SECTION_HEX1;
+                        break;
+
+                    case CHAR_CLASS__CLOSEBRACKET:
+                        context = CONTEXT__SECTION_CLOSE;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__SECTION_HEX1:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__HEXDIGIT:
+                        stats.escape();
+                        current_section += char_to_hex(input) << 4;
+                        context = CONTEXT__SECTION_HEX2;
+                        break;
+
+                    default:
+                        current_section += input;
+                        context = CONTEXT__SECTION_NAME;
+                        step_back = true;
+//                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__SECTION_HEX2:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__HEXDIGIT:
+                        current_section[current_section.length() - 1] |= char_to_hex(input);
+                        if (!current_section[current_section.length() - 1])
+                            if (callback)
+                                callback->warning(Storage::PARSE_WARNING__BINARY_ZERO_IN_SECTION_NAME, cur_pos - 2, cur_line, cur_char - 2);
+                        context = CONTEXT__SECTION_NAME;
+                        break;
+
+                    default:
+                        current_section[current_section.size() - 1] >>= 4;
+                        context = CONTEXT__SECTION_NAME;
+                        step_back = true;
+//                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__SECTION_END:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__CLOSEBRACKET:
+                        context = CONTEXT__SECTION_CLOSE;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__SECTION_CLOSE:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__NEWLINE:
+                        context = CONTEXT__NEWLINE;
+                        break;
+
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__SEMICOLON:
+                        context = CONTEXT__COMMENT;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__KEY_NAME:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__SPACE:
+                        context = CONTEXT__KEY_END;
+                        break;
+
+                    case CHAR_CLASS__HEXDIGIT:
+                    case CHAR_CLASS__LETTERS:
+                    case CHAR_CLASS__MINUS:
+                    case CHAR_CLASS__BACKSLASH:
+                        current_key += input;
+                        break;
+
+                    case CHAR_CLASS__PERCENT:
+                        context = CONTEXT__KEY_HEX1;
+                        break;
+
+                    case CHAR_CLASS__EQUAL:
+                        current_values.clear();
+                        current_value.clear();
+                        context = CONTEXT__EQUAL;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__KEY_HEX1:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__HEXDIGIT:
+                        stats.escape();
+                        current_key += char_to_hex(input) << 4;
+                        context = CONTEXT__KEY_HEX2;
+                        break;
+
+                    default:
+                        current_key += input;
+                        context = CONTEXT__KEY_NAME;
+                        step_back = true;
+//                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__KEY_HEX2:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__HEXDIGIT:
+                        current_key[current_key.length() - 1] |= char_to_hex(input);
+                        if (!current_key[current_key.length() - 1])
+                            if (callback)
+                                callback->warning(Storage::PARSE_WARNING__BINARY_ZERO_IN_KEY_NAME, cur_pos - 2, cur_line, cur_char - 2);
+                        context = CONTEXT__KEY_NAME;
+                        break;
+
+                    default:
+                        current_key[current_key.size() - 1] >>= 4;
+                        context = CONTEXT__KEY_NAME;
+                        step_back = true;
+//                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__KEY_END:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__EQUAL:
+                        current_values.clear();
+                        current_value.clear();
+                        context = CONTEXT__EQUAL;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__EQUAL:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__NEWLINE:
+                        current_values += current_value;
+                        current_value.clear();
+                        if (!store(current_section, current_key, current_values, target, stats))
+                            return false;
+                        context = CONTEXT__NEWLINE;
+                        break;
+
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__SEMICOLON:
+                        context = CONTEXT__COMMENT;
+                        break;
+
+                    case CHAR_CLASS__QUOTE:
+                        context = CONTEXT__VALUE_QUOTED;
+                        break;
+
+                    case CHAR_CLASS__BACKSLASH:
+                        last_context = CONTEXT__VALUE_START;
+                        context = CONTEXT__VALUE_ESCAPED;
+                        break;
+
+                    case CHAR_CLASS__COMMA:
+                        current_values += trim_value(current_value);
+                        current_value.clear();
+                        context = CONTEXT__EQUAL;
+                        break;
+
+                    default:
+                        if ((input >= 0x20) && (input < 0x7f))
+                            current_value += input;
+                        else if (!utf8 || !take_utf8(text, cur_pos, current_value))
+                        {
+                            fail = true;
+                            break;
+                        }
+                        context = CONTEXT__VALUE_START;
+                    }
+                    break;
+
+                case CONTEXT__VALUE_QUOTED:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__QUOTE:
+                        current_values += current_value;
+                        current_value.clear();
+                        context = CONTEXT__VALUE_END;
+                        break;
+
+                    case CHAR_CLASS__BACKSLASH:
+                        last_context = context;
+                        context = CONTEXT__VALUE_ESCAPED;
+                        break;
+
+                    default:
+                        if ((input >= 0x20) && (input < 0x7f))
+                            current_value += input;
+                        else if (!utf8 || !take_utf8(text, cur_pos, current_value))
+                            fail = true;
+                    }
+                    break;
+
+                case CONTEXT__VALUE_START:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__NEWLINE:
+                        current_values += trim_value(current_value);
+                        current_value.clear();
+                        if (!store(current_section, current_key, current_values, target, stats))
+                            return false;
+                        context = CONTEXT__NEWLINE;
+                        break;
+
+                    case CHAR_CLASS__SPACE:
+                        current_value += input;
+                        break;
+
+                    case CHAR_CLASS__SEMICOLON:
+                        context = CONTEXT__COMMENT;
+                        break;
+
+                    case CHAR_CLASS__BACKSLASH:
+                        last_context = context;
+                        context = CONTEXT__VALUE_ESCAPED;
+                        break;
+
+                    case CHAR_CLASS__COMMA:
+                        current_values += trim_value(current_value);
+                        current_value.clear();
+                        context = CONTEXT__EQUAL;
+                        break;
+
+                    default:
+                        if ((input >= 0x20) && (input < 0x7f))
+                            current_value += input;
+                        else if (!utf8 || !take_utf8(text, cur_pos, current_value))
+                            fail = true;
+                    }
+                    break;
+
+                case CONTEXT__VALUE_ESCAPED:
+                    switch (input) // !! INPUT, NOT CLASS
+                    {
+                    case '0':
+                        current_value += '\0';
+                        context = last_context;
+                        break;
+
+                    case 'a':
+                        current_value += '\a';
+                        context = last_context;
+                        break;
+
+                    case 'b':
+                        current_value += '\b';
+                        context = last_context;
+                        break;
+
+                    case 'f':
+                        current_value += '\f';
+                        context = last_context;
+                        break;
+
+                    case 'n':
+                        current_value += '\n';
+                        context = last_context;
+                        break;
+
+                    case 'r':
+                        current_value += '\r';
+                        context = last_context;
+                        break;
+
+                    case 't':
+                        current_value += '\t';
+                        context = last_context;
+                        break;
+
+                    case 'v':
+                        current_value += '\v';
+                        context = last_context;
+                        break;
+
+                    case '"':
+                    case '\\':
+                        current_value += input;
+                        context = last_context;
+                        break;
+
+                    case 'x':
+                        context = CONTEXT__VALUE_HEX1;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    if (context == last_context) // \xNN counts once its digits are read
+                        stats.escape();
+                    break;
+
+                case CONTEXT__VALUE_HEX1:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__HEXDIGIT:
+                        current_value += char_to_hex(input) << 4;
+                        context = CONTEXT__VALUE_HEX2;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+
+                case CONTEXT__VALUE_HEX2:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__HEXDIGIT:
+                        current_value[current_value.size() - 1] |= char_to_hex(input);
+                        context = last_context;
+                        break;
+
+                    default:
+                        current_value[current_value.size() - 1] >>= 4;
+                        context = last_context;
+                        step_back = true;
+//                        fail = true;
+                    }
+                    stats.escape();
+                    break;
+
+                case CONTEXT__VALUE_END:
+                    switch (char_class)
+                    {
+                    case CHAR_CLASS__NEWLINE:
+                        if (!store(current_section, current_key, current_values, target, stats))
+                            return false;
+                        context = CONTEXT__NEWLINE;
+                        break;
+
+                    case CHAR_CLASS__SPACE:
+                        break;
+
+                    case CHAR_CLASS__SEMICOLON:
+                        if (!store(current_section, current_key, current_values, target, stats))
+                            return false;
+                        context = CONTEXT__COMMENT;
+                        break;
+
+                    case CHAR_CLASS__COMMA:
+                        context = CONTEXT__EQUAL;
+                        break;
+
+                    default:
+                        fail = true;
+                    }
+                    break;
+                }
+            }
+            while (step_back);
+
+            if (fail)
+            {
+                stats.fail(cur_pos, cur_line, cur_char);
+                if (callback)
+                    callback->error(cur_pos, cur_line, cur_char);
+                return false;
+            }
+
+            if ((input == '\r') || ((input == '\n') && (text[cur_pos + 1] != '\r')))
+            {
+                cur_char = 0;
+                ++cur_line;
+            }
+        }
+
+        switch (context)
+        {
+        case CONTEXT__NEWLINE:
+        case CONTEXT__COMMENT:
+        case CONTEXT__SECTION_CLOSE:
+            return true;
+
+        case CONTEXT__VALUE_START:
+            current_values += trim_value(current_value);
+            current_value.clear();
+        // FALL THROUGH
+        case CONTEXT__VALUE_END:
+            return store(current_section, current_key, current_values, target, stats);
+
+        default:;
+        }
+
+        stats.fail(cur_pos, cur_line, cur_char);
+        if (callback)
+            callback->error(cur_pos, cur_line, cur_char);
+
+        return false;
+    }
+
+    /// returns the length of the well-formed UTF-8 sequence of a non-ASCII character at the start, 0 if there is none
+    /// (no overlong forms, no surrogates, nothing above U+10FFFF)
+    static INIPLUS_GRAMMAR_CONSTEXPR size_t utf8_sequence_length(const char *data, size_t size)
+    {
+        unsigned char lead = static_cast<unsigned char>(data[0]);
+
+        size_t length;
+        unsigned char low = 0x80; // the range of the second byte
+        unsigned char high = 0xbf;
+        if ((lead >= 0xc2) && (lead <= 0xdf))
+            length = 2;
+        else if ((lead >= 0xe0) && (lead <= 0xef))
+        {
+            length = 3;
+            if (lead == 0xe0)
+                low = 0xa0;
+            else if (lead == 0xed)
+                high = 0x9f;
+        }
+        else if ((lead >= 0xf0) && (lead <= 0xf4))
+        {
+            length = 4;
+            if (lead == 0xf0)
+                low = 0x90;
+            else if (lead == 0xf4)
+                high = 0x8f;
+        }
+        else
+            return 0;
+
+        if ((size < length) || (static_cast<unsigned char>(data[1]) < low) || (static_cast<unsigned char>(data[1]) > high))
+            return 0;
+        for (size_t i = 2; i != length; ++i)
+            if ((static_cast<unsigned char>(data[i]) & 0xc0) != 0x80)
+                return 0;
+
+        return length;
+    }
+
+private:
+    typedef enum Context {
+        CONTEXT__NEWLINE,
+        CONTEXT__COMMENT,
+        CONTEXT__SECTION_START,
+        CONTEXT__SECTION_NAME,
+        CONTEXT__SECTION_HEX1,
+        CONTEXT__SECTION_HEX2,
+        CONTEXT__SECTION_END,
+        CONTEXT__SECTION_CLOSE,
+        CONTEXT__KEY_NAME,
+        CONTEXT__KEY_HEX1,
+        CONTEXT__KEY_HEX2,
+        CONTEXT__KEY_END,
+        CONTEXT__EQUAL,
+        CONTEXT__VALUE_QUOTED,
+        CONTEXT__VALUE_START,
+        CONTEXT__VALUE_ESCAPED,
+        CONTEXT__VALUE_HEX1,
+        CONTEXT__VALUE_HEX2,
+        CONTEXT__VALUE_END
+    } Context;
+
+    typedef enum CharClass {
+        CHAR_CLASS__NEWLINE,      // \r \n
+        CHAR_CLASS__SPACE,        // \s \t
+        CHAR_CLASS__SEMICOLON,    // ;
+        CHAR_CLASS__OPENBRACKET,  // [
+        CHAR_CLASS__CLOSEBRACKET, // ]
+        CHAR_CLASS__PERCENT,      // %
+        CHAR_CLASS__HEXDIGIT,     // 0-9A-Fa-f
+        CHAR_CLASS__LETTERS,      // G-Zg-z
+        CHAR_CLASS__MINUS,        // _.-
+        CHAR_CLASS__EQUAL,        // =
+        CHAR_CLASS__QUOTE,        // "
+        CHAR_CLASS__BACKSLASH,    // \\ (backslash)
+        CHAR_CLASS__COMMA,        // ,
+        CHAR_CLASS__VISIBLE,      // other 0x21-0x7e
+        CHAR_CLASS__OTHER         // other 0x00-0x1f, 0x7f-0xff
+    } CharClass;
+
+    /// appends the UTF-8 character at the position, which is left on its last byte, so it counts as one char
+    template <typename Text, typename Value>
+    static INIPLUS_GRAMMAR_CONSTEXPR bool take_utf8(const Text &text, size_t &cur_pos, Value &value)
+    {
+        const char *data = text.data() + cur_pos;
+        size_t length = utf8_sequence_length(data, text.length() - cur_pos);
+        if (!length)
+            return false;
+
+        append_value(value, data, length);
+        cur_pos += length - 1;
+        return true;
+    }
+
+    template <typename Name, typename Values, typename Target, typename Stats>
+    static INIPLUS_GRAMMAR_CONSTEXPR bool store(const Name &section, const Name &key, const Values &values, Target &target, Stats &stats)
+    {
+        stats.begin_store();
+        bool result = target.entry(section, key, values);
+        stats.end_store(section, key, values);
+        return result;
+    }
+
+    static INIPLUS_GRAMMAR_CONSTEXPR CharClass get_char_class(char input)
+    {
+        switch (input)
+        {
+        case '\r':
+        case '\n':
+            return CHAR_CLASS__NEWLINE;
+
+        case ' ':
+        case '\t':
+            return CHAR_CLASS__SPACE;
+
+        case ';':
+            return CHAR_CLASS__SEMICOLON;
+
+        case '[':
+            return CHAR_CLASS__OPENBRACKET;
+
+        case ']':
+            return CHAR_CLASS__CLOSEBRACKET;
+
+        case '%':
+            return CHAR_CLASS__PERCENT;
+
+        case '=':
+            return CHAR_CLASS__EQUAL;
+
+        case '"':
+            return CHAR_CLASS__QUOTE;
+
+        case '\\':
+            return CHAR_CLASS__BACKSLASH;
+
+        case ',':
+            return CHAR_CLASS__COMMA;
+
+        case '-':
+        case '_':
+        case '.':
+            return CHAR_CLASS__MINUS;
+
+        default:
+            if (((input >= '0') && (input <= '9')) || ((input >= 'A') && (input <= 'F')) || ((input >= 'a') && (input <= 'f')))
+                return CHAR_CLASS__HEXDIGIT;
+            else if (((input >= 'G') && (input <= 'Z')) || ((input >= 'g') && (input <= 'z')))
+                return CHAR_CLASS__LETTERS;
+            else if ((input >= 0x20) || (input < 0x7f))
+                return CHAR_CLASS__VISIBLE;
+            else
+                return CHAR_CLASS__OTHER;
+        }
+    }
+
+    static INIPLUS_GRAMMAR_CONSTEXPR char char_to_hex(char input)
+    {
+        if ((input >= '0') && (input <= '9'))
+            return input - '0';
+        else if ((input >= 'A') && (input <= 'F'))
+            return input - 'A' + 0x0a;
+        else if ((input >= 'a') && (input <= 'f'))
+            return input - 'a' + 0x0a;
+        return '\0';
+    }
+};
+
+}
+
+#endif // INIPLUS_GRAMMAR__INCLUDED
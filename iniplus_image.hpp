@@ -0,0 +1,292 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+#ifndef INIPLUS_IMAGE__INCLUDED
+#define INIPLUS_IMAGE__INCLUDED
+
+
+#include "iniplus.hpp"
+
+#include <cstring>
+#include <string>
+
+#include <stdint.h>
+
+
+namespace iniplus {
+
+/*  Binary image of a Storage, usable in place (mmap, shared memory).
+ *
+ *  header | sections[] | keys[] | values[] | bytes
+ *
+ *  Sections and keys are sorted the same way the Storage keeps them, so lookups are binary searches.
+ *  Every part starts at a multiple of 8 bytes, all numbers are in host byte order.
+ */
+
+static const char IMAGE__MAGIC[8] = { 'I', 'N', 'I', 'P', 'L', 'U', 'S', 'B' };
+
+typedef enum ImageVersion {
+    IMAGE_VERSION__1 = 1,
+    IMAGE_VERSION__CURRENT = IMAGE_VERSION__1
+} ImageVersion;
+
+typedef enum ImageFlag {
+    IMAGE_FLAG__CASE_INSENSITIVE = 0x01 // the names are sorted and looked up ignoring the ASCII case
+} ImageFlag;
+
+/// identifies the text file the image was made of
+typedef struct ImageSource
+{
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t hash;
+} ImageSource;
+
+typedef struct ImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t size;     // of the whole image
+    uint64_t checksum; // of everything after the header
+    ImageSource source;
+    uint32_t section_count;
+    uint32_t key_count;
+    uint32_t value_count;
+    uint32_t reserved;
+    uint64_t sections_offset;
+    uint64_t keys_offset;
+    uint64_t values_offset;
+    uint64_t bytes_offset;
+} ImageHeader;
+
+typedef struct ImageSection
+{
+    uint64_t name_offset; // in bytes
+    uint32_t name_size;
+    uint32_t first_key;
+    uint32_t key_count;
+    uint32_t reserved;
+} ImageSection;
+
+typedef struct ImageKey
+{
+    uint64_t name_offset; // in bytes
+    uint32_t name_size;
+    uint32_t first_value;
+    uint32_t value_count;
+    uint32_t reserved;
+} ImageKey;
+
+typedef struct ImageValue
+{
+    uint64_t offset; // in bytes
+    uint64_t size;
+} ImageValue;
+
+static inline unsigned char fold_char(char c)
+{
+    unsigned char u = static_cast<unsigned char>(c);
+    return ((u >= 'A') && (u <= 'Z')) ? (u | 0x20) : u;
+}
+
+/// compares the same way std::string does, on the lower-cased ASCII letters if folding
+static inline int compare_names(const char *left, size_t left_size, const char *right, size_t right_size, bool fold)
+{
+    size_t m = (left_size < right_size) ? left_size : right_size;
+    if (!fold)
+    {
+        int result = m ? memcmp(left, right, m) : 0;
+        if (result)
+            return result;
+    }
+    else
+        for (size_t i = 0; i != m; ++i)
+            if (fold_char(left[i]) != fold_char(right[i]))
+                return (fold_char(left[i]) < fold_char(right[i])) ? -1 : 1;
+
+    if (left_size == right_size)
+        return 0;
+    return (left_size < right_size) ? -1 : 1;
+}
+
+/// orders the section and key names of a Storage, the folded form is never stored, so the names keep their spelling
+class NameLess
+{
+public:
+    NameLess(bool fold = false)
+        : m_fold(fold)
+    {}
+
+    bool operator () (const std::string &left, const std::string &right) const
+    {
+        if (!m_fold)
+            return left < right;
+        return compare_names(left.data(), left.length(), right.data(), right.length(), true) < 0;
+    }
+
+    bool equal(const std::string &left, const std::string &right) const
+    {
+        if (!m_fold)
+            return left == right;
+        return (left.length() == right.length()) && !compare_names(left.data(), left.length(), right.data(), right.length(), true);
+    }
+
+    bool fold() const
+    {
+        return m_fold;
+    }
+
+private:
+    bool m_fold;
+};
+
+/// FNV-1a over 64-bit words, the tail bytes go one by one
+uint64_t image_hash(const char *data, size_t size);
+
+/// reads the whole file, fills the source if asked
+bool read_file(const std::string &path, std::string &text, ImageSource *source = 0);
+
+/// fills the size and the mtime of the source without reading the file, the hash is 0
+bool stat_source(const std::string &path, ImageSource &source);
+
+/// the image was made of the file as stat_source() sees it now, judged by the size and the mtime alone
+static inline bool is_same_source(const ImageSource &image, const ImageSource &file)
+{
+    return (image.size == file.size) && (image.mtime_ns == file.mtime_ns);
+}
+
+/// parses the text straight into an image in the buffer without touching the heap, the buffer must be 8-byte aligned;
+/// sets required to the buffer size the text needs, also when failing because the buffer is smaller
+bool parse_image(const char *text, size_t length, char *buffer, size_t size, size_t &required, Storage::Callback *callback, unsigned options);
+
+/// orders the lookups by section and key the way the names are sorted, so the batches can share section lookups and walk the keys in order
+void sort_lookups(const Storage::Lookup *lookups, size_t count, size_t *order, const NameLess &less);
+
+/// fills the result of a missed lookup
+void set_default_result(const Storage::Lookup &lookup, Storage::LookupResult &result);
+
+/// read-only mapping of a whole file
+class ImageFile
+{
+public:
+    ImageFile();
+    ~ImageFile();
+
+    bool open(const std::string &path);
+    void close();
+
+    const char *data() const
+    {
+        return static_cast<const char *>(m_data);
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    ImageFile(const ImageFile &);
+    ImageFile& operator = (const ImageFile &);
+
+private:
+    void *m_data;
+    size_t m_size;
+};
+
+/// read-only access to an image, never copies it
+class ImageView
+{
+public:
+    ImageView();
+
+    /// checks the header, the checksum and that all offsets stay inside, the data must be 8-byte aligned;
+    /// without the checksum a damaged image may give wrong names or values, but still never reads outside the data
+    bool attach(const char *data, size_t size, bool checksum = true);
+    void detach();
+
+    bool is_attached() const
+    {
+        return m_header != 0;
+    }
+
+    const ImageHeader &header() const
+    {
+        return *m_header;
+    }
+
+    const ImageSection &section(uint32_t index) const
+    {
+        return m_sections[index];
+    }
+
+    const ImageKey &key(uint32_t index) const
+    {
+        return m_keys[index];
+    }
+
+    const ImageValue &value(uint32_t index) const
+    {
+        return m_values[index];
+    }
+
+    const char *bytes(uint64_t offset) const
+    {
+        return m_bytes + offset;
+    }
+
+    std::string section_name(uint32_t index) const
+    {
+        return std::string(bytes(m_sections[index].name_offset), m_sections[index].name_size);
+    }
+
+    std::string key_name(uint32_t index) const
+    {
+        return std::string(bytes(m_keys[index].name_offset), m_keys[index].name_size);
+    }
+
+    /// the order of the names
+    NameLess less() const
+    {
+        return NameLess(m_header && (m_header->flags & IMAGE_FLAG__CASE_INSENSITIVE));
+    }
+
+    bool find_section(const std::string &section, uint32_t &index) const;
+    bool find_key(const std::string &section, const std::string &key, uint32_t &index) const;
+    bool find_key(uint32_t section_index, const std::string &key, uint32_t &index) const;
+
+private:
+    const ImageHeader *m_header;
+    const ImageSection *m_sections;
+    const ImageKey *m_keys;
+    const ImageValue *m_values;
+    const char *m_bytes;
+};
+
+}
+
+#endif // INIPLUS_IMAGE__INCLUDED
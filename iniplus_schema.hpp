@@ -0,0 +1,436 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+#ifndef INIPLUS_SCHEMA__INCLUDED
+#define INIPLUS_SCHEMA__INCLUDED
+
+#if __cplusplus < 202002L
+#error "iniplus_schema.hpp needs C++20, the library itself does not"
+#endif
+
+
+#include "iniplus.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+
+namespace iniplus {
+
+/*  Binds INI entries to the members of a struct at compile time.
+ *
+ *  struct Server
+ *  {
+ *      std::string host = "localhost";
+ *      int port = 80;
+ *      std::vector<std::string> peers;
+ *  };
+ *
+ *  typedef iniplus::Schema<Server,
+ *      iniplus::Field<"server", "host", &Server::host>,
+ *      iniplus::Field<"server", "port", &Server::port, iniplus::FIELD_FLAG__REQUIRED>,
+ *      iniplus::Field<"server", "peers", &Server::peers>
+ *  > ServerSchema;
+ *
+ *  Server server;
+ *  iniplus::SchemaIssues issues;
+ *  ServerSchema::load("server.ini", server, &issues);
+ *
+ *  The entries are converted while parsing, no Storage is built. A member keeps its value if its entry is missing
+ *  or invalid, so the initializers of the struct are the defaults. Duplicate fields, fields of another struct and
+ *  member types without a FieldConverter do not compile.
+ */
+
+/// a string literal usable as a template argument
+template <size_t N>
+struct FixedString
+{
+    constexpr FixedString(const char (&string)[N])
+    {
+        std::copy_n(string, N, data);
+    }
+
+    constexpr std::string_view view() const
+    {
+        return std::string_view(data, N - 1);
+    }
+
+    char data[N];
+};
+
+typedef enum FieldFlag {
+    FIELD_FLAG__OPTIONAL = 0,
+    FIELD_FLAG__REQUIRED = 1  // reported as missing if the text does not have it
+} FieldFlag;
+
+template <FixedString Section, FixedString Key, auto Member, unsigned Flags = FIELD_FLAG__OPTIONAL>
+struct Field
+{
+    static constexpr std::string_view section = Section.view();
+    static constexpr std::string_view key = Key.view();
+    static constexpr auto member = Member;
+    static constexpr bool required = Flags & FIELD_FLAG__REQUIRED;
+
+    static_assert(!key.empty(), "a key name can not be empty");
+};
+
+typedef enum SchemaIssueType {
+    SCHEMA_ISSUE__MISSING = 0, // a required entry is not in the text
+    SCHEMA_ISSUE__INVALID,     // the value did not convert, the member keeps its value
+    SCHEMA_ISSUE__UNKNOWN      // the schema does not know the entry, a typo in the text maybe
+} SchemaIssueType;
+
+typedef struct SchemaIssue
+{
+    SchemaIssueType type;
+    std::string section;
+    std::string key;
+} SchemaIssue;
+
+typedef std::vector<SchemaIssue> SchemaIssues;
+
+
+/// converts the values of an entry, specialize it for own member types
+template <typename T, typename Enable = void>
+struct FieldConverter;
+
+template <>
+struct FieldConverter<Storage::Values>
+{
+    static bool convert(const Storage::Values &values, Storage::Values &result)
+    {
+        result = values;
+        return true;
+    }
+};
+
+/// the scalars take exactly one value
+template <typename T>
+struct ScalarConverter
+{
+    static bool convert(const Storage::Values &values, T &result)
+    {
+        return (values.size() == 1) && FieldConverter<T>::convert_value(values.front(), result);
+    }
+};
+
+template <>
+struct FieldConverter<std::string> : ScalarConverter<std::string>
+{
+    static bool convert_value(const Storage::Value &value, std::string &result)
+    {
+        result.assign(value.begin(), value.end());
+        return true;
+    }
+};
+
+template <>
+struct FieldConverter<bool> : ScalarConverter<bool>
+{
+    static bool convert_value(const Storage::Value &value, bool &result)
+    {
+        static const char *const names[] = { "0", "1", "false", "true", "no", "yes", "off", "on" };
+
+        std::string_view text(value.data(), value.size());
+        for (size_t i = 0; i != sizeof(names) / sizeof(names[0]); ++i)
+        {
+            std::string_view name(names[i]);
+            if ((text.size() == name.size()) && std::equal(text.begin(), text.end(), name.begin(),
+                    [](char a, char b) { return ((a >= 'A') && (a <= 'Z') ? a - 'A' + 'a' : a) == b; }))
+            {
+                result = i % 2;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+template <typename T>
+struct FieldConverter<T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value>::type> : ScalarConverter<T>
+{
+    static bool convert_value(const Storage::Value &value, T &result)
+    {
+        const char *first = value.data();
+        const char *last = first + value.size();
+
+        T converted;
+        std::from_chars_result parsed = std::from_chars(first, last, converted);
+        if ((parsed.ec != std::errc()) || (parsed.ptr != last) || (first == last))
+            return false;
+
+        result = converted;
+        return true;
+    }
+};
+
+/// a comma separated list, every item converts like a scalar
+template <typename T>
+struct FieldConverter<std::vector<T> >
+{
+    static bool convert(const Storage::Values &values, std::vector<T> &result)
+    {
+        std::vector<T> converted(values.size());
+        for (size_t i = 0; i != values.size(); ++i)
+            if (!FieldConverter<T>::convert_value(values[i], converted[i]))
+                return false;
+
+        result.swap(converted);
+        return true;
+    }
+};
+
+
+namespace schema_detail {
+
+template <typename M>
+struct MemberTraits;
+
+template <typename C, typename V>
+struct MemberTraits<V C::*>
+{
+    typedef C Class;
+    typedef V Value;
+};
+
+template <typename M>
+struct MemberTraits<const M> : MemberTraits<M>
+{};
+
+constexpr uint64_t hash(std::string_view section, std::string_view key, uint64_t seed)
+{
+    uint64_t result = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+    for (char ch : section)
+        result = (result ^ static_cast<unsigned char>(ch)) * 1099511628211ULL;
+    result = (result ^ 0xff) * 1099511628211ULL;
+    for (char ch : key)
+        result = (result ^ static_cast<unsigned char>(ch)) * 1099511628211ULL;
+    return result ^ (result >> 32);
+}
+
+template <size_t Count>
+constexpr bool has_duplicates(const std::array<std::string_view, Count> &sections, const std::array<std::string_view, Count> &keys)
+{
+    for (size_t i = 0; i != Count; ++i)
+        for (size_t j = i + 1; j != Count; ++j)
+            if ((sections[i] == sections[j]) && (keys[i] == keys[j]))
+                return true;
+    return false;
+}
+
+constexpr size_t table_size(size_t count)
+{
+    size_t result = 1;
+    while (result < 2 * count)
+        result *= 2;
+    return result;
+}
+
+/// hash and displace: the names go to buckets by their seed 0 hash, then every bucket, the fullest first,
+/// gets the seed that puts its names into free slots
+template <size_t Count, size_t Size>
+struct PerfectHash
+{
+    constexpr PerfectHash(const std::array<std::string_view, Count> &sections, const std::array<std::string_view, Count> &keys)
+        : seeds()
+        , slots()
+        , found(false)
+    {
+        if (has_duplicates(sections, keys))
+            return;
+
+        std::array<size_t, Count> buckets {};
+        std::array<size_t, Size> sizes {};
+        for (size_t i = 0; i != Count; ++i)
+        {
+            buckets[i] = hash(sections[i], keys[i], 0) & (Size - 1);
+            ++sizes[buckets[i]];
+        }
+
+        for (size_t size = Count; size; --size)
+            for (size_t bucket = 0; bucket != Size; ++bucket)
+                if ((sizes[bucket] == size) && !place(sections, keys, buckets, bucket))
+                    return;
+
+        found = true;
+    }
+
+    constexpr size_t find(std::string_view section, std::string_view key) const
+    {
+        uint32_t seed = seeds[hash(section, key, 0) & (Size - 1)];
+        return slots[hash(section, key, seed) & (Size - 1)];
+    }
+
+    std::array<uint32_t, Size> seeds;
+    std::array<size_t, Size> slots; // the name index + 1, 0 for the free ones
+    bool found;
+
+private:
+    constexpr bool place(const std::array<std::string_view, Count> &sections, const std::array<std::string_view, Count> &keys,
+                         const std::array<size_t, Count> &buckets, size_t bucket)
+    {
+        for (uint32_t seed = 1; seed != 65536; ++seed)
+        {
+            std::array<size_t, Size> taken = slots;
+            bool placed = true;
+            for (size_t i = 0; placed && (i != Count); ++i)
+            {
+                if (buckets[i] != bucket)
+                    continue;
+
+                size_t slot = hash(sections[i], keys[i], seed) & (Size - 1);
+                placed = !taken[slot];
+                taken[slot] = i + 1;
+            }
+
+            if (placed)
+            {
+                seeds[bucket] = seed;
+                slots = taken;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+}
+
+
+template <typename T, typename... Fields>
+class Schema
+{
+public:
+    typedef T Object;
+
+    /// parses the text into the object, returns false if the text is malformed, a required entry is missing
+    /// or a value is invalid; the issues (if given) get all of those and the unknown entries too
+    static bool parse(const std::string &text, T &object, SchemaIssues *issues = 0, Storage::Callback *callback = 0)
+    {
+        Loader loader(object, issues);
+        bool result = Storage::scan(text, loader, callback);
+        return loader.finish() && result;
+    }
+
+    static bool load(const std::string &path, T &object, SchemaIssues *issues = 0, Storage::Callback *callback = 0)
+    {
+        Loader loader(object, issues);
+        bool result = Storage::scan_file(path, loader, callback);
+        return loader.finish() && result;
+    }
+
+private:
+    static constexpr size_t COUNT = sizeof...(Fields);
+    static constexpr size_t SIZE = schema_detail::table_size(COUNT);
+
+    static constexpr std::array<std::string_view, COUNT> sections = {{ Fields::section... }};
+    static constexpr std::array<std::string_view, COUNT> keys = {{ Fields::key... }};
+    static constexpr std::array<bool, COUNT> required = {{ Fields::required... }};
+
+    static_assert(COUNT > 0, "a schema needs fields");
+    static_assert((std::is_same<typename schema_detail::MemberTraits<decltype(Fields::member)>::Class, T>::value && ...),
+                  "a field binds a member of another struct");
+    static_assert(!schema_detail::has_duplicates(sections, keys), "a section/key pair is bound twice");
+
+    static constexpr schema_detail::PerfectHash<COUNT, SIZE> names = schema_detail::PerfectHash<COUNT, SIZE>(sections, keys);
+    static_assert(names.found || schema_detail::has_duplicates(sections, keys), "no perfect hash for the names");
+
+    typedef bool (*Setter)(T &object, const Storage::Values &values);
+
+    template <typename F>
+    static bool set(T &object, const Storage::Values &values)
+    {
+        typedef typename schema_detail::MemberTraits<decltype(F::member)>::Value Value;
+        return FieldConverter<Value>::convert(values, object.*F::member);
+    }
+
+    static constexpr std::array<Setter, COUNT> setters = {{ &set<Fields>... }};
+
+    class Loader : public Storage::Visitor
+    {
+    public:
+        Loader(T &object, SchemaIssues *issues)
+            : Visitor()
+            , m_object(object)
+            , m_issues(issues)
+            , m_seen()
+            , m_success(true)
+        {}
+
+        virtual bool entry(const std::string &section, const std::string &key, const Storage::Values &values)
+        {
+            size_t index = names.find(section, key);
+            if (!index || (sections[index - 1] != section) || (keys[index - 1] != key))
+            {
+                report(SCHEMA_ISSUE__UNKNOWN, section, key);
+                return true;
+            }
+
+            --index;
+            m_seen[index] = true;
+            if (!setters[index](m_object, values))
+            {
+                report(SCHEMA_ISSUE__INVALID, section, key);
+                m_success = false;
+            }
+            return true;
+        }
+
+        bool finish()
+        {
+            for (size_t i = 0; i != COUNT; ++i)
+                if (required[i] && !m_seen[i])
+                {
+                    report(SCHEMA_ISSUE__MISSING, std::string(sections[i]), std::string(keys[i]));
+                    m_success = false;
+                }
+            return m_success;
+        }
+
+    private:
+        void report(SchemaIssueType type, const std::string &section, const std::string &key)
+        {
+            if (!m_issues)
+                return;
+
+            SchemaIssue issue = { type, section, key };
+            m_issues->push_back(issue);
+        }
+
+    private:
+        T &m_object;
+        SchemaIssues *m_issues;
+        std::array<bool, COUNT> m_seen;
+        bool m_success;
+    };
+};
+
+}
+
+#endif // INIPLUS_SCHEMA__INCLUDED
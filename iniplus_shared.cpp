@@ -0,0 +1,358 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+
+#include "iniplus_shared.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace iniplus {
+
+static const char SHARED__MAGIC[8] = { 'I', 'N', 'I', 'P', 'L', 'U', 'S', 'S' };
+
+typedef struct SharedControl
+{
+    char magic[8];
+    std::atomic<uint64_t> generation;
+} SharedControl;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the generation counter must be lock-free to live in shared memory");
+
+/// the generation of a control segment its publisher unlinked, the readers open the name again
+static const uint64_t SHARED__RETIRED = ~static_cast<uint64_t>(0);
+
+static std::string segment_name(const std::string &name, uint64_t generation)
+{
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), ".%llu", static_cast<unsigned long long>(generation));
+    return name + suffix;
+}
+
+/// a mapped shared memory object
+class SharedSegment
+{
+public:
+    SharedSegment()
+        : m_data(0)
+        , m_size(0)
+    {}
+
+    ~SharedSegment()
+    {
+        close();
+    }
+
+    bool create(const std::string &name, size_t size, bool exclusive)
+    {
+        close();
+
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | (exclusive ? O_EXCL : 0), 0644);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        bool result = !::fstat(fd, &st) && ((static_cast<size_t>(st.st_size) >= size) || !::ftruncate(fd, size));
+        result = result && map(fd, std::max(size, static_cast<size_t>(st.st_size)), PROT_READ | PROT_WRITE);
+        ::close(fd);
+
+        if (!result && exclusive)
+            ::shm_unlink(name.c_str());
+        return result;
+    }
+
+    bool open(const std::string &name)
+    {
+        close();
+
+        int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        bool result = !::fstat(fd, &st) && (st.st_size > 0) && map(fd, st.st_size, PROT_READ);
+        ::close(fd);
+
+        return result;
+    }
+
+    void close()
+    {
+        if (m_data)
+            ::munmap(m_data, m_size);
+        m_data = 0;
+        m_size = 0;
+    }
+
+    void swap(SharedSegment &other)
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+    }
+
+    char *data() const
+    {
+        return static_cast<char *>(m_data);
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    bool map(int fd, size_t size, int protection)
+    {
+        void *data = ::mmap(0, size, protection, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            return false;
+
+        m_data = data;
+        m_size = size;
+        return true;
+    }
+
+private:
+    SharedSegment(const SharedSegment &);
+    SharedSegment& operator = (const SharedSegment &);
+
+private:
+    void *m_data;
+    size_t m_size;
+};
+
+
+class SharedPublisherImpl
+{
+public:
+    SharedPublisherImpl(const std::string &name)
+        : m_name(name)
+        , m_generation(0)
+    {}
+
+    ~SharedPublisherImpl()
+    {}
+
+    bool publish(const Storage &storage)
+    {
+        if (!m_control.data())
+        {
+            if (!m_control.create(m_name, sizeof(SharedControl), false))
+                return false;
+
+            // a restarted publisher continues the numbering, so the names never repeat
+            SharedControl *control = this->control();
+            memcpy(control->magic, SHARED__MAGIC, sizeof(SHARED__MAGIC));
+            m_generation = control->generation.load(std::memory_order_acquire);
+
+            // opened while another publisher was unlinking it
+            if (m_generation == SHARED__RETIRED)
+            {
+                m_control.close();
+                m_generation = 0;
+                return false;
+            }
+        }
+
+        std::string image = storage.generate_binary();
+
+        uint64_t generation = m_generation + 1;
+        std::string name = segment_name(m_name, generation);
+        SharedSegment segment;
+        if (!segment.create(name, image.size(), true))
+        {
+            // left by a publisher that stopped before publishing it, so no reader has it
+            if ((errno != EEXIST) || ::shm_unlink(name.c_str()) || !segment.create(name, image.size(), true))
+                return false;
+        }
+        memcpy(segment.data(), image.data(), image.size());
+        segment.close();
+
+        control()->generation.store(generation, std::memory_order_release);
+
+        if (m_generation)
+            ::shm_unlink(segment_name(m_name, m_generation).c_str());
+        m_generation = generation;
+
+        return true;
+    }
+
+    uint64_t generation() const
+    {
+        return m_generation;
+    }
+
+    void unlink()
+    {
+        if (m_generation)
+            ::shm_unlink(segment_name(m_name, m_generation).c_str());
+        if (m_control.data())
+            control()->generation.store(SHARED__RETIRED, std::memory_order_release);
+        ::shm_unlink(m_name.c_str());
+        m_control.close();
+        m_generation = 0;
+    }
+
+private:
+    SharedControl *control() const
+    {
+        return reinterpret_cast<SharedControl *>(m_control.data());
+    }
+
+private:
+    std::string m_name;
+    SharedSegment m_control;
+    uint64_t m_generation;
+};
+
+
+class SharedReaderImpl
+{
+public:
+    SharedReaderImpl(const std::string &name)
+        : m_name(name)
+        , m_generation(0)
+        , m_replaced(false)
+    {}
+
+    ~SharedReaderImpl()
+    {}
+
+    bool refresh()
+    {
+        if (!m_control.data() && !open_control())
+            return m_generation != 0;
+
+        // the publisher may unlink a segment between reading its generation and opening it, then there is a newer one
+        for (int attempt = 0; attempt != 8; ++attempt)
+        {
+            const SharedControl *control = reinterpret_cast<const SharedControl *>(m_control.data());
+            if (memcmp(control->magic, SHARED__MAGIC, sizeof(SHARED__MAGIC)))
+                break;
+
+            uint64_t generation = control->generation.load(std::memory_order_acquire);
+            if (generation == SHARED__RETIRED)
+            {
+                // the publisher unlinked it, a new one starts over under the same name
+                if (!open_control())
+                    break;
+                continue;
+            }
+            if (!generation || ((generation == m_generation) && !m_replaced))
+                break;
+
+            SharedSegment segment;
+            if (!segment.open(segment_name(m_name, generation)))
+                continue;
+
+            if (!m_snapshot.attach(segment.data(), segment.size()))
+            {
+                // a damaged publication, stay with the previous one
+                if (m_generation)
+                    m_snapshot.attach(m_segment.data(), m_segment.size());
+                break;
+            }
+
+            m_segment.swap(segment);
+            m_generation = generation;
+            m_replaced = false;
+            break;
+        }
+
+        return m_generation != 0;
+    }
+
+    uint64_t generation() const
+    {
+        return m_generation;
+    }
+
+    const Snapshot &snapshot() const
+    {
+        return m_snapshot;
+    }
+
+private:
+    bool open_control()
+    {
+        // the numbering of another control segment has nothing to do with the mapped generation
+        m_replaced = (m_generation != 0);
+        if (m_control.open(m_name) && (m_control.size() >= sizeof(SharedControl)))
+            return true;
+
+        m_control.close();
+        return false;
+    }
+
+private:
+    std::string m_name;
+    SharedSegment m_control;
+    SharedSegment m_segment;
+    Snapshot m_snapshot;
+    uint64_t m_generation;
+    bool m_replaced;  // the mapped generation is of a control segment unlinked since
+};
+
+
+SharedPublisher::SharedPublisher(const std::string &name) :
+    impl(new SharedPublisherImpl(name))
+{
+}
+
+SharedPublisher::~SharedPublisher()
+{
+    delete impl;
+}
+
+bool                             SharedPublisher::publish  (const Storage &storage)                                                                                               { return impl->publish  (storage); }
+uint64_t                         SharedPublisher::generation()                                                                                                              const { return impl->generation(); }
+void                             SharedPublisher::unlink   ()                                                                                                                     {        impl->unlink   (); }
+
+
+SharedReader::SharedReader(const std::string &name) :
+    impl(new SharedReaderImpl(name))
+{
+}
+
+SharedReader::~SharedReader()
+{
+    delete impl;
+}
+
+bool                             SharedReader::refresh     ()                                                                                                                     { return impl->refresh     (); }
+uint64_t                         SharedReader::generation  ()                                                                                                               const { return impl->generation  (); }
+const Snapshot&                  SharedReader::snapshot    ()                                                                                                               const { return impl->snapshot    (); }
+
+}
@@ -0,0 +1,99 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+#ifndef INIPLUS_SHARED__INCLUDED
+#define INIPLUS_SHARED__INCLUDED
+
+
+#include "iniplus_snapshot.hpp"
+
+#include <stdint.h>
+
+
+namespace iniplus {
+
+/*  A Storage shared between processes through POSIX shared memory.
+ *
+ *  Every publication goes into its own read-only segment "<name>.<generation>" holding the binary image,
+ *  and the control segment "<name>" holds the generation of the latest one.
+ *  The previous segment is unlinked after a publication, readers that still map it keep using it until they refresh.
+ */
+
+class SharedPublisherImpl;
+class SharedReaderImpl;
+
+class SharedPublisher
+{
+public:
+    /// name is a shared memory object name, like "/myconfig"
+    SharedPublisher(const std::string &name);
+    ~SharedPublisher();
+
+    /// returns false if the segments could not be created, the readers keep the previous publication then
+    bool publish(const Storage &storage);
+
+    /// of the latest publication, 0 if nothing was published
+    uint64_t generation() const;
+
+    /// removes the segments, mapped ones stay valid for the readers; the readers switch to a later publisher
+    /// of the same name on a refresh() after it published
+    void unlink();
+
+private:
+    SharedPublisher(const SharedPublisher &);
+    SharedPublisher& operator = (const SharedPublisher &);
+
+private:
+    SharedPublisherImpl *impl;
+};
+
+class SharedReader
+{
+public:
+    SharedReader(const std::string &name);
+    ~SharedReader();
+
+    /// switches to the latest publication if there is a new one, lock-free,
+    /// returns false if nothing is published yet
+    bool refresh();
+
+    /// of the mapped publication, 0 if none
+    uint64_t generation() const;
+
+    /// the mapped publication, stays the same until the next refresh()
+    const Snapshot &snapshot() const;
+
+private:
+    SharedReader(const SharedReader &);
+    SharedReader& operator = (const SharedReader &);
+
+private:
+    SharedReaderImpl *impl;
+};
+
+}
+
+#endif // INIPLUS_SHARED__INCLUDED
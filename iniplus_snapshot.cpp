@@ -0,0 +1,542 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+
+#include "iniplus_snapshot.hpp"
+#include "iniplus_image.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace iniplus {
+
+uint64_t image_hash(const char *data, size_t size)
+{
+    uint64_t result = 0xcbf29ce484222325ULL;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        result = (result ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; ++i)
+        result = (result ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+
+    return result;
+}
+
+
+class LookupLess
+{
+public:
+    LookupLess(const Storage::Lookup *lookups, const NameLess &less)
+        : m_lookups(lookups)
+        , m_less(less)
+    {}
+
+    bool operator () (size_t left, size_t right) const
+    {
+        const std::string &left_section = *m_lookups[left].section;
+        const std::string &right_section = *m_lookups[right].section;
+        int result = compare_names(left_section.data(), left_section.length(), right_section.data(), right_section.length(), m_less.fold());
+        if (result)
+            return result < 0;
+        return m_less(*m_lookups[left].key, *m_lookups[right].key);
+    }
+
+private:
+    const Storage::Lookup *m_lookups;
+    NameLess m_less;
+};
+
+void sort_lookups(const Storage::Lookup *lookups, size_t count, size_t *order, const NameLess &less)
+{
+    for (size_t i = 0; i != count; ++i)
+        order[i] = i;
+
+    std::sort(order, order + count, LookupLess(lookups, less));
+}
+
+void set_default_result(const Storage::Lookup &lookup, Storage::LookupResult &result)
+{
+    result.found = false;
+    result.values = lookup.default_values;
+    result.count = 0;
+    result.data = 0;
+    result.size = 0;
+
+    if (lookup.default_values)
+    {
+        result.count = lookup.default_values->size();
+        if (result.count && !lookup.default_values->front().empty())
+        {
+            result.data = &lookup.default_values->front()[0];
+            result.size = lookup.default_values->front().size();
+        }
+    }
+}
+
+
+static bool fits(uint64_t offset, uint64_t size, uint64_t limit)
+{
+    return (offset <= limit) && (size <= limit - offset);
+}
+
+ImageView::ImageView()
+    : m_header(0)
+    , m_sections(0)
+    , m_keys(0)
+    , m_values(0)
+    , m_bytes(0)
+{
+}
+
+bool ImageView::attach(const char *data, size_t size, bool checksum)
+{
+    detach();
+
+    if (reinterpret_cast<uintptr_t>(data) % 8)
+        return false;
+    if (size < sizeof(ImageHeader))
+        return false;
+
+    const ImageHeader *header = reinterpret_cast<const ImageHeader *>(data);
+    if (memcmp(header->magic, IMAGE__MAGIC, sizeof(IMAGE__MAGIC)) || (header->version != IMAGE_VERSION__CURRENT))
+        return false;
+    if ((header->size < sizeof(ImageHeader)) || (header->size > size))
+        return false;
+
+    uint64_t limit = header->size;
+    if ((header->sections_offset % 8) || (header->keys_offset % 8) || (header->values_offset % 8) || (header->bytes_offset % 8))
+        return false;
+    if (!fits(header->sections_offset, static_cast<uint64_t>(header->section_count) * sizeof(ImageSection), limit) ||
+        !fits(header->keys_offset, static_cast<uint64_t>(header->key_count) * sizeof(ImageKey), limit) ||
+        !fits(header->values_offset, static_cast<uint64_t>(header->value_count) * sizeof(ImageValue), limit) ||
+        !fits(header->bytes_offset, 0, limit))
+        return false;
+
+    if (checksum && (header->checksum != image_hash(data + sizeof(ImageHeader), header->size - sizeof(ImageHeader))))
+        return false;
+
+    const ImageSection *sections = reinterpret_cast<const ImageSection *>(data + header->sections_offset);
+    const ImageKey *keys = reinterpret_cast<const ImageKey *>(data + header->keys_offset);
+    const ImageValue *values = reinterpret_cast<const ImageValue *>(data + header->values_offset);
+    uint64_t bytes_size = limit - header->bytes_offset;
+
+    for (uint32_t i = 0; i != header->section_count; ++i)
+        if (!fits(sections[i].name_offset, sections[i].name_size, bytes_size) || !fits(sections[i].first_key, sections[i].key_count, header->key_count))
+            return false;
+    for (uint32_t i = 0; i != header->key_count; ++i)
+        if (!fits(keys[i].name_offset, keys[i].name_size, bytes_size) || !fits(keys[i].first_value, keys[i].value_count, header->value_count))
+            return false;
+    for (uint32_t i = 0; i != header->value_count; ++i)
+        if (!fits(values[i].offset, values[i].size, bytes_size))
+            return false;
+
+    m_header = header;
+    m_sections = sections;
+    m_keys = keys;
+    m_values = values;
+    m_bytes = data + header->bytes_offset;
+    return true;
+}
+
+void ImageView::detach()
+{
+    m_header = 0;
+    m_sections = 0;
+    m_keys = 0;
+    m_values = 0;
+    m_bytes = 0;
+}
+
+bool ImageView::find_section(const std::string &section, uint32_t &index) const
+{
+    if (!m_header)
+        return false;
+
+    uint32_t low = 0;
+    uint32_t high = m_header->section_count;
+    bool fold = (m_header->flags & IMAGE_FLAG__CASE_INSENSITIVE) != 0;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        int result = compare_names(bytes(m_sections[middle].name_offset), m_sections[middle].name_size, section.data(), section.length(), fold);
+        if (!result)
+        {
+            index = middle;
+            return true;
+        }
+        if (result < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return false;
+}
+
+bool ImageView::find_key(const std::string &section, const std::string &key, uint32_t &index) const
+{
+    uint32_t section_index;
+    if (!find_section(section, section_index))
+        return false;
+
+    return find_key(section_index, key, index);
+}
+
+bool ImageView::find_key(uint32_t section_index, const std::string &key, uint32_t &index) const
+{
+    uint32_t low = m_sections[section_index].first_key;
+    uint32_t high = low + m_sections[section_index].key_count;
+    bool fold = (m_header->flags & IMAGE_FLAG__CASE_INSENSITIVE) != 0;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        int result = compare_names(bytes(m_keys[middle].name_offset), m_keys[middle].name_size, key.data(), key.length(), fold);
+        if (!result)
+        {
+            index = middle;
+            return true;
+        }
+        if (result < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return false;
+}
+
+
+ImageFile::ImageFile()
+    : m_data(0)
+    , m_size(0)
+{
+}
+
+ImageFile::~ImageFile()
+{
+    close();
+}
+
+bool ImageFile::open(const std::string &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (::fstat(fd, &st) || (st.st_size <= 0))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *data = ::mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    m_data = data;
+    m_size = st.st_size;
+    return true;
+}
+
+void ImageFile::close()
+{
+    if (m_data)
+        ::munmap(m_data, m_size);
+    m_data = 0;
+    m_size = 0;
+}
+
+
+class SnapshotImpl
+{
+public:
+    SnapshotImpl()
+    {}
+
+    ~SnapshotImpl()
+    {}
+
+    bool attach(const char *data, size_t size)
+    {
+        close();
+        return m_view.attach(data, size);
+    }
+
+    bool parse(const char *text, size_t length, char *buffer, size_t size, size_t &required, Storage::Callback *callback, unsigned options)
+    {
+        close();
+        if (!parse_image(text, length, buffer, size, required, callback, options))
+            return false;
+
+        // just written, nothing to verify
+        return m_view.attach(buffer, size, false);
+    }
+
+    bool open(const std::string &path, bool checksum = true)
+    {
+        close();
+        if (!m_file.open(path))
+            return false;
+        if (m_view.attach(m_file.data(), m_file.size(), checksum))
+            return true;
+        m_file.close();
+        return false;
+    }
+
+    /// a snapshot matching the file by size and mtime is used without reading either of them through
+    bool open_cached(const std::string &path, const std::string &snapshot_path, Storage::Callback *callback)
+    {
+        ImageSource source;
+        if (stat_source(path, source) && open(snapshot_path, false) && is_same_source(m_view.header().source, source))
+            return true;
+
+        Storage storage;
+        if (!storage.load_cached(path, snapshot_path, callback))
+            return false;
+
+        return open(snapshot_path);
+    }
+
+    void close()
+    {
+        m_view.detach();
+        m_file.close();
+    }
+
+    bool is_open() const
+    {
+        return m_view.is_attached();
+    }
+
+    Storage::Strings get_all_sections() const
+    {
+        Storage::Strings result;
+
+        if (m_view.is_attached())
+            for (uint32_t i = 0; i != m_view.header().section_count; ++i)
+                result.insert(result.end(), m_view.section_name(i));
+
+        return result;
+    }
+
+    bool is_section_exist(const std::string &section) const
+    {
+        uint32_t index;
+        return m_view.find_section(section, index);
+    }
+
+    Storage::Strings get_all_keys(const std::string &section) const
+    {
+        Storage::Strings result;
+
+        uint32_t index;
+        if (m_view.find_section(section, index))
+        {
+            const ImageSection &image_section = m_view.section(index);
+            for (uint32_t i = 0; i != image_section.key_count; ++i)
+                result.insert(result.end(), m_view.key_name(image_section.first_key + i));
+        }
+
+        return result;
+    }
+
+    bool is_key_exist(const std::string &section, const std::string &key) const
+    {
+        uint32_t index;
+        return m_view.find_key(section, key, index);
+    }
+
+    bool is_list(const std::string &section, const std::string &key) const
+    {
+        uint32_t index;
+        if (m_view.find_key(section, key, index))
+            return m_view.key(index).value_count > 1;
+
+        return false;
+    }
+
+    bool contains_binary(const std::string &section, const std::string &key) const
+    {
+        std::pair<bool, Storage::Values> result = get_values(section, key, Storage::Values());
+
+        return result.first && result.second.contains_binary();
+    }
+
+    bool contains_binary_utf8(const std::string &section, const std::string &key) const
+    {
+        std::pair<bool, Storage::Values> result = get_values(section, key, Storage::Values());
+
+        return result.first && result.second.contains_binary_utf8();
+    }
+
+    std::pair<bool, std::string> get_string(const std::string &section, const std::string &key, const std::string &default_value) const
+    {
+        const char *data;
+        size_t size;
+        if (get_raw(section, key, 0, data, size))
+            return std::make_pair(true, std::string(data, size));
+
+        return std::make_pair(false, default_value);
+    }
+
+    std::pair<bool, Storage::Values> get_values(const std::string &section, const std::string &key, const Storage::Values &default_values) const
+    {
+        uint32_t index;
+        if (m_view.find_key(section, key, index))
+        {
+            const ImageKey &image_key = m_view.key(index);
+
+            Storage::Values result;
+            result.resize(image_key.value_count);
+            for (uint32_t i = 0; i != image_key.value_count; ++i)
+            {
+                const ImageValue &image_value = m_view.value(image_key.first_value + i);
+                const char *data = m_view.bytes(image_value.offset);
+                result[i].assign(data, data + image_value.size);
+            }
+
+            return std::make_pair(true, result);
+        }
+
+        return std::make_pair(false, default_values);
+    }
+
+    void get_batch(const Storage::Lookup *lookups, size_t count, Storage::LookupResult *results) const
+    {
+        size_t stack_order[64];
+        std::vector<size_t> heap_order;
+        size_t *order = stack_order;
+        if (count > 64)
+        {
+            heap_order.resize(count);
+            order = &heap_order[0];
+        }
+        NameLess less = m_view.less();
+        sort_lookups(lookups, count, order, less);
+
+        const std::string *section = 0;
+        bool section_found = false;
+        uint32_t section_index = 0;
+        for (size_t i = 0; i != count; ++i)
+        {
+            const Storage::Lookup &lookup = lookups[order[i]];
+            Storage::LookupResult &result = results[order[i]];
+
+            if (!section || !less.equal(*section, *lookup.section))
+            {
+                section = lookup.section;
+                section_found = m_view.find_section(*section, section_index);
+            }
+
+            uint32_t key_index;
+            if (!section_found || !m_view.find_key(section_index, *lookup.key, key_index))
+            {
+                set_default_result(lookup, result);
+                continue;
+            }
+
+            const ImageKey &image_key = m_view.key(key_index);
+            result.found = true;
+            result.values = 0;
+            result.count = image_key.value_count;
+            result.data = 0;
+            result.size = 0;
+            if (image_key.value_count)
+            {
+                const ImageValue &image_value = m_view.value(image_key.first_value);
+                result.data = m_view.bytes(image_value.offset);
+                result.size = image_value.size;
+            }
+        }
+    }
+
+    bool get_raw(const std::string &section, const std::string &key, size_t index, const char *&data, size_t &size) const
+    {
+        uint32_t key_index;
+        if (!m_view.find_key(section, key, key_index))
+            return false;
+
+        const ImageKey &image_key = m_view.key(key_index);
+        if (index >= image_key.value_count)
+            return false;
+
+        const ImageValue &image_value = m_view.value(image_key.first_value + index);
+        data = m_view.bytes(image_value.offset);
+        size = image_value.size;
+        return true;
+    }
+
+private:
+    ImageFile m_file;
+    ImageView m_view;
+};
+
+
+Snapshot::Snapshot() :
+    impl(new SnapshotImpl())
+{
+}
+
+Snapshot::~Snapshot()
+{
+    delete impl;
+}
+
+bool                             Snapshot::attach          (const char *data, size_t size)                                                                                        { return impl->attach          (data, size); }
+bool                             Snapshot::parse           (const char *text, size_t length, char *buffer, size_t size, size_t &required, Storage::Callback *callback, unsigned options) { return impl->parse           (text, length, buffer, size, required, callback, options); }
+bool                             Snapshot::open            (const std::string &path)                                                                                              { return impl->open            (path); }
+bool                             Snapshot::open_cached     (const std::string &path, const std::string &snapshot_path, Storage::Callback *callback)                               { return impl->open_cached     (path, snapshot_path, callback); }
+void                             Snapshot::close           ()                                                                                                                     {        impl->close           (); }
+bool                             Snapshot::is_open         ()                                                                                                               const { return impl->is_open         (); }
+Storage::Strings                 Snapshot::get_all_sections()                                                                                                               const { return impl->get_all_sections(); }
+bool                             Snapshot::is_section_exist(const std::string &section)                                                                                     const { return impl->is_section_exist(section); }
+Storage::Strings                 Snapshot::get_all_keys    (const std::string &section)                                                                                     const { return impl->get_all_keys    (section); }
+bool                             Snapshot::is_key_exist    (const std::string &section, const std::string &key)                                                             const { return impl->is_key_exist    (section, key); }
+bool                             Snapshot::is_list         (const std::string &section, const std::string &key)                                                             const { return impl->is_list         (section, key); }
+bool                             Snapshot::contains_binary (const std::string &section, const std::string &key)                                                             const { return impl->contains_binary (section, key); }
+bool                             Snapshot::contains_binary_utf8(const std::string &section, const std::string &key)                                                         const { return impl->contains_binary_utf8(section, key); }
+std::pair<bool, std::string>     Snapshot::get_string      (const std::string &section, const std::string &key, const std::string &default_value)                           const { return impl->get_string      (section, key, default_value); }
+std::pair<bool, Storage::Values> Snapshot::get_values      (const std::string &section, const std::string &key, const Storage::Values &default_values)                      const { return impl->get_values      (section, key, default_values); }
+void                             Snapshot::get_batch       (const Storage::Lookup *lookups, size_t count, Storage::LookupResult *results)                                   const {        impl->get_batch       (lookups, count, results); }
+bool                             Snapshot::get_raw         (const std::string &section, const std::string &key, size_t index, const char *&data, size_t &size)              const { return impl->get_raw         (section, key, index, data, size); }
+
+}
@@ -0,0 +1,95 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+#ifndef INIPLUS_SNAPSHOT__INCLUDED
+#define INIPLUS_SNAPSHOT__INCLUDED
+
+
+#include "iniplus.hpp"
+
+
+namespace iniplus {
+
+class SnapshotImpl;
+
+/// read-only view of a binary image made by Storage::generate_binary(), used in place without a deserialization pass
+class Snapshot
+{
+public:
+    Snapshot();
+    ~Snapshot();
+
+    /// uses the image in place, the data must stay valid while attached and be 8-byte aligned
+    bool attach(const char *data, size_t size);
+
+    /// parses the text into an image in the buffer and uses it in place, never allocating, for the contexts where
+    /// the heap is off limits; the buffer must be 8-byte aligned, required is set to the size the text needs,
+    /// so a false return with required > size means the buffer was too small; options as of Storage
+    bool parse(const char *text, size_t length, char *buffer, size_t size, size_t &required, Storage::Callback *callback = 0, unsigned options = 0);
+
+    /// maps the file made by Storage::save_binary()
+    bool open(const std::string &path);
+
+    /// maps the snapshot of the text file, (re)builds the snapshot first if it does not match the text file
+    bool open_cached(const std::string &path, const std::string &snapshot_path, Storage::Callback *callback = 0);
+
+    void close();
+
+    bool is_open() const;
+
+    Storage::Strings get_all_sections() const;
+
+    bool is_section_exist(const std::string &section) const;
+
+    Storage::Strings get_all_keys(const std::string &section) const;
+
+    bool is_key_exist(const std::string &section, const std::string &key) const;
+
+    bool is_list(const std::string &section, const std::string &key) const;
+
+    bool contains_binary(const std::string &section, const std::string &key) const;
+    bool contains_binary_utf8(const std::string &section, const std::string &key) const;
+
+    std::pair<bool, std::string> get_string(const std::string &section, const std::string &key, const std::string &default_string = std::string()) const;
+    std::pair<bool, Storage::Values> get_values(const std::string &section, const std::string &key, const Storage::Values &default_values = Storage::Values()) const;
+
+    /// looks up many keys at once without copying, keys of the same section share a single section lookup
+    void get_batch(const Storage::Lookup *lookups, size_t count, Storage::LookupResult *results) const;
+
+    /// points data into the image, returns false if the section/key/index did not exist
+    bool get_raw(const std::string &section, const std::string &key, size_t index, const char *&data, size_t &size) const;
+
+private:
+    Snapshot(const Snapshot &);
+    Snapshot& operator = (const Snapshot &);
+
+private:
+    SnapshotImpl *impl;
+};
+
+}
+
+#endif // INIPLUS_SNAPSHOT__INCLUDED
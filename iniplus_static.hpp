@@ -0,0 +1,616 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+#ifndef INIPLUS_STATIC__INCLUDED
+#define INIPLUS_STATIC__INCLUDED
+
+#if __cplusplus < 202002L
+#error "iniplus_static.hpp needs C++20, the library itself does not"
+#endif
+
+
+#include "iniplus.hpp"
+#include "iniplus_grammar.hpp"
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+namespace iniplus {
+
+/*  An INI text parsed at compile time into read-only tables.
+ *
+ *  constexpr iniplus::StaticStorage<
+ *      "[server]\n"
+ *      "host = localhost\n"
+ *      "port = 80\n"
+ *  > defaults;
+ *
+ *  static_assert(defaults.get_view("server", "port").second == "80");
+ *
+ *  Storage storage;
+ *  storage.load("server.ini");
+ *  defaults.apply_defaults(storage);
+ *
+ *  The grammar is the one of Storage::parse() (iniplus_grammar.hpp), the options are those of Storage. A malformed
+ *  text does not compile, the error goes through static_syntax_error(); Storage::parse() of the same text with a
+ *  Callback tells the line and char.
+ *  Nothing is parsed or allocated at start-up. The lookups taking and returning std::string_view are constexpr,
+ *  the ones returning std::string and Storage::Values are the same as of Storage and Snapshot.
+ */
+
+/// a string literal usable as a template argument, also the Text of Grammar::parse()
+template <size_t N>
+struct StaticText
+{
+    constexpr StaticText(const char (&string)[N])
+    {
+        std::copy_n(string, N, text);
+    }
+
+    constexpr char operator [] (size_t index) const
+    {
+        return (index < N - 1) ? text[index] : '\0';
+    }
+
+    constexpr const char *data() const
+    {
+        return text;
+    }
+
+    constexpr size_t length() const
+    {
+        return N - 1;
+    }
+
+    char text[N];
+};
+
+/// a name or a value of the compile-time parse
+class StaticBytes
+{
+public:
+    constexpr void clear()
+    {
+        m_bytes.clear();
+    }
+
+    constexpr StaticBytes& operator += (char c)
+    {
+        m_bytes += c;
+        return *this;
+    }
+
+    constexpr char &operator [] (size_t index)
+    {
+        return m_bytes[index];
+    }
+
+    constexpr size_t size() const
+    {
+        return m_bytes.size();
+    }
+
+    constexpr size_t length() const
+    {
+        return m_bytes.size();
+    }
+
+    constexpr std::string &str()
+    {
+        return m_bytes;
+    }
+
+    constexpr const std::string &str() const
+    {
+        return m_bytes;
+    }
+
+private:
+    std::string m_bytes;
+};
+
+/// the Grammar helpers of the values
+constexpr StaticBytes trim_value(const StaticBytes &value)
+{
+    const std::string &bytes = value.str();
+    size_t start = 0;
+    size_t end = bytes.size();
+    while ((start != end) && ((bytes[start] == ' ') || (bytes[start] == '\t')))
+        ++start;
+    while ((end != start) && ((bytes[end - 1] == ' ') || (bytes[end - 1] == '\t')))
+        --end;
+
+    StaticBytes result;
+    result.str().assign(bytes, start, end - start);
+    return result;
+}
+
+constexpr void append_value(StaticBytes &value, const char *data, size_t size)
+{
+    value.str().append(data, size);
+}
+
+class StaticValues
+{
+public:
+    constexpr void clear()
+    {
+        m_values.clear();
+    }
+
+    constexpr StaticValues& operator += (const StaticBytes &value)
+    {
+        m_values.push_back(value.str());
+        return *this;
+    }
+
+    constexpr const std::vector<std::string> &values() const
+    {
+        return m_values;
+    }
+
+private:
+    std::vector<std::string> m_values;
+};
+
+typedef struct StaticEntry
+{
+    std::string section;
+    std::string key;
+    std::vector<std::string> values;
+} StaticEntry;
+
+/// Grammar target of the compile-time parse, keeps the entries in the order of the text
+class StaticCollector
+{
+public:
+    constexpr bool entry(const StaticBytes &section, const StaticBytes &key, const StaticValues &values)
+    {
+        m_entries.push_back(StaticEntry { section.str(), key.str(), values.values() });
+        return true;
+    }
+
+    constexpr const std::vector<StaticEntry> &entries() const
+    {
+        return m_entries;
+    }
+
+private:
+    std::vector<StaticEntry> m_entries;
+};
+
+/// not constexpr on purpose: a malformed StaticStorage text stops the compilation here
+inline void static_syntax_error(size_t /*faulty_pos*/, size_t /*faulty_line*/, size_t /*faulty_char*/)
+{}
+
+class StaticStats
+{
+public:
+    constexpr void escape()
+    {}
+
+    constexpr void begin_store()
+    {}
+
+    template <typename Name, typename Values>
+    constexpr void end_store(const Name &, const Name &, const Values &)
+    {}
+
+    /// a template, so that only reaching the call is an error
+    template <typename Position>
+    constexpr void fail(Position faulty_pos, Position faulty_line, Position faulty_char)
+    {
+        static_syntax_error(faulty_pos, faulty_line, faulty_char);
+    }
+};
+
+/// a section with the range of its keys, or a key with the range of its values
+typedef struct StaticName
+{
+    size_t offset; // in the bytes
+    size_t size;
+    size_t first;
+    size_t count;
+} StaticName;
+
+typedef struct StaticSpan
+{
+    size_t offset; // in the bytes
+    size_t size;
+} StaticSpan;
+
+template <size_t SectionCount, size_t KeyCount, size_t ValueCount, size_t ByteCount>
+struct StaticTables
+{
+    std::array<StaticName, SectionCount> sections;
+    std::array<StaticName, KeyCount> keys;
+    std::array<StaticSpan, ValueCount> values;
+    std::array<char, ByteCount> bytes;
+};
+
+/// compares the way Storage orders the names, on the lower-cased ASCII letters if folding
+constexpr int static_compare(std::string_view left, std::string_view right, bool fold)
+{
+    size_t m = std::min(left.size(), right.size());
+    for (size_t i = 0; i != m; ++i)
+    {
+        unsigned char l = static_cast<unsigned char>(left[i]);
+        unsigned char r = static_cast<unsigned char>(right[i]);
+        if (fold)
+        {
+            l = ((l >= 'A') && (l <= 'Z')) ? (l | 0x20) : l;
+            r = ((r >= 'A') && (r <= 'Z')) ? (r | 0x20) : r;
+        }
+        if (l != r)
+            return (l < r) ? -1 : 1;
+    }
+
+    if (left.size() == right.size())
+        return 0;
+    return (left.size() < right.size()) ? -1 : 1;
+}
+
+template <StaticText Text, unsigned Options = 0>
+class StaticStorage
+{
+public:
+    constexpr StaticStorage()
+    {}
+
+    constexpr bool is_section_exist(std::string_view section) const
+    {
+        size_t index = 0;
+        return find_section(section, index);
+    }
+
+    constexpr bool is_key_exist(std::string_view section, std::string_view key) const
+    {
+        size_t index = 0;
+        return find_key(section, key, index);
+    }
+
+    constexpr bool is_list(std::string_view section, std::string_view key) const
+    {
+        size_t index = 0;
+        return find_key(section, key, index) && (tables.keys[index].count > 1);
+    }
+
+    /// the first value, or the default if the key did not exist
+    constexpr std::pair<bool, std::string_view> get_view(std::string_view section, std::string_view key, std::string_view default_view = std::string_view()) const
+    {
+        const char *data = 0;
+        size_t size = 0;
+        if (get_raw(section, key, 0, data, size))
+            return std::make_pair(true, std::string_view(data, size));
+
+        return std::make_pair(false, default_view);
+    }
+
+    /// points data into the tables, returns false if the section/key/index did not exist
+    constexpr bool get_raw(std::string_view section, std::string_view key, size_t index, const char *&data, size_t &size) const
+    {
+        size_t key_index = 0;
+        if (!find_key(section, key, key_index) || (index >= tables.keys[key_index].count))
+            return false;
+
+        const StaticSpan &value = tables.values[tables.keys[key_index].first + index];
+        data = tables.bytes.data() + value.offset;
+        size = value.size;
+        return true;
+    }
+
+    Storage::Strings get_all_sections() const
+    {
+        Storage::Strings result;
+        for (size_t i = 0; i != tables.sections.size(); ++i)
+            result.insert(result.end(), std::string(name(tables.sections[i])));
+        return result;
+    }
+
+    Storage::Strings get_all_keys(std::string_view section) const
+    {
+        Storage::Strings result;
+
+        size_t index = 0;
+        if (find_section(section, index))
+        {
+            const StaticName &static_section = tables.sections[index];
+            for (size_t i = 0; i != static_section.count; ++i)
+                result.insert(result.end(), std::string(name(tables.keys[static_section.first + i])));
+        }
+
+        return result;
+    }
+
+    bool contains_binary(std::string_view section, std::string_view key) const
+    {
+        std::pair<bool, Storage::Values> result = get_values(section, key);
+
+        return result.first && result.second.contains_binary();
+    }
+
+    bool contains_binary_utf8(std::string_view section, std::string_view key) const
+    {
+        std::pair<bool, Storage::Values> result = get_values(section, key);
+
+        return result.first && result.second.contains_binary_utf8();
+    }
+
+    std::pair<bool, std::string> get_string(std::string_view section, std::string_view key, const std::string &default_string = std::string()) const
+    {
+        std::pair<bool, std::string_view> result = get_view(section, key);
+        if (result.first)
+            return std::make_pair(true, std::string(result.second));
+
+        return std::make_pair(false, default_string);
+    }
+
+    std::pair<bool, Storage::Values> get_values(std::string_view section, std::string_view key, const Storage::Values &default_values = Storage::Values()) const
+    {
+        size_t index = 0;
+        if (find_key(section, key, index))
+            return std::make_pair(true, values(tables.keys[index]));
+
+        return std::make_pair(false, default_values);
+    }
+
+    /// calls section() before the entries of each section, returns false if the visitor stopped
+    bool visit_entries(Storage::Visitor &visitor) const
+    {
+        for (size_t i = 0; i != tables.sections.size(); ++i)
+        {
+            const StaticName &static_section = tables.sections[i];
+            std::string section(name(static_section));
+            if (!visitor.section(section))
+                return false;
+
+            for (size_t j = 0; j != static_section.count; ++j)
+            {
+                const StaticName &static_key = tables.keys[static_section.first + j];
+                if (!visitor.entry(section, std::string(name(static_key)), values(static_key)))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// sets the keys the storage does not have, so the table acts as the layer under what was loaded
+    void apply_defaults(Storage &storage) const
+    {
+        for (size_t i = 0; i != tables.sections.size(); ++i)
+        {
+            const StaticName &static_section = tables.sections[i];
+            std::string section(name(static_section));
+            for (size_t j = 0; j != static_section.count; ++j)
+            {
+                const StaticName &static_key = tables.keys[static_section.first + j];
+                std::string key(name(static_key));
+                if (!storage.is_key_exist(section, key))
+                    storage.set_values(section, key, values(static_key));
+            }
+        }
+    }
+
+private:
+    static constexpr bool fold = (Options & Storage::OPTION__CASE_INSENSITIVE) != 0;
+
+    typedef struct DraftName
+    {
+        std::string name;
+        size_t first;
+        size_t count;
+    } DraftName;
+
+    /// the merged entries: the later of the same keys wins, the names keep their first spelling
+    typedef struct Draft
+    {
+        std::vector<DraftName> sections;
+        std::vector<DraftName> keys;
+        std::vector<std::string> values;
+    } Draft;
+
+    static constexpr int compare_keys(const StaticEntry &left, const StaticEntry &right)
+    {
+        int result = static_compare(left.section, right.section, fold);
+        return result ? result : static_compare(left.key, right.key, fold);
+    }
+
+    static constexpr Draft draft()
+    {
+        StaticCollector collector;
+        StaticStats stats;
+        StaticBytes current_section;
+        StaticBytes current_key;
+        StaticValues current_values;
+        StaticBytes current_value;
+        Grammar::parse(Text, 0, collector, stats, (Options & Storage::OPTION__UTF8) != 0, current_section, current_key, current_values, current_value);
+
+        const std::vector<StaticEntry> &entries = collector.entries();
+        std::vector<size_t> order(entries.size());
+        for (size_t i = 0; i != order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&entries](size_t left, size_t right) {
+            int result = compare_keys(entries[left], entries[right]);
+            return result ? (result < 0) : (left < right);
+        });
+
+        Draft result;
+        for (size_t i = 0; i != order.size(); )
+        {
+            size_t section_first = order[i];
+            size_t first_entry = section_first;
+            result.sections.push_back(DraftName { std::string(), result.keys.size(), 0 });
+
+            while ((i != order.size()) && !static_compare(entries[section_first].section, entries[order[i]].section, fold))
+            {
+                size_t last = i;
+                while ((last + 1 != order.size()) && !compare_keys(entries[order[i]], entries[order[last + 1]]))
+                    ++last;
+
+                first_entry = std::min(first_entry, order[i]);
+                const std::vector<std::string> &values = entries[order[last]].values;
+                result.keys.push_back(DraftName { entries[order[i]].key, result.values.size(), values.size() });
+                result.values.insert(result.values.end(), values.begin(), values.end());
+                ++result.sections.back().count;
+
+                i = last + 1;
+            }
+
+            result.sections.back().name = entries[first_entry].section;
+        }
+
+        return result;
+    }
+
+    typedef struct Layout
+    {
+        size_t section_count;
+        size_t key_count;
+        size_t value_count;
+        size_t byte_count;
+    } Layout;
+
+    static constexpr Layout measure()
+    {
+        Draft draft = StaticStorage::draft();
+        Layout layout = { draft.sections.size(), draft.keys.size(), draft.values.size(), 0 };
+        for (size_t i = 0; i != draft.sections.size(); ++i)
+            layout.byte_count += draft.sections[i].name.size();
+        for (size_t i = 0; i != draft.keys.size(); ++i)
+            layout.byte_count += draft.keys[i].name.size();
+        for (size_t i = 0; i != draft.values.size(); ++i)
+            layout.byte_count += draft.values[i].size();
+        return layout;
+    }
+
+    static constexpr Layout layout = measure();
+
+    typedef StaticTables<layout.section_count, layout.key_count, layout.value_count, layout.byte_count> Tables;
+
+    static constexpr Tables build()
+    {
+        Draft draft = StaticStorage::draft();
+        Tables result {};
+        size_t offset = 0;
+        for (size_t i = 0; i != draft.sections.size(); ++i)
+        {
+            result.sections[i] = StaticName { offset, draft.sections[i].name.size(), draft.sections[i].first, draft.sections[i].count };
+            offset = copy(draft.sections[i].name, result, offset);
+        }
+        for (size_t i = 0; i != draft.keys.size(); ++i)
+        {
+            result.keys[i] = StaticName { offset, draft.keys[i].name.size(), draft.keys[i].first, draft.keys[i].count };
+            offset = copy(draft.keys[i].name, result, offset);
+        }
+        for (size_t i = 0; i != draft.values.size(); ++i)
+        {
+            result.values[i] = StaticSpan { offset, draft.values[i].size() };
+            offset = copy(draft.values[i], result, offset);
+        }
+        return result;
+    }
+
+    static constexpr size_t copy(const std::string &bytes, Tables &tables, size_t offset)
+    {
+        std::copy(bytes.begin(), bytes.end(), tables.bytes.begin() + offset);
+        return offset + bytes.size();
+    }
+
+    static constexpr Tables tables = build();
+
+    constexpr std::string_view name(const StaticName &static_name) const
+    {
+        return std::string_view(tables.bytes.data() + static_name.offset, static_name.size);
+    }
+
+    Storage::Values values(const StaticName &static_key) const
+    {
+        Storage::Values result;
+        result.resize(static_key.count);
+        for (size_t i = 0; i != static_key.count; ++i)
+        {
+            const StaticSpan &value = tables.values[static_key.first + i];
+            result[i].assign(tables.bytes.data() + value.offset, tables.bytes.data() + value.offset + value.size);
+        }
+        return result;
+    }
+
+    constexpr bool find_section(std::string_view section, size_t &index) const
+    {
+        size_t low = 0;
+        size_t high = tables.sections.size();
+        while (low < high)
+        {
+            size_t middle = low + (high - low) / 2;
+            int result = static_compare(name(tables.sections[middle]), section, fold);
+            if (!result)
+            {
+                index = middle;
+                return true;
+            }
+            if (result < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return false;
+    }
+
+    constexpr bool find_key(std::string_view section, std::string_view key, size_t &index) const
+    {
+        size_t section_index = 0;
+        if (!find_section(section, section_index))
+            return false;
+
+        size_t low = tables.sections[section_index].first;
+        size_t high = low + tables.sections[section_index].count;
+        while (low < high)
+        {
+            size_t middle = low + (high - low) / 2;
+            int result = static_compare(name(tables.keys[middle]), key, fold);
+            if (!result)
+            {
+                index = middle;
+                return true;
+            }
+            if (result < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return false;
+    }
+};
+
+}
+
+#endif // INIPLUS_STATIC__INCLUDED
@@ -0,0 +1,1280 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+/*  Regression tests, run by ctest. Every test works in its own scratch directory under the working directory. */
+
+#include "iniplus.hpp"
+#include "iniplus_shared.hpp"
+#include "iniplus_snapshot.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using namespace iniplus;
+
+static int failures = 0;
+
+/// counts the allocations, as iniplus_bench.cpp does
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *result = malloc(size ? size : 1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void *operator new[](size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *result = malloc(size ? size : 1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++failures; \
+        } \
+    } while (0)
+
+static std::string scratch(const std::string &test)
+{
+    std::string path = "iniplus_test." + test;
+    std::string command = "rm -rf '" + path + "' && mkdir -p '" + path + "'";
+    if (system(command.c_str()))
+        abort();
+    return path + "/";
+}
+
+static void write_text(const std::string &path, const std::string &text)
+{
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    file << text;
+}
+
+static std::string read_text(const std::string &path)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+
+/// every sink gets the generate() output, generated_size() tells its length and a buffer one byte short fails
+static void test_sinks()
+{
+    std::string directory = scratch("sinks");
+    Storage storage;
+    CHECK(storage.parse("[s]\nk = 1\nlong = " + std::string(200, 'x') + "\nlist = a, \"b c\"\n[t]\nk = 2\n"));
+    std::string text = storage.generate();
+    CHECK(storage.generated_size() == text.size());
+
+    std::string string;
+    Storage::StringSink string_sink(string);
+    CHECK(storage.generate_to(string_sink));
+    CHECK(string == text);
+
+    std::vector<char> buffer(text.size());
+    Storage::BufferSink buffer_sink(buffer.data(), buffer.size());
+    CHECK(storage.generate_to(buffer_sink));
+    CHECK(buffer_sink.size() == text.size());
+    CHECK(std::string(buffer.data(), buffer.size()) == text);
+
+    Storage::BufferSink short_sink(buffer.data(), buffer.size() - 1);
+    CHECK(!storage.generate_to(short_sink));
+
+    std::ostringstream stream;
+    Storage::OStreamSink stream_sink(stream);
+    CHECK(storage.generate_to(stream_sink));
+    CHECK(stream.str() == text);
+
+    // a buffer smaller than the long value, the rest waits in it until the flush
+    std::string path = directory + "fd.ini";
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    Storage::FdSink fd_sink(fd, 16);
+    CHECK(storage.generate_to(fd_sink));
+    ::close(fd);
+    CHECK(read_text(path) == text);
+}
+
+/// the encoders write the same bytes the scalar ones did, also for names and values long enough for the SSE2 path
+static void test_encoders()
+{
+    Storage storage;
+    storage.set_string("plain section", "key", "a value long enough to reach the vector path");
+    storage.set_string("plain section", "spaces", "  leading and trailing spaces, well past 16  ");
+    storage.set_string("plain section", "quote", "sixteen bytes ok \"quoted\" and more text after it");
+    storage.set_string("plain section", "escapes", "tab\there, newline\nthere, backslash\\ and cr\r at byte 40+");
+    storage.set_string("plain section", "binary", std::string("0123456789abcdef\x01\x7f\xff\x80 tail", 24));
+    storage.set_string("plain section", "comment", "0123456789abcdef; not a comment # nor this");
+    storage.set_string("plain section", "empty", "");
+    storage.set_string("[odd] = section;#", "key with = and ; and \"q\" beyond sixteen", "v");
+    storage.set_string("[odd] = section;#", "short", "x,y");
+
+    Storage::Values values;
+    values.push_back(std::string("first value of a list, with a comma inside"));
+    values.push_back(std::string(""));
+    values.push_back(std::string("0123456789abcdef0123456789abcdef\""));
+    values.push_back(std::string("\0nul", 4));
+    storage.set_values("list", "values", values);
+
+    std::string expected =
+        "[%5Bodd%5D%20%3D%20section%3B%23]\n"
+        "key%20with%20%3D%20and%20%3B%20and%20%22q%22%20beyond%20sixteen=v\n"
+        "short=\"x,y\"\n"
+        "\n"
+        "[list]\n"
+        "values=\"first value of a list, with a comma inside\", , \"0123456789abcdef0123456789abcdef\\\"\", \\0nul\n"
+        "\n"
+        "[plain%20section]\n"
+        "binary=0123456789abcdef\\x01\\x7F\\xFF\\x80 tai\n"
+        "comment=\"0123456789abcdef; not a comment # nor this\"\n"
+        "empty=\n"
+        "escapes=\"tab\\there, newline\\nthere, backslash\\\\ and cr\\r at byte 40+\"\n"
+        "key=a value long enough to reach the vector path\n"
+        "quote=\"sixteen bytes ok \\\"quoted\\\" and more text after it\"\n"
+        "spaces=\"  leading and trailing spaces, well past 16  \"\n"
+        "\n";
+    CHECK(storage.generate() == expected);
+
+    Storage parsed;
+    CHECK(parsed.parse(expected));
+    CHECK(parsed.generate() == expected);
+    CHECK(parsed.get_values("list", "values").second == values);
+    CHECK(parsed.get_string("plain section", "escapes").second == storage.get_string("plain section", "escapes").second);
+}
+
+/// save() leaves an identical file alone, replaces the target of a symlink and creates a new file under the umask
+static void test_save()
+{
+    std::string directory = scratch("save");
+    std::string path = directory + "a.ini";
+
+    Storage storage;
+    CHECK(storage.parse("[s]\nk = 1\n"));
+
+    mode_t mask = ::umask(027);
+    CHECK(storage.save(path));
+    ::umask(mask);
+
+    struct stat st;
+    CHECK(!::stat(path.c_str(), &st));
+    CHECK((st.st_mode & 0777) == 0640);
+    CHECK(read_text(path) == storage.generate());
+
+    ino_t inode = st.st_ino;
+    CHECK(storage.save(path));
+    CHECK(!::stat(path.c_str(), &st));
+    CHECK(st.st_ino == inode);
+
+    CHECK(!::chmod(path.c_str(), 0600));
+    storage.set_string("s", "k", "2");
+    CHECK(storage.save(path));
+    CHECK(!::stat(path.c_str(), &st));
+    CHECK(st.st_ino != inode);
+    CHECK((st.st_mode & 0777) == 0600);
+    CHECK(read_text(path) == storage.generate());
+
+    std::string link_path = directory + "link.ini";
+    CHECK(!::symlink("a.ini", link_path.c_str()));
+    storage.set_string("s", "k", "3");
+    CHECK(storage.save(link_path));
+    CHECK(!::lstat(link_path.c_str(), &st));
+    CHECK(S_ISLNK(st.st_mode));
+    CHECK(read_text(path) == storage.generate());
+}
+
+/// the files of every size come back whole, the empty one included
+static void test_load_sizes()
+{
+    std::string directory = scratch("load_sizes");
+    for (size_t size = 0; size < 9000; size = size * 2 + 7)
+    {
+        std::string text = "[s]\nk=" + std::string(size, 'v') + "\n";
+        write_text(directory + "a.ini", text);
+
+        Storage storage;
+        CHECK(storage.load(directory + "a.ini"));
+        CHECK(storage.get_string("s", "k").second == std::string(size, 'v'));
+    }
+
+    write_text(directory + "empty.ini", "");
+    Storage storage;
+    CHECK(storage.load(directory + "empty.ini"));
+    CHECK(storage.get_all_sections().empty());
+}
+
+/// a snapshot matching the size and the mtime is taken without reading the file, so a same-size edit
+/// with the mtime put back goes unnoticed, while a new mtime brings the edit in
+static void test_load_cached_fast_path()
+{
+    std::string directory = scratch("load_cached");
+    std::string path = directory + "a.ini";
+    std::string snapshot_path = directory + "a.snap";
+    write_text(path, "[s]\nk=1\n");
+
+    Storage storage;
+    CHECK(storage.load_cached(path, snapshot_path));
+    CHECK(storage.get_string("s", "k").second == "1");
+
+    struct stat st;
+    CHECK(!::stat(path.c_str(), &st));
+    write_text(path, "[s]\nk=2\n");
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    CHECK(!::utimensat(AT_FDCWD, path.c_str(), times, 0));
+
+    Storage cached;
+    CHECK(cached.load_cached(path, snapshot_path));
+    CHECK(cached.get_string("s", "k").second == "1");
+
+    Snapshot snapshot;
+    CHECK(snapshot.open_cached(path, snapshot_path));
+    CHECK(snapshot.get_string("s", "k").second == "1");
+    snapshot.close();
+
+    times[1].tv_sec -= 10;
+    CHECK(!::utimensat(AT_FDCWD, path.c_str(), times, 0));
+
+    Storage reparsed;
+    CHECK(reparsed.load_cached(path, snapshot_path));
+    CHECK(reparsed.get_string("s", "k").second == "2");
+    CHECK(snapshot.open_cached(path, snapshot_path));
+    CHECK(snapshot.get_string("s", "k").second == "2");
+}
+
+/// a segment of the next generation left by a publisher that died before publishing it does not block publishing
+static void test_shared_orphan_segment()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/iniplus_test.%d", static_cast<int>(::getpid()));
+
+    int fd = ::shm_open((std::string(name) + ".1").c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    CHECK(fd >= 0);
+    if (fd >= 0)
+        ::close(fd);
+
+    Storage storage;
+    storage.set_string("s", "k", "v");
+
+    SharedPublisher publisher(name);
+    CHECK(publisher.publish(storage));
+    CHECK(publisher.generation() == 1);
+
+    SharedReader reader(name);
+    CHECK(reader.refresh());
+    CHECK(reader.snapshot().get_string("s", "k").second == "v");
+
+    publisher.unlink();
+}
+
+/// a reader switches to a new publisher of the name after the old one unlinked it, even at the same generation
+static void test_shared_republish()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/iniplus_test.%d.republish", static_cast<int>(::getpid()));
+
+    Storage storage;
+    SharedPublisher publisher(name);
+    storage.set_string("s", "k", "1");
+    CHECK(publisher.publish(storage));
+    storage.set_string("s", "k", "2");
+    CHECK(publisher.publish(storage));
+
+    SharedReader reader(name);
+    CHECK(reader.refresh());
+    CHECK(reader.generation() == 2);
+
+    publisher.unlink();
+    CHECK(reader.refresh());
+    CHECK(reader.snapshot().get_string("s", "k").second == "2");
+
+    SharedPublisher successor(name);
+    storage.set_string("s", "k", "3");
+    CHECK(successor.publish(storage));
+    CHECK(reader.refresh());
+    CHECK(reader.snapshot().get_string("s", "k").second == "3");
+
+    successor.unlink();
+    SharedPublisher third(name);
+    storage.set_string("s", "k", "4");
+    CHECK(third.publish(storage));
+    CHECK(third.generation() == 1);
+    CHECK(reader.refresh());
+    CHECK(reader.generation() == 1);
+    CHECK(reader.snapshot().get_string("s", "k").second == "4");
+    third.unlink();
+}
+
+static void check_batch(const Storage::LookupResult *results, const Storage::Values &defaults)
+{
+    CHECK(results[0].found && (results[0].count == 1) && (std::string(results[0].data, results[0].size) == "1"));
+    CHECK(!results[1].found && !results[1].values && !results[1].count);
+    CHECK(!results[2].found && (results[2].values == &defaults) && (results[2].count == 2));
+    CHECK(std::string(results[2].data, results[2].size) == "d1");
+    CHECK(!results[3].found && (results[3].values == &defaults));
+    CHECK(results[4].found && (results[4].count == 2) && (std::string(results[4].data, results[4].size) == "p"));
+    CHECK(results[5].found && (std::string(results[5].data, results[5].size) == "3"));
+}
+
+/// the same answers from a storage and its snapshot for hits, missing keys and sections, with and without defaults
+static void test_get_batch()
+{
+    Storage storage;
+    CHECK(storage.parse("[a]\nx = 1\ny = p, q\n[b]\nz = 3\n"));
+
+    Storage::Values defaults;
+    defaults.push_back(std::string("d1"));
+    defaults.push_back(std::string("d2"));
+
+    std::string a("a"), b("b"), c("c"), x("x"), y("y"), z("z"), missing("missing");
+    Storage::Lookup lookups[6] = {
+        { &a, &x, 0 },
+        { &b, &missing, 0 },
+        { &a, &missing, &defaults },
+        { &c, &x, &defaults },
+        { &a, &y, &defaults },
+        { &b, &z, 0 }
+    };
+
+    Storage::LookupResult results[6];
+    storage.get_batch(lookups, 6, results);
+    check_batch(results, defaults);
+    CHECK(*results[4].values == storage.get_values("a", "y").second);
+
+    std::string image = storage.generate_binary();
+    std::vector<uint64_t> buffer(image.size() / sizeof(uint64_t) + 1);
+    memcpy(buffer.data(), image.data(), image.size());
+
+    Snapshot snapshot;
+    CHECK(snapshot.attach(reinterpret_cast<const char *>(buffer.data()), image.size()));
+    Storage::LookupResult snapshot_results[6];
+    snapshot.get_batch(lookups, 6, snapshot_results);
+    check_batch(snapshot_results, defaults);
+}
+
+class NameList : public Storage::Visitor
+{
+public:
+    virtual bool section(const std::string &section)
+    {
+        names += "[" + section + "]";
+        return true;
+    }
+
+    std::string names;
+};
+
+static std::string children(const Storage &storage, const std::string &section)
+{
+    NameList list;
+    storage.visit_child_sections(section, list);
+    return list.names;
+}
+
+static std::string subtree(const Storage &storage, const std::string &section)
+{
+    NameList list;
+    storage.visit_subtree(section, list);
+    return list.names;
+}
+
+/// collects the names the visits hand over, stops after limit of them
+class NameRecorder : public Storage::Visitor
+{
+public:
+    NameRecorder(size_t limit = 0)
+        : Visitor()
+        , m_limit(limit)
+    {}
+
+    virtual bool section(const std::string &section)
+    {
+        return add("[" + section + "]");
+    }
+
+    virtual bool entry(const std::string &, const std::string &key, const Storage::Values &)
+    {
+        return add(key + ";");
+    }
+
+    std::string names;
+
+private:
+    bool add(const std::string &name)
+    {
+        names += name;
+        return !m_limit || --m_limit;
+    }
+
+private:
+    size_t m_limit;
+};
+
+static std::string sections_with_prefix(const Storage &storage, const std::string &prefix)
+{
+    NameRecorder recorder;
+    CHECK(storage.visit_sections_with_prefix(prefix, recorder));
+    return recorder.names;
+}
+
+static std::string sections_in_range(const Storage &storage, const std::string &first, const std::string &last)
+{
+    NameRecorder recorder;
+    CHECK(storage.visit_sections_in_range(first, last, recorder));
+    return recorder.names;
+}
+
+static std::string keys_with_prefix(const Storage &storage, const std::string &section, const std::string &prefix)
+{
+    NameRecorder recorder;
+    CHECK(storage.visit_keys_with_prefix(section, prefix, recorder));
+    return recorder.names;
+}
+
+/// the prefix and range visits stop at their bounds, fold the case when the storage does and report a stopped visitor
+static void test_prefix_range_visits()
+{
+    const char *text = "[ALPHA.x]\nk=1\n[alpha.y]\nk=1\n[Alpine]\nk=1\n[alps]\nk=1\n[beta]\nKey1=1\nkey2=2\nother=3\n[Gamma]\nk=1\n"
+                       "[b]\nk=1\n";
+
+    Storage storage;
+    CHECK(storage.parse(text));
+    storage.set_string("a\xff", "k", "1");
+    storage.set_string("a\xffz", "k", "1");
+    CHECK(sections_with_prefix(storage, "alp") == "[alpha.y][alps]");
+    CHECK(sections_with_prefix(storage, "a\xff") == "[a\xff][a\xffz]");
+    CHECK(sections_with_prefix(storage, "zeta") == "");
+    CHECK(sections_in_range(storage, "Alpine", "alpha.y") == "[Alpine][Gamma]");
+    CHECK(sections_in_range(storage, "b", "beta") == "[b]");
+    CHECK(keys_with_prefix(storage, "beta", "key") == "key2;");
+
+    Storage folded(Storage::OPTION__CASE_INSENSITIVE);
+    CHECK(folded.parse(text));
+    CHECK(sections_with_prefix(folded, "alp") == "[ALPHA.x][alpha.y][Alpine][alps]");
+    CHECK(sections_with_prefix(folded, "ALPHA.") == "[ALPHA.x][alpha.y]");
+    CHECK(sections_in_range(folded, "ALPINE", "B") == "[Alpine][alps]");
+    CHECK(sections_in_range(folded, "b", "GAMMA") == "[b][beta]");
+    CHECK(sections_in_range(folded, "b", "gammb") == "[b][beta][Gamma]");
+    CHECK(keys_with_prefix(folded, "BETA", "KEY") == "Key1;key2;");
+
+    NameRecorder stopped(2);
+    CHECK(!folded.visit_sections_with_prefix("alp", stopped));
+    CHECK(stopped.names == "[ALPHA.x][alpha.y]");
+}
+
+/// the index and the scan without it agree on the children and the subtree, "-" sorting between "eu" and "eu."
+/// lists no child twice, and the empty section is the top level itself
+static void test_hierarchy()
+{
+    for (int indexed = 0; indexed != 2; ++indexed)
+    {
+        Storage storage;
+        storage.set_hierarchy_index(indexed != 0);
+        storage.set_string("", "k", "v");
+        storage.set_string("cluster.eu", "k", "v");
+        storage.set_string("cluster.eu-west", "k", "v");
+        storage.set_string("cluster.eu.node1", "k", "v");
+        storage.set_string("other.x", "k", "v");
+
+        CHECK(children(storage, "cluster") == "[cluster.eu][cluster.eu-west]");
+        CHECK(children(storage, "") == "[cluster][other]");
+        CHECK(subtree(storage, "cluster") == "[cluster.eu][cluster.eu.node1][cluster.eu-west]");
+        CHECK(subtree(storage, "") == "[][cluster.eu][cluster.eu.node1][cluster.eu-west][other.x]");
+
+        CHECK(storage.remove_section(""));
+        CHECK(subtree(storage, "") == "[cluster.eu][cluster.eu.node1][cluster.eu-west][other.x]");
+        CHECK(children(storage, "") == "[cluster][other]");
+        CHECK(storage.remove_subtree("") == 4);
+        CHECK(storage.get_all_sections().empty());
+        CHECK(subtree(storage, "").empty());
+    }
+}
+
+/// the counters of a parse, escapes counted only once decoded, and the failure position
+static void test_parse_result()
+{
+    std::string directory = scratch("parse_result");
+    std::string text = "[s%41]\nk = a\\tb, \\x41, c\n[t]\nk2 = 1\nk3 = \\x4\n";
+
+    Storage storage;
+    Storage::ParseResult result;
+    CHECK(storage.parse(text, result));
+    CHECK(result.success);
+    CHECK(result.bytes_processed == text.size());
+    CHECK(result.section_count == 2);
+    CHECK(result.key_count == 3);
+    CHECK(result.value_count == 5);
+    CHECK(result.escapes_decoded == 4);
+    CHECK(result.peak_value_count == 3);
+    CHECK(result.peak_value_size == 3);
+    CHECK(result.allocations == 0);
+    CHECK(result.read_time == 0);
+    CHECK(result.total_time >= result.scan_time);
+
+    Storage failed;
+    CHECK(!failed.parse("[s]\nk = \\q\n", result));
+    CHECK(!result.success);
+    CHECK(result.escapes_decoded == 0);
+    CHECK(result.faulty_line == 2);
+    CHECK(!failed.parse("[s]\nk = \\xg\n", result));
+    CHECK(result.escapes_decoded == 0);
+
+    std::string path = directory + "a.ini";
+    write_text(path, text);
+    Storage loaded;
+    CHECK(loaded.load(path, result));
+    CHECK(result.bytes_processed == text.size());
+    CHECK(result.key_count == 3);
+    CHECK(result.total_time >= result.read_time);
+}
+
+/// a thread counting lookups on storage after storage keeps no memory for the destroyed ones
+static void test_access_stats_threads_forget()
+{
+    if (!Storage::has_access_stats())
+        return;
+
+    size_t start = 0;
+    for (int i = 0; i != 50000; ++i)
+    {
+        Storage storage;
+        storage.get_string("s", "k");
+        if (i == 100)
+            start = mallinfo2().uordblks;
+    }
+
+    CHECK(mallinfo2().uordblks < start + 256 * 1024);
+}
+
+/// remembers the files the reports were about
+class FileReports : public Storage::Callback
+{
+public:
+    FileReports()
+        : Callback()
+    {}
+
+    virtual void error(size_t, size_t, size_t)
+    {}
+
+    virtual void warning(Storage::ParseWarning, size_t, size_t, size_t)
+    {}
+
+    virtual void file_error(const std::string &path, size_t, size_t faulty_line, size_t)
+    {
+        errors += path + ":" + std::to_string(faulty_line) + ";";
+    }
+
+    virtual void read_error(const std::string &path, int)
+    {
+        read_errors += path + ";";
+    }
+
+    std::string errors;
+    std::string read_errors;
+};
+
+/// the files matching the pattern merge in name order by the policy, a broken one is reported by name and skipped
+static void test_load_directory()
+{
+    std::string directory = scratch("load_directory");
+    write_text(directory + "10-a.ini", "[s]\nk = 1\nonly_a = a\n");
+    write_text(directory + "20-b.ini", "[s]\nk = 2\n[t]\nx = 1\n");
+    write_text(directory + "30-c.ini", "[s]\nk = 3\n");
+    write_text(directory + "notes.txt", "[s]\nk = txt\n");
+    write_text(directory + ".hidden.ini", "[s]\nk = hidden\n");
+    std::string path = directory.substr(0, directory.size() - 1);
+
+    for (unsigned threads = 1; threads != 4; ++threads)
+    {
+        Storage storage;
+        CHECK(storage.load_directory(path, "*.ini", 0, Storage::MERGE_POLICY__OVERRIDE, threads));
+        CHECK(storage.get_string("s", "k").second == "3");
+        CHECK(storage.get_string("s", "only_a").second == "a");
+        CHECK(storage.get_string("t", "x").second == "1");
+
+        CHECK(storage.load_directory(path, "*.ini", 0, Storage::MERGE_POLICY__KEEP, threads));
+        CHECK(storage.get_string("s", "k").second == "1");
+
+        CHECK(storage.load_directory(path, "*.ini", 0, Storage::MERGE_POLICY__APPEND, threads));
+        CHECK(storage.get_values("s", "k").second.size() == 3);
+        CHECK(storage.get_string("s", "k").second == "1");
+    }
+
+    write_text(directory + "25-broken.ini", "[s]\nk = 4\n[t\n");
+    FileReports reports;
+    Storage storage;
+    CHECK(!storage.load_directory(path, "*.ini", &reports));
+    CHECK(reports.errors == path + "/25-broken.ini:3;");
+    CHECK(storage.get_string("s", "k").second == "3");
+
+    CHECK(!storage.load_directory(path + "/missing", "*.ini", &reports));
+    CHECK(reports.read_errors == path + "/missing;");
+}
+
+/// names match ignoring the ASCII case, the first spelling is kept and a case-sensitive storage tells them apart
+static void test_case_insensitive()
+{
+    std::string text = "[Server]\nHost = a\n[SERVER]\nport = 80\n";
+
+    Storage folded(Storage::OPTION__CASE_INSENSITIVE);
+    CHECK(folded.parse(text));
+    CHECK(folded.get_all_sections().size() == 1);
+    CHECK(folded.get_string("server", "HOST").second == "a");
+    CHECK(folded.get_string("sErVeR", "Port").second == "80");
+    CHECK(folded.is_key_exist("SERVER", "host"));
+
+    folded.set_string("server", "HOST", "b");
+    CHECK(folded.get_string("Server", "Host").second == "b");
+    CHECK(folded.generate() == "[Server]\nHost=b\nport=80\n\n");
+
+    CHECK(folded.remove_key("SERVER", "PORT"));
+    CHECK(!folded.is_key_exist("Server", "port"));
+    CHECK(folded.rename_section("SERVER", "Other"));
+    CHECK(folded.is_section_exist("OTHER"));
+
+    Storage exact;
+    CHECK(exact.parse(text));
+    CHECK(exact.get_all_sections().size() == 2);
+    CHECK(!exact.get_string("server", "Host").first);
+    CHECK(!exact.is_key_exist("Server", "host"));
+}
+
+/// the memoized expansions follow the changes of the keys they were made of, cycles and chains over 64 deep
+/// leave the references as written
+static void test_expansion()
+{
+    Storage storage;
+    CHECK(storage.parse("[app]\nurl = http://${host}:${net:port}/\nhost = ${net:name}\n[net]\nname = example\nport = 80\n"));
+    CHECK(storage.get_expanded_string("app", "url").second == "http://example:80/");
+
+    storage.set_string("net", "port", "8080");
+    CHECK(storage.get_expanded_string("app", "url").second == "http://example:8080/");
+    storage.set_string("net", "name", "other");
+    CHECK(storage.get_expanded_string("app", "host").second == "other");
+    CHECK(storage.get_expanded_string("app", "url").second == "http://other:8080/");
+
+    CHECK(storage.rename_key("net", "port", "net", "old_port"));
+    CHECK(storage.get_expanded_string("app", "url").second == "http://other:${net:port}/");
+    storage.set_string("net", "port", "81");
+    CHECK(storage.get_expanded_string("app", "url").second == "http://other:81/");
+    CHECK(storage.remove_section("net"));
+    CHECK(storage.get_expanded_string("app", "url").second == "http://${net:name}:${net:port}/");
+    CHECK(storage.get_string("app", "url").second == "http://${host}:${net:port}/");
+
+    storage.set_string("cycle", "p", "<${q}>");
+    storage.set_string("cycle", "q", "(${p})");
+    storage.set_string("cycle", "self", "${self}!");
+    CHECK(storage.get_expanded_string("cycle", "p").second == "<(${p})>");
+    CHECK(storage.get_expanded_string("cycle", "q").second == "(<${q}>)");
+    CHECK(storage.get_expanded_string("cycle", "self").second == "${self}!");
+    storage.set_string("cycle", "q", "fixed");
+    CHECK(storage.get_expanded_string("cycle", "p").second == "<fixed>");
+
+    Storage chain;
+    for (int i = 0; i != 100; ++i)
+        chain.set_string("d", "k" + std::to_string(i), "${k" + std::to_string(i + 1) + "}");
+    chain.set_string("d", "k100", "end");
+    CHECK(chain.get_expanded_string("d", "k0").second == "${k64}");
+    CHECK(chain.get_expanded_string("d", "k37").second == "end");
+}
+
+/// rejects the change of one key
+class RejectKey : public Storage::Validator
+{
+public:
+    RejectKey(const std::string &key)
+        : Validator()
+        , m_key(key)
+    {}
+
+    virtual bool validate(const Storage::Change &change, const Storage::Values *)
+    {
+        return change.key != m_key;
+    }
+
+private:
+    std::string m_key;
+};
+
+/// counts the observer calls and the changes they reported
+class ChangeCounter : public Storage::Observer
+{
+public:
+    ChangeCounter()
+        : Observer()
+        , calls(0)
+        , changes(0)
+    {}
+
+    virtual void changed(const Storage::Changes &changes)
+    {
+        ++calls;
+        this->changes += changes.size();
+    }
+
+    size_t calls;
+    size_t changes;
+};
+
+static std::string locations(const Storage &storage, const std::string &value)
+{
+    Storage::Locations found = storage.find_value(value);
+    std::string result;
+    for (size_t i = 0; i != found.size(); ++i)
+        result += found[i].section + "/" + found[i].key + ";";
+    return result;
+}
+
+/// a rejected commit leaves the content, the value index and the expansions as they were and tells nobody,
+/// an accepted one takes the last change of a key, drops the emptied sections and tells the observer once
+static void test_transaction()
+{
+    std::string text = "[a]\nref = ${b:z}\nx = 1\n[b]\nz = 3\n[e]\nonly = 1\n";
+    Storage storage;
+    CHECK(storage.parse(text));
+    ChangeCounter counter;
+    storage.set_observer(&counter);
+    CHECK(locations(storage, "1") == "a/x;e/only;");
+    CHECK(storage.get_expanded_string("a", "ref").second == "3");
+
+    Storage::Transaction rejected(storage);
+    rejected.set_string("a", "x", "9");
+    rejected.remove_key("b", "z");
+    rejected.remove_key("e", "only");
+    rejected.set_string("new", "k", "1");
+    rejected.set_string("zz", "reject", "1");
+    RejectKey reject("reject");
+    CHECK(!rejected.commit(&reject));
+    CHECK(!rejected.size());
+    Storage original;
+    CHECK(original.parse(text));
+    CHECK(storage.generate() == original.generate());
+    CHECK(locations(storage, "1") == "a/x;e/only;");
+    CHECK(locations(storage, "9") == "");
+    CHECK(storage.get_expanded_string("a", "ref").second == "3");
+    CHECK(!counter.calls);
+
+    Storage::Transaction accepted(storage);
+    accepted.set_string("a", "x", "5");
+    accepted.remove_key("b", "z");
+    accepted.remove_key("e", "only");
+    accepted.set_string("n", "k", "1");
+    accepted.set_string("a", "x", "6");
+    CHECK(accepted.commit());
+    CHECK((counter.calls == 1) && (counter.changes == 4));
+    CHECK(storage.get_string("a", "x").second == "6");
+    CHECK(!storage.is_section_exist("b") && !storage.is_section_exist("e"));
+    CHECK(locations(storage, "1") == "n/k;");
+    CHECK(locations(storage, "6") == "a/x;");
+    CHECK(storage.get_expanded_string("a", "ref").second == "${b:z}");
+    storage.set_observer(0);
+}
+
+/// the reverse index follows set_values(), remove_key(), rename_key(), rename_section() and clear(), also once dropped
+static void test_value_index()
+{
+    for (int enabled = 0; enabled != 2; ++enabled)
+    {
+        Storage storage;
+        CHECK(storage.parse("[a]\nx = v, w, v\ny = v\n[b]\nz = w\n"));
+        storage.set_value_index(enabled != 0);
+        CHECK(locations(storage, "v") == "a/x;a/x;a/y;");
+        CHECK(storage.find_value("v")[1].index == 2);
+
+        Storage::Values values;
+        values.push_back(std::string("w"));
+        values.push_back(std::string("v"));
+        storage.set_values("a", "x", values);
+        CHECK(locations(storage, "v") == "a/x;a/y;");
+        CHECK(locations(storage, "w") == "a/x;b/z;");
+
+        CHECK(storage.remove_key("a", "y"));
+        CHECK(locations(storage, "v") == "a/x;");
+        CHECK(storage.rename_key("a", "x", "c", "moved"));
+        CHECK(locations(storage, "v") == "c/moved;");
+        CHECK(storage.rename_section("b", "d"));
+        CHECK(locations(storage, "w") == "c/moved;d/z;");
+
+        storage.clear();
+        CHECK(locations(storage, "w") == "");
+        storage.set_string("e", "k", "w");
+        CHECK(locations(storage, "w") == "e/k;");
+    }
+}
+
+/// OPTION__UTF8 takes well-formed UTF-8 values and writes them back raw, malformed sequences fail the parse either way
+static void test_utf8()
+{
+    std::string value = "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 long enough for the vector path";
+    std::string text = "[s]\nk = " + value + "\n";
+
+    Storage utf8(Storage::OPTION__UTF8);
+    CHECK(utf8.parse(text));
+    CHECK(utf8.get_string("s", "k").second == value);
+    CHECK(utf8.generate() == "[s]\nk=" + value + "\n\n");
+    CHECK(utf8.contains_binary("s", "k"));
+    CHECK(!utf8.contains_binary_utf8("s", "k"));
+
+    Storage reparsed(Storage::OPTION__UTF8);
+    CHECK(reparsed.parse(utf8.generate()));
+    CHECK(reparsed.get_string("s", "k").second == value);
+
+    Storage plain;
+    CHECK(!plain.parse(text));
+    plain.set_string("s", "k", "caf\xc3\xa9");
+    CHECK(plain.generate() == "[s]\nk=caf\\xC3\\xA9\n\n");
+
+    const char *malformed[] = {
+        "\xc0\x80",                                    // overlong
+        "\xed\xa0\x80",                                // surrogate
+        "ab\xe2\x82",                                  // cut short
+        "\xf4\x90\x80\x80",                            // beyond U+10FFFF
+        "0123456789abcdef0123456789abcdef\xc3\xa9\xff"  // past the vector blocks
+    };
+    for (size_t i = 0; i != sizeof(malformed) / sizeof(malformed[0]); ++i)
+    {
+        Storage storage(Storage::OPTION__UTF8);
+        CHECK(!storage.parse(std::string("[s]\nk = ") + malformed[i] + "\n"));
+    }
+}
+
+/// generate_parallel() writes what generate() does for any number of threads, an ordered storage in its own order
+static void test_generate_parallel()
+{
+    std::string directory = scratch("generate_parallel");
+    Storage storage;
+    Storage ordered(Storage::OPTION__ORDERED);
+    for (int i = 0; i != 2000; ++i)
+    {
+        std::string section = "s" + std::to_string((i * 7919) % 2000);
+        std::string value = std::string(i % 97, 'x') + " \"quoted\"";
+        storage.set_string(section, "k", value);
+        ordered.set_string(section, "k", value);
+        if (!(i % 5))
+        {
+            storage.set_string(section, "extra", "1");
+            ordered.set_string(section, "extra", "1");
+        }
+    }
+
+    std::string text = storage.generate();
+    unsigned threads[] = { 0, 1, 2, 3, 8, 64 };
+    for (size_t i = 0; i != sizeof(threads) / sizeof(threads[0]); ++i)
+        CHECK(storage.generate_parallel(threads[i]) == text);
+
+    std::string ordered_text = ordered.generate();
+    CHECK(ordered_text != text);
+    CHECK(ordered.generate_parallel(4) == ordered_text);
+
+    CHECK(storage.save_parallel(directory + "a.ini", 4));
+    CHECK(read_text(directory + "a.ini") == text);
+
+    Storage empty;
+    CHECK(empty.generate_parallel(4) == "");
+}
+
+/// loads on the pool queued before the prefetches of their files do not wait for them, and a prefetched file that
+/// changed since is read again
+static void test_prefetch_load_async()
+{
+    std::string directory = scratch("prefetch");
+    std::string big_path = directory + "big.ini";
+    std::string big;
+    for (int i = 0; i != 200000; ++i)
+        big += "[s" + std::to_string(i % 1000) + "]\nk" + std::to_string(i) + "=value\n";
+    write_text(big_path, big);
+
+    // keeps the pool busy until the loads and the prefetches behind them are all queued
+    std::vector<Storage> busy(8);
+    std::vector<std::future<bool> > busy_loads;
+    for (size_t i = 0; i != busy.size(); ++i)
+        busy_loads.push_back(busy[i].load_async(big_path));
+
+    std::vector<std::string> paths;
+    for (int i = 0; i != 8; ++i)
+    {
+        paths.push_back(directory + "f" + std::to_string(i) + ".ini");
+        write_text(paths.back(), "[s]\nk=" + std::to_string(i) + "\n");
+    }
+
+    std::vector<Storage> storages(paths.size());
+    std::vector<std::future<bool> > loads;
+    for (size_t i = 0; i != paths.size(); ++i)
+        loads.push_back(storages[i].load_async(paths[i]));
+    Storage::prefetch(paths);
+
+    for (size_t i = 0; i != loads.size(); ++i)
+    {
+        if (loads[i].wait_for(std::chrono::seconds(60)) != std::future_status::ready)
+        {
+            fprintf(stderr, "%s:%d: load_async() of a prefetched file hangs\n", __FILE__, __LINE__);
+            _exit(EXIT_FAILURE);
+        }
+        CHECK(loads[i].get());
+        CHECK(storages[i].get_string("s", "k").second == std::to_string(i));
+    }
+    for (size_t i = 0; i != busy_loads.size(); ++i)
+        CHECK(busy_loads[i].get());
+
+    std::string path = directory + "changed.ini";
+    write_text(path, "[s]\nk=1\n");
+    Storage::prefetch(std::vector<std::string>(1, path));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    write_text(path, "[s]\nk=22\n");
+
+    Storage storage;
+    CHECK(storage.load(path));
+    CHECK(storage.get_string("s", "k").second == "22");
+    Storage::cancel_prefetch();
+}
+
+/// Snapshot::parse() tells the exact buffer size it needs, fails on a smaller buffer and never touches the heap
+static void test_snapshot_parse_heap_free()
+{
+    std::string text = "[server]\nhost = example\nport = 80\npeers = a, \"b c\", \\x41\n[client]\nretries = 3\n";
+
+    size_t required = 0;
+    Snapshot snapshot;
+    CHECK(!snapshot.parse(text.data(), text.size(), 0, 0, required));
+    CHECK(required > 0);
+
+    std::vector<uint64_t> buffer((required + sizeof(uint64_t) - 1) / sizeof(uint64_t) + 1);
+    char *data = reinterpret_cast<char *>(buffer.data());
+    size_t smaller = required - 1;
+    CHECK(!snapshot.parse(text.data(), text.size(), data, smaller, required));
+    CHECK(required == smaller + 1);
+
+    uint64_t before = allocations.load();
+    CHECK(snapshot.parse(text.data(), text.size(), data, required, required));
+    const char *value = 0;
+    size_t size = 0;
+    CHECK(snapshot.get_raw("server", "peers", 2, value, size));
+    CHECK(allocations.load() == before);
+    CHECK(std::string(value, size) == "A");
+    CHECK(snapshot.get_string("client", "retries").second == "3");
+
+    CHECK(!snapshot.parse("[broken\n", 8, data, required, required));
+}
+
+/// the number of records in the journal file, walking their headers
+static size_t journal_records(const std::string &path)
+{
+    std::string data = read_text(path);
+
+    size_t count = 0;
+    for (size_t offset = 8; offset + 16 <= data.size(); ++count)
+    {
+        uint32_t size;
+        memcpy(&size, data.data() + offset, sizeof(size));
+        offset += 16 + size;
+    }
+    return count;
+}
+
+/// a subtree goes to the journal as one record and only the sections that were there are counted
+static void test_journal_remove_subtree()
+{
+    std::string directory = scratch("journal_subtree");
+    std::string path = directory + "a.ini";
+
+    for (int indexed = 0; indexed != 2; ++indexed)
+    {
+        unlink(path.c_str());
+        unlink((path + ".journal").c_str());
+
+        Storage storage;
+        storage.set_hierarchy_index(indexed);
+        CHECK(storage.open_journal(path, 0, 0));
+        storage.set_string("a", "k", "1");
+        storage.set_string("a.b", "k", "2");
+        storage.set_string("a.b.c", "k", "3");
+        storage.set_string("q.r", "k", "4");
+        storage.set_string("x", "k", "5");
+        CHECK(journal_records(path + ".journal") == 5);
+
+        CHECK(storage.remove_subtree("a") == 3);
+        CHECK(journal_records(path + ".journal") == 6);
+        CHECK(storage.remove_subtree("q") == 1);
+        CHECK(storage.remove_subtree("missing") == 0);
+        CHECK(journal_records(path + ".journal") == 7);
+        CHECK(storage.close_journal());
+
+        Storage reopened;
+        CHECK(reopened.open_journal(path, 0, 0));
+        CHECK((reopened.get_all_sections().size() == 1) && reopened.is_section_exist("x"));
+        CHECK(reopened.close_journal());
+    }
+}
+
+/// a record is replayed like its change was made, so a section that a commit emptied and refilled keeps its spelling
+static void test_journal_replay_case()
+{
+    std::string directory = scratch("journal_replay_case");
+    std::string path = directory + "a.ini";
+    unlink(path.c_str());
+    unlink((path + ".journal").c_str());
+
+    Storage storage(Storage::OPTION__CASE_INSENSITIVE);
+    CHECK(storage.open_journal(path, 0, 0));
+    Storage::Transaction first(storage);
+    first.set_string("A.B", "w", "1");
+    CHECK(first.commit(0));
+    Storage::Transaction second(storage);
+    second.set_string("a.B", "x", "2");
+    second.remove_key("a.B", "W");
+    CHECK(second.commit(0));
+    CHECK((storage.get_all_sections().size() == 1) && (*storage.get_all_sections().begin() == "A.B"));
+    std::string text = storage.generate();
+    CHECK(storage.close_journal());
+
+    Storage reopened(Storage::OPTION__CASE_INSENSITIVE);
+    CHECK(reopened.open_journal(path, 0, 0));
+    CHECK(reopened.generate() == text);
+    CHECK(reopened.compact_journal());
+    CHECK(reopened.close_journal());
+
+    Storage compacted(Storage::OPTION__CASE_INSENSITIVE);
+    CHECK(compacted.open_journal(path, 0, 0));
+    CHECK(compacted.generate() == text);
+    CHECK(compacted.close_journal());
+}
+
+static size_t sum_of_parts(const Storage::MemoryUsage &usage)
+{
+    return usage.name_bytes + usage.value_bytes + usage.overhead_bytes + usage.slack_bytes + usage.index_bytes;
+}
+
+/// the usage grows with the content, and the slack left by overwritten values is what shrink_to_fit() releases
+static void test_memory_usage_shrink()
+{
+    Storage storage;
+    Storage::MemoryUsage empty = storage.memory_usage();
+    CHECK(empty.total_bytes == sum_of_parts(empty));
+    CHECK(!empty.name_bytes && !empty.value_bytes && !empty.slack_bytes);
+
+    std::string name(40, 'n');
+    storage.set_string(name, "k", std::string(200, 'x'));
+    Storage::Values list;
+    for (int i = 0; i != 4; ++i)
+        list += Storage::Value(std::string(32, 'y'));
+    storage.set_values(name, "list", list);
+    Storage::MemoryUsage full = storage.memory_usage();
+    CHECK(full.total_bytes == sum_of_parts(full));
+    CHECK(full.name_bytes >= name.length());
+    CHECK(full.value_bytes == 200 + 4 * 32);
+    CHECK(full.block_count > empty.block_count);
+    CHECK(!full.slack_bytes);
+    CHECK(!storage.shrink_to_fit());
+
+    storage.set_string(name, "k", "short");
+    storage.set_values(name, "list", Storage::Values(Storage::Value(std::string(32, 'y'))));
+    Storage::MemoryUsage overwritten = storage.memory_usage();
+    CHECK(overwritten.total_bytes == sum_of_parts(overwritten));
+    CHECK(overwritten.value_bytes == 5 + 32);
+    CHECK(overwritten.slack_bytes >= 195 + 3 * sizeof(Storage::Value));
+
+    size_t released = storage.shrink_to_fit();
+    Storage::MemoryUsage shrunk = storage.memory_usage();
+    CHECK(released == overwritten.slack_bytes - shrunk.slack_bytes);
+    CHECK(shrunk.total_bytes == overwritten.total_bytes - released);
+    CHECK(!shrunk.slack_bytes);
+    CHECK(!storage.shrink_to_fit());
+    CHECK(storage.get_string(name, "k").second == "short");
+    CHECK(storage.get_values(name, "list").second.size() == 1);
+
+    Storage ordered(Storage::OPTION__ORDERED);
+    ordered.set_string(name, "k", "short");
+    CHECK(ordered.memory_usage().index_bytes > storage.memory_usage().index_bytes);
+}
+
+/// a rejected commit of an ordered storage leaves the order of the sections and keys as it was
+static void test_ordered_rejected_commit()
+{
+    Storage storage(Storage::OPTION__ORDERED);
+    CHECK(storage.parse("[s]\nfirst = 1\nsecond = 2\n"));
+    std::string text = storage.generate();
+
+    Storage::Transaction remove(storage);
+    remove.remove_key("s", "first");
+    remove.set_string("s", "third", "3");
+    RejectKey reject_third("third");
+    CHECK(!remove.commit(&reject_third));
+    CHECK(storage.generate() == text);
+
+    CHECK(storage.parse("[z]\nk = 1\nk2 = 2\n[s]\nfirst = 1\nsecond = 2\nthird = 3\n[t]\nk = 1\n[a]\nk = 1\n"));
+    storage.remove_key("s", "third");
+    text = storage.generate();
+
+    Storage::Transaction changes(storage);
+    changes.remove_key("s", "first");
+    changes.remove_key("s", "second");
+    changes.remove_key("t", "k");
+    changes.set_string("u", "new", "1");
+    changes.set_string("z", "k", "2");
+    RejectKey reject_z("k2");
+    changes.remove_key("z", "k2");
+    CHECK(!changes.commit(&reject_z));
+    CHECK(storage.generate() == text);
+
+    // the tombstones left behind still close up right
+    storage.remove_key("s", "first");
+    storage.remove_key("t", "k");
+    storage.set_string("s", "fourth", "4");
+    Storage expected(Storage::OPTION__ORDERED);
+    CHECK(expected.parse("[z]\nk = 1\nk2 = 2\n[s]\nsecond = 2\nfourth = 4\n[a]\nk = 1\n"));
+    CHECK(storage.generate() == expected.generate());
+}
+
+
+/// an ordered storage reopened from its journal, and from the compacted file, keeps the order it had
+static void test_ordered_journal_replay()
+{
+    std::string directory = scratch("ordered_journal");
+    std::string path = directory + "a.ini";
+    unlink(path.c_str());
+    unlink((path + ".journal").c_str());
+
+    Storage storage(Storage::OPTION__ORDERED);
+    CHECK(storage.open_journal(path, 0, 0));
+    storage.set_string("b", "y", "1");
+    storage.set_string("b", "x", "2");
+    storage.set_string("a", "x", "3");
+    CHECK(storage.rename_section("b", "c"));
+
+    // the commit empties [A] and fills it again, it stays in front of [a-B]
+    storage.set_string("A", "X", "4");
+    storage.set_string("a-B", "X", "5");
+    Storage::Transaction refill(storage);
+    refill.remove_key("A", "X");
+    refill.set_string("A", "w", "6");
+    CHECK(refill.commit(0));
+
+    std::string text = storage.generate();
+    CHECK(text == "[c]\ny=1\nx=2\n\n[a]\nx=3\n\n[A]\nw=6\n\n[a-B]\nX=5\n\n");
+    CHECK(storage.close_journal());
+
+    Storage reopened(Storage::OPTION__ORDERED);
+    CHECK(reopened.open_journal(path, 0, 0));
+    CHECK(reopened.generate() == text);
+    CHECK(reopened.compact_journal());
+    CHECK(read_text(path) == text);
+
+    // a rename already in the base replays to the same content
+    reopened.set_string("c", "z", "7");
+    CHECK(reopened.rename_section("c", "d"));
+    reopened.set_string("c", "y", "8");
+    text = reopened.generate();
+    CHECK(reopened.close_journal());
+    rename((path + ".journal").c_str(), (path + ".journal.old").c_str());
+    CHECK(reopened.save(path));
+
+    Storage recovered(Storage::OPTION__ORDERED);
+    CHECK(recovered.open_journal(path, 0, 0));
+    CHECK(recovered.get_all_keys("c") == reopened.get_all_keys("c"));
+    CHECK(recovered.get_all_keys("d") == reopened.get_all_keys("d"));
+    CHECK(recovered.get_all_sections() == reopened.get_all_sections());
+    CHECK(recovered.close_journal());
+}
+
+int main()
+{
+    test_sinks();
+    test_encoders();
+    test_save();
+    test_load_sizes();
+    test_load_cached_fast_path();
+    test_shared_orphan_segment();
+    test_shared_republish();
+    test_get_batch();
+    test_prefix_range_visits();
+    test_hierarchy();
+    test_parse_result();
+    test_access_stats_threads_forget();
+    test_load_directory();
+    test_case_insensitive();
+    test_expansion();
+    test_transaction();
+    test_value_index();
+    test_utf8();
+    test_generate_parallel();
+    test_prefetch_load_async();
+    test_snapshot_parse_heap_free();
+    test_journal_remove_subtree();
+    test_journal_replay_case();
+    test_memory_usage_shrink();
+    test_ordered_rejected_commit();
+    test_ordered_journal_replay();
+
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*************
+**
+** Project:      inixx
+** Author:       Copyright (C) 2013 Kuzma Shapran <Kuzma.Shapran@gmail.com>
+** License:      LGPLv2.1+
+**
+** Description: inixx is a cross-platform C++ library that provides
+** the simplest support of INI files.
+**
+** This program or library is free software; you can redistribute it
+** and/or modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General
+** Public License along with this library; if not, write to the
+** Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+** Boston, MA 02110-1301 USA
+**
+*************/
+
+/*  Tests of the C++20 headers, built only by a compiler that takes C++20. The compile-time parts are static_asserts,
+ *  so most of the test is that this file compiles at all.
+ */
+
+#include "iniplus_schema.hpp"
+#include "iniplus_static.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+using namespace iniplus;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++failures; \
+        } \
+    } while (0)
+
+
+/// the table is parsed at compile time and layers under a loaded storage
+static void test_static_storage()
+{
+    static constexpr StaticStorage<
+        "[server]\n"
+        "host = localhost\n"
+        "port = 80\n"
+        "peers = a, b\n"
+    > defaults;
+
+    static_assert(defaults.is_section_exist("server"));
+    static_assert(defaults.get_view("server", "port").second == "80");
+    static_assert(defaults.is_list("server", "peers"));
+    static_assert(!defaults.is_key_exist("server", "user"));
+
+    CHECK(defaults.get_string("server", "host").second == "localhost");
+    CHECK(defaults.get_values("server", "peers").second.size() == 2);
+
+    Storage storage;
+    CHECK(storage.parse("[server]\nport = 8080\n"));
+    defaults.apply_defaults(storage);
+    CHECK(storage.get_string("server", "port").second == "8080");
+    CHECK(storage.get_string("server", "host").second == "localhost");
+}
+
+struct Server
+{
+    std::string host = "localhost";
+    int port = 80;
+    bool verbose = false;
+    std::vector<std::string> peers;
+};
+
+typedef Schema<Server,
+    Field<"server", "host", &Server::host>,
+    Field<"server", "port", &Server::port, FIELD_FLAG__REQUIRED>,
+    Field<"server", "verbose", &Server::verbose>,
+    Field<"server", "peers", &Server::peers>
+> ServerSchema;
+
+/// the fields convert, the members of missing and invalid entries keep their values, the issues tell which
+static void test_schema()
+{
+    Server server;
+    SchemaIssues issues;
+    CHECK(ServerSchema::parse("[server]\nport = 8080\nverbose = yes\npeers = a, b\n", server, &issues));
+    CHECK(issues.empty());
+    CHECK(server.host == "localhost");
+    CHECK(server.port == 8080);
+    CHECK(server.verbose);
+    CHECK(server.peers.size() == 2);
+
+    Server other;
+    CHECK(!ServerSchema::parse("[server]\nhost = example\nverbose = maybe\ntypo = 1\n", other, &issues));
+    CHECK(other.host == "example");
+    CHECK(other.port == 80);
+    CHECK(!other.verbose);
+    CHECK(issues.size() == 3);
+}
+
+
+int main()
+{
+    test_static_storage();
+    test_schema();
+
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}